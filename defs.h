@@ -4,4 +4,19 @@
 #define LIB_SRC "lib_src.dll"
 #define LIB_SRC_TEMP "lib_src_temp.dll"
 
+// The exe and the lib both see structs sized by these, so they live here rather than prg.h
+#define MAX_THREADS 2 /* 1 == only main thread */
+#define MT 0
+#define WT 1 /* builds the next frame while the main thread submits the current one */
+
+#ifdef _MSC_VER
+#define thread_persist __declspec(thread)
+#else
+#define thread_persist _Thread_local
+#endif
+
+#ifdef LIB
+extern thread_persist u32 prg_ti; // index of the calling thread into per thread arrays
+#endif
+
 #endif //DEFS_H
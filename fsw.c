@@ -0,0 +1,340 @@
+#include "fsw.h"
+#include "prg.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+internal char *fsw_uris[FSW_FILE_CNT] = {
+    [FSW_LIB] = LIB_SRC_TEMP, // what the build writes, load_lib copies it over LIB_SRC itself
+    [FSW_SH] = SH_SRC_URI,
+    [FSW_WORLD] = WORLD_FILE_URI,
+};
+
+internal void fsw_post(u32 file)
+{
+    SDL_Event e = {.type = prg->fsw.event};
+    e.user.code = file;
+    if (SDL_PushEvent(&e) < 0)
+        log_error("Failed to post change to %s - %s", fsw_uris[file], SDL_GetError());
+}
+
+internal char* fsw_base(u32 file)
+{
+    char *s = SDL_strrchr(fsw_uris[file], '/');
+    return s ? s + 1 : fsw_uris[file];
+}
+
+internal void fsw_dir(u32 file, char *dir, u64 size)
+{
+    char *s = SDL_strrchr(fsw_uris[file], '/');
+    if (s)
+        SDL_strlcpy(dir, fsw_uris[file], (u64)(s - fsw_uris[file]) + 1 < size ? (u64)(s - fsw_uris[file]) + 1 : size);
+    else
+        SDL_strlcpy(dir, ".", size);
+}
+
+// 0 == missing
+internal u64 fsw_mtime(char *uri)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA a;
+    if (!GetFileAttributesExA(uri, GetFileExInfoStandard, &a))
+        return 0;
+    return (u64)a.ftLastWriteTime.dwHighDateTime << 32 | a.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat s;
+    return stat(uri, &s) ? 0 : (u64)s.st_mtime;
+#endif
+}
+
+// No native watcher: poll modification times. A file counts as changed once its time has
+// moved and then held still for FSW_DEBOUNCE_MS, and each change is posted once.
+internal int fsw_poll_thread(void *arg)
+{
+    u32 due[FSW_FILE_CNT] = {}; // when a file counts as changed, 0 == not pending
+    
+    while(!SDL_AtomicGet(&prg->fsw.quit)) {
+        u32 now = SDL_GetTicks();
+        for(u32 i=0; i < FSW_FILE_CNT; ++i) {
+            u64 t = fsw_mtime(fsw_uris[i]);
+            if (t != prg->fsw.mtime[i]) {
+                prg->fsw.mtime[i] = t;
+                due[i] = (now + FSW_DEBOUNCE_MS) | 1;
+            } else if (due[i] && (s32)(due[i] - now) <= 0) {
+                fsw_post(i);
+                due[i] = 0;
+            }
+        }
+        SDL_Delay(FSW_POLL_MS);
+    }
+    return 0;
+}
+
+#ifdef __linux__
+
+// Watches are on directories rather than the files themselves, as compilers and editors
+// tend to replace a file instead of writing to it, which would end a watch on the file.
+internal int fsw_inotify_thread(void *arg)
+{
+    u32 due[FSW_FILE_CNT] = {}; // when a file counts as changed, 0 == not pending
+    char buf[kb(4)] __attribute__((aligned(__alignof__(struct inotify_event))));
+    
+    while(!SDL_AtomicGet(&prg->fsw.quit)) {
+        u32 now = SDL_GetTicks();
+        int timeout = -1;
+        for(u32 i=0; i < FSW_FILE_CNT; ++i) {
+            if (!due[i])
+                continue;
+            if ((s32)(due[i] - now) <= 0) {
+                fsw_post(i);
+                due[i] = 0;
+            } else if (timeout < 0 || (s32)(due[i] - now) < timeout) {
+                timeout = (s32)(due[i] - now);
+            }
+        }
+        
+        struct pollfd p[] = {
+            {.fd = prg->fsw.fd, .events = POLLIN},
+            {.fd = prg->fsw.wake[0], .events = POLLIN},
+        };
+        if (poll(p, cl_array_size(p), timeout) <= 0 || p[1].revents)
+            continue;
+        
+        ssize_t n = read(prg->fsw.fd, buf, sizeof(buf));
+        for(ssize_t i=0; i < n;) {
+            struct inotify_event *e = (struct inotify_event*)(buf + i);
+            for(u32 j=0; e->len && j < FSW_FILE_CNT; ++j) {
+                if (e->wd == prg->fsw.wd[j] && !SDL_strcmp(e->name, fsw_base(j)))
+                    due[j] = (SDL_GetTicks() + FSW_DEBOUNCE_MS) | 1;
+            }
+            i += sizeof(*e) + e->len;
+        }
+    }
+    return 0;
+}
+
+internal int fsw_watch(void)
+{
+    prg->fsw.fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (prg->fsw.fd < 0) {
+        log_error("Failed to create inotify instance, polling for file changes instead");
+        return -1;
+    }
+    if (pipe(prg->fsw.wake) || fcntl(prg->fsw.wake[0], F_SETFL, O_NONBLOCK)) {
+        log_error("Failed to create file watcher wake pipe, polling for file changes instead");
+        close(prg->fsw.fd);
+        prg->fsw.fd = -1;
+        return -1;
+    }
+    
+    for(u32 i=0; i < FSW_FILE_CNT; ++i) {
+        char dir[256];
+        fsw_dir(i, dir, sizeof(dir));
+        
+        // the same directory just hands back the same watch
+        prg->fsw.wd[i] = inotify_add_watch(prg->fsw.fd, dir, IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE);
+        if (prg->fsw.wd[i] < 0)
+            log_error("Failed to watch %s, changes to %s will be missed", dir, fsw_uris[i]);
+    }
+    return 0;
+}
+
+#endif // __linux__
+
+#ifdef _WIN32
+
+#define FSW_RDCW_FILTER (FILE_NOTIFY_CHANGE_FILE_NAME|FILE_NOTIFY_CHANGE_LAST_WRITE)
+
+internal bool fsw_name_is(FILE_NOTIFY_INFORMATION *n, char *name)
+{
+    u32 len = n->FileNameLength / sizeof(WCHAR);
+    if (len != SDL_strlen(name))
+        return false;
+    for(u32 i=0; i < len; ++i) {
+        if (n->FileName[i] != (WCHAR)(u8)name[i])
+            return false;
+    }
+    return true;
+}
+
+// One overlapped ReadDirectoryChangesW per file, on the directory for the same reason as the
+// inotify watches, and debounced the same way.
+internal int fsw_rdcw_thread(void *arg)
+{
+    u32 due[FSW_FILE_CNT] = {}; // when a file counts as changed, 0 == not pending
+    DWORD buf[FSW_FILE_CNT][kb(4) / sizeof(DWORD)]; // notify records are dword aligned
+    OVERLAPPED ov[FSW_FILE_CNT] = {};
+    
+    HANDLE wait[FSW_FILE_CNT + 1] = {prg->fsw.wake_ev};
+    u32 file[FSW_FILE_CNT + 1]; // wait slot to enum fsw_files
+    u32 cnt = 1;
+    
+    for(u32 i=0; i < FSW_FILE_CNT; ++i) {
+        if (!prg->fsw.dir[i])
+            continue;
+        ov[i].hEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+        if (!ov[i].hEvent || !ReadDirectoryChangesW(prg->fsw.dir[i], buf[i], sizeof(buf[i]), FALSE, FSW_RDCW_FILTER, NULL, &ov[i], NULL)) {
+            log_error("Failed to watch the directory of %s, changes to it will be missed", fsw_uris[i]);
+            if (ov[i].hEvent)
+                CloseHandle(ov[i].hEvent);
+            continue;
+        }
+        file[cnt] = i;
+        wait[cnt++] = ov[i].hEvent;
+    }
+    
+    while(!SDL_AtomicGet(&prg->fsw.quit)) {
+        u32 now = SDL_GetTicks();
+        DWORD timeout = INFINITE;
+        for(u32 i=0; i < FSW_FILE_CNT; ++i) {
+            if (!due[i])
+                continue;
+            if ((s32)(due[i] - now) <= 0) {
+                fsw_post(i);
+                due[i] = 0;
+            } else if (timeout == INFINITE || (DWORD)(due[i] - now) < timeout) {
+                timeout = due[i] - now;
+            }
+        }
+        
+        DWORD r = WaitForMultipleObjects(cnt, wait, FALSE, timeout);
+        if (r <= WAIT_OBJECT_0 || r >= WAIT_OBJECT_0 + cnt)
+            continue;
+        
+        u32 i = file[r - WAIT_OBJECT_0];
+        DWORD n = 0;
+        if (GetOverlappedResult(prg->fsw.dir[i], &ov[i], &n, FALSE) && !n)
+            due[i] = (SDL_GetTicks() + FSW_DEBOUNCE_MS) | 1; // too much at once to record, could be anything
+        
+        for(FILE_NOTIFY_INFORMATION *e = (FILE_NOTIFY_INFORMATION*)buf[i]; n;) {
+            if (fsw_name_is(e, fsw_base(i)))
+                due[i] = (SDL_GetTicks() + FSW_DEBOUNCE_MS) | 1;
+            if (!e->NextEntryOffset)
+                break;
+            e = (FILE_NOTIFY_INFORMATION*)((u8*)e + e->NextEntryOffset);
+        }
+        
+        if (!ReadDirectoryChangesW(prg->fsw.dir[i], buf[i], sizeof(buf[i]), FALSE, FSW_RDCW_FILTER, NULL, &ov[i], NULL))
+            log_error("Failed to keep watching the directory of %s, changes to it will be missed", fsw_uris[i]);
+    }
+    
+    // a read left pending would complete into this stack frame after the thread is gone
+    for(u32 j=1; j < cnt; ++j) {
+        u32 i = file[j];
+        DWORD n;
+        CancelIoEx(prg->fsw.dir[i], &ov[i]);
+        GetOverlappedResult(prg->fsw.dir[i], &ov[i], &n, TRUE);
+        CloseHandle(ov[i].hEvent);
+    }
+    return 0;
+}
+
+internal int fsw_watch(void)
+{
+    prg->fsw.wake_ev = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (!prg->fsw.wake_ev) {
+        log_error("Failed to create file watcher wake event, polling for file changes instead");
+        return -1;
+    }
+    
+    for(u32 i=0; i < FSW_FILE_CNT; ++i) {
+        char dir[256];
+        fsw_dir(i, dir, sizeof(dir));
+        
+        HANDLE h = CreateFileA(dir, FILE_LIST_DIRECTORY, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS|FILE_FLAG_OVERLAPPED, NULL);
+        if (h == INVALID_HANDLE_VALUE) {
+            log_error("Failed to watch %s, changes to %s will be missed", dir, fsw_uris[i]);
+            continue;
+        }
+        prg->fsw.dir[i] = h;
+    }
+    return 0;
+}
+
+#endif // _WIN32
+
+/**************************************************************************/
+// Header functions
+
+def_create_fsw(create_fsw)
+{
+    prg->fsw.event = SDL_RegisterEvents(1);
+    if (prg->fsw.event == (u32)-1) {
+        log_error("Failed to register file change event, hot reloading is off - %s", SDL_GetError());
+        prg->fsw.event = 0;
+        return -1;
+    }
+    
+    prg->fsw.fd = -1;
+    for(u32 i=0; i < FSW_FILE_CNT; ++i)
+        prg->fsw.mtime[i] = fsw_mtime(fsw_uris[i]);
+    
+#if defined(__linux__) || defined(_WIN32)
+    fsw_watch();
+#endif
+    return fsw_start();
+}
+
+def_fsw_start(fsw_start)
+{
+    if (prg->fsw.thread || !prg->fsw.event)
+        return 0;
+    
+    SDL_AtomicSet(&prg->fsw.quit, 0);
+    SDL_ThreadFunction fn = fsw_poll_thread;
+#ifdef __linux__
+    if (prg->fsw.fd >= 0)
+        fn = fsw_inotify_thread;
+#elif defined(_WIN32)
+    if (prg->fsw.wake_ev)
+        fn = fsw_rdcw_thread;
+#endif
+    prg->fsw.thread = SDL_CreateThread(fn, "fsw", NULL);
+    if (!prg->fsw.thread) {
+        log_error("Failed to create file watcher thread - %s", SDL_GetError());
+        return -1;
+    }
+    return 0;
+}
+
+def_fsw_stop(fsw_stop)
+{
+    if (!prg->fsw.thread)
+        return;
+    
+    SDL_AtomicSet(&prg->fsw.quit, 1);
+#ifdef __linux__
+    if (prg->fsw.fd >= 0 && write(prg->fsw.wake[1], "", 1) != 1)
+        log_error("Failed to wake file watcher");
+#elif defined(_WIN32)
+    if (prg->fsw.wake_ev && !SetEvent(prg->fsw.wake_ev))
+        log_error("Failed to wake file watcher");
+#endif
+    SDL_WaitThread(prg->fsw.thread, NULL);
+    prg->fsw.thread = NULL;
+
+#ifdef __linux__
+    // drain the wake so the next start does not see it
+    char c;
+    if (prg->fsw.fd >= 0)
+        while(read(prg->fsw.wake[0], &c, 1) == 1);
+#endif
+}
+
+def_fsw_take(fsw_take)
+{
+    u32 changed = prg->fsw.changed;
+    prg->fsw.changed = 0;
+    return changed;
+}
@@ -0,0 +1,57 @@
+#ifndef FSW_H
+#define FSW_H
+
+#include "SDL2/SDL.h"
+
+#include "../solh/sol.h"
+
+#define FSW_DEBOUNCE_MS 100 /* quiet time after the last write to a file before it counts as changed */
+#define FSW_POLL_MS 500 /* modification time polling interval where there is no native watcher */
+
+// Files the watcher reports changes to
+enum fsw_files {
+    FSW_LIB,
+    FSW_SH,
+    FSW_WORLD,
+    FSW_FILE_CNT,
+};
+
+// The watcher thread posts an sdl event per debounced change, so a main thread blocked in
+// win_poll wakes straight away. win_poll collects them into 'changed' for prg_update.
+struct fsw {
+    SDL_Thread *thread;
+    SDL_atomic_t quit;
+    u32 event; // sdl event type, user.code is the enum fsw_files
+    u32 changed; // bit per enum fsw_files
+    
+    // linux
+    int fd; // inotify instance, -1 == no inotify
+    int wake[2]; // pipe that interrupts the watcher's poll when it is told to stop
+    int wd[FSW_FILE_CNT]; // watch on the directory holding each file
+    
+    // windows
+    void *wake_ev; // event that interrupts the watcher's wait, NULL == no directory watches
+    void *dir[FSW_FILE_CNT]; // directory holding each file, opened for ReadDirectoryChangesW
+    
+    // neither, or setting up the watches failed
+    u64 mtime[FSW_FILE_CNT]; // modification time last seen by the poll, kept across restarts
+};
+
+#ifdef LIB
+
+#define def_create_fsw(name) int name(void)
+def_create_fsw(create_fsw);
+
+#define def_fsw_start(name) int name(void)
+def_fsw_start(fsw_start);
+
+#define def_fsw_stop(name) void name(void)
+def_fsw_stop(fsw_stop);
+
+// Returns the files that changed since the last call
+#define def_fsw_take(name) u32 name(void)
+def_fsw_take(fsw_take);
+
+#endif // LIB
+
+#endif // FSW_H
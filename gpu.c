@@ -6,15 +6,47 @@
 
 struct gpu *gpu;
 
-u32 frm_i = 0;
-static inline void gpu_inc_frame(void)
-{
-    frm_i = (frm_i + 1) % FRAME_WRAP;
-}
+internal struct prg_field gpu_fields[] = {
+    prg_field(struct gpu, inst),
+    prg_field(struct gpu, surf),
+    prg_field(struct gpu, props),
+    prg_field(struct gpu, memprops),
+    prg_field(struct gpu, phys_dev),
+    prg_field(struct gpu, dev),
+    prg_field(struct gpu, flags),
+    prg_field(struct gpu, q_cnt),
+    prg_field(struct gpu, q),
+    prg_field(struct gpu, heap),
+    prg_field(struct gpu, upload),
+    prg_field(struct gpu, xfer),
+    prg_field(struct gpu, sc),
+    prg_field(struct gpu, pm),
+    prg_field(struct gpu, sh),
+    prg_field(struct gpu, pll),
+    prg_field(struct gpu, pl),
+    prg_field(struct gpu, plc),
+    prg_field(struct gpu, rp),
+    prg_field(struct gpu, fb),
+    prg_field(struct gpu, dsl),
+    prg_field(struct gpu, dp),
+    prg_field(struct gpu, ds),
+    prg_field(struct gpu, draw),
+    prg_field(struct gpu, qry),
+};
+prg_layout(prg_layout_gpu, struct gpu, GPU_LAYOUT_VERSION, gpu_fields);
+
+thread_persist u32 frm_i = 0;
 
-char* gpu_mem_names[GPU_MEM_CNT] = {
-    [GPU_MI_V] = "Vertex",
-    [GPU_MI_T] = "Transfer",
+char* gpu_pm_names[GPU_PM_CNT] = {
+    [GPU_PM_FIFO] = "fifo",
+    [GPU_PM_MAILBOX] = "mailbox",
+    [GPU_PM_IMMEDIATE] = "immediate",
+};
+
+VkPresentModeKHR gpu_pm_vk[GPU_PM_CNT] = {
+    [GPU_PM_FIFO] = VK_PRESENT_MODE_FIFO_KHR,
+    [GPU_PM_MAILBOX] = VK_PRESENT_MODE_MAILBOX_KHR,
+    [GPU_PM_IMMEDIATE] = VK_PRESENT_MODE_IMMEDIATE_KHR,
 };
 
 char *gpu_cmdq_names[GPU_CMD_CNT] = {
@@ -50,134 +82,264 @@ internal u32 gpu_memtype_helper(u32 type_bits, u32 req)
     return ret;
 }
 
-#define gpu_buf_align(sz) align(sz, gpu->props.limits.optimalBufferCopyOffsetAlignment)
+/**************************************************************************/
+// Device memory heap
 
-internal u64 gpu_buf_alloc(u32 bi, u64 sz)
+// recompute the free orders above 'node', which is at 'order'
+internal void gpu_heap_fix(struct gpu_heap_block *b, u32 node, u32 order)
 {
-    sz = gpu_buf_align(sz);
-    if (gpu->buf[bi].size < gpu->buf[bi].used + sz) {
-        log_error("Gpu buffer allocation failed for buffer %u (%s), size requested %u, size remaining %u",
-                  bi, gpu_buf_name(bi), sz, gpu->buf[bi].size - gpu->buf[bi].used);
-        return Max_u64;
-    }
-    gpu->buf[bi].used += sz;
-    return gpu->buf[bi].used - sz;
+    while(node) {
+        node = (node - 1) / 2;
+        order++;
+        u8 l = b->free[node * 2 + 1];
+        u8 r = b->free[node * 2 + 2];
+        b->free[node] = l == order && r == order ? order + 1 : (l > r ? l : r);
+    }
 }
 
-internal u64 gpu_bufcpy(VkCommandBuffer cmd, u64 ofs, u64 sz, u32 bi_from, u32 bi_to)
+internal u32 gpu_heap_create_block(u32 type, u64 size, u64 unit)
 {
-    VkBufferCopy r;
-    r.size = sz;
-    r.srcOffset = ofs;
-    r.dstOffset = gpu_buf_alloc(bi_to, sz);
+    u32 bi = 0;
+    while(bi < gpu->heap.block_cnt && gpu->heap.blocks[bi].mem)
+        ++bi;
+    if (bi == GPU_HEAP_MAX_BLOCKS) {
+        log_error("Gpu heap is out of blocks (%u)", (u64)GPU_HEAP_MAX_BLOCKS);
+        return Max_u32;
+    }
+    
+    struct gpu_heap_block *b = &gpu->heap.blocks[bi];
+    b->unit = unit;
+    b->orders = 1;
+    while((unit << (b->orders - 1)) < size)
+        b->orders++;
     
-    if (r.dstOffset == Max_u64) {
-        log_error("Failed to copy %u bytes from buffer %u (%s) to buffer %u (%s)",
-                  sz, bi_from, gpu_buf_name(bi_from), bi_to, gpu_buf_name(bi_to));
-        return Max_u64;
+    b->free = SDL_malloc((1u << b->orders) - 1);
+    if (!b->free) {
+        log_error("Failed to allocate gpu heap block tree");
+        return Max_u32;
+    }
+    for(u32 d=0; d < b->orders; ++d)
+        memset(b->free + (1u << d) - 1, b->orders - d, 1u << d);
+    
+    VkMemoryAllocateInfo ai = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+    ai.allocationSize = size;
+    ai.memoryTypeIndex = type;
+    if (vk_alloc_mem(&ai, &b->mem)) {
+        log_error("Failed to allocate %fmb of device memory, type %u", (f64)size / mb(1), (u64)type);
+        goto fail;
+    }
+    if ((gpu->memprops.memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) &&
+        vk_map_mem(b->mem, 0, size, &b->data))
+    {
+        log_error("Failed to map device memory block");
+        vk_free_mem(b->mem);
+        goto fail;
     }
     
-    vk_cmd_bufcpy(cmd, 1, &r, gpu->buf[bi_from].handle, gpu->buf[bi_to].handle);
-    return r.dstOffset;
+    b->type = type;
+    b->used = 0;
+    if (bi == gpu->heap.block_cnt)
+        gpu->heap.block_cnt++;
+    return bi;
+    
+    fail:
+    SDL_free(b->free);
+    memset(b, 0, sizeof(*b));
+    return Max_u32;
 }
 
-internal int gpu_create_draw_objs(void)
+internal void gpu_heap_destroy_block(struct gpu_heap_block *b)
 {
-    gpu->buffer_size = sizeof(*gpu->draw.elem) * win->max.w * win->max.h;
+    vk_free_mem(b->mem); // unmaps
+    SDL_free(b->free);
+    memset(b, 0, sizeof(*b));
+}
+
+// Sub-allocate memory for 'mr' from a block of the type gpu_memtype_helper picks for 'req'. Buddies
+// are aligned to their own size, so rounding the size up takes care of alignment, and rounding it
+// to bufferImageGranularity keeps buffers and optimal images off each other's pages.
+internal int gpu_heap_alloc(VkMemoryRequirements *mr, u32 req, struct gpu_alloc *a)
+{
+    u32 type = gpu_memtype_helper(mr->memoryTypeBits, req);
+    if (type == Max_u32) {
+        log_error("No memory type has properties %u", (u64)req);
+        return -1;
+    }
     
-    if (gpu->props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
-        VkBufferCreateInfo ci = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-        ci.size = gpu->buffer_size * FRAME_WRAP;
-        ci.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-        
-        if (vk_create_buf(&ci, &gpu_buf(GPU_BI_V).handle)) {
-            log_error("Failed to create vertex buffer");
-            return -1;
-        }
-        
-        u32 req = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-        
-        VkMemoryRequirements mr;
-        vk_get_buf_memreq(gpu_buf(GPU_BI_V).handle, &mr);
-        
-        VkMemoryAllocateInfo ai = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
-        ai.allocationSize = mr.size;
-        ai.memoryTypeIndex = gpu_memtype_helper(mr.memoryTypeBits, req);
-        
-        if (vk_alloc_mem(&ai, &gpu_mem(GPU_MI_V))) {
-            log_error("Failed to allocate vertex buffer memory");
-            return -1;
-        }
-        if (vk_bind_buf_mem(gpu_buf(GPU_BI_V).handle, gpu_mem(GPU_MI_V), 0)) {
-            log_error("Failed to bind vertex memory");
-            return -1;
-        }
-        
-        VkBufferCreateInfo tci = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-        tci.size = gpu->buffer_size * FRAME_WRAP;
-        tci.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-        
-        if (vk_create_buf(&tci, &gpu_buf(GPU_BI_T).handle)) {
-            log_error("Failed to create transfer buffer");
-            return -1;
-        }
-        
-        u32 treq = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-        
-        VkMemoryRequirements tmr;
-        vk_get_buf_memreq(gpu_buf(GPU_BI_T).handle, &tmr);
-        
-        VkMemoryAllocateInfo tai = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
-        tai.allocationSize = tmr.size;
-        tai.memoryTypeIndex = gpu_memtype_helper(tmr.memoryTypeBits, treq);
-        
-        if (vk_alloc_mem(&tai, &gpu_mem(GPU_MI_T))) {
-            log_error("Failed to allocate transfer buffer memory");
-            return -1;
-        }
-        if (vk_map_mem(gpu_mem(GPU_MI_T), 0, tmr.size, &gpu_buf(GPU_BI_T).data)) {
-            log_error("Failed to map transfer mem");
-            return -1;
-        }
-        if (vk_bind_buf_mem(gpu_buf(GPU_BI_T).handle, gpu_mem(GPU_MI_T), 0)) {
-            log_error("Failed to bind transfer memory");
-            return -1;
-        }
-        gpu->draw.elem = gpu_buf(GPU_BI_T).data;
+    u64 sz = mr->size;
+    if (sz < mr->alignment) sz = mr->alignment;
+    if (sz < gpu->props.limits.bufferImageGranularity) sz = gpu->props.limits.bufferImageGranularity;
+    
+    SDL_LockMutex(gpu->heap.lock);
+    
+    u32 k = 0;
+    while((GPU_HEAP_MIN_ALLOC << k) < sz)
+        ++k;
+    
+    u32 bi = Max_u32;
+    if (k >= GPU_HEAP_ORDERS) {
+        bi = gpu_heap_create_block(type, sz, sz);
+        k = 0;
     } else {
-        VkBufferCreateInfo ci = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-        ci.size = gpu->buffer_size * FRAME_WRAP;
-        ci.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-        
-        if (vk_create_buf(&ci, &gpu_buf(GPU_BI_V).handle)) {
-            log_error("Failed to create vertex buffer");
-            return -1;
-        }
-        
-        u32 req = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT|VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-        
-        VkMemoryRequirements mr;
-        vk_get_buf_memreq(gpu_buf(GPU_BI_V).handle, &mr);
-        
-        VkMemoryAllocateInfo ai = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
-        ai.allocationSize = mr.size;
-        ai.memoryTypeIndex = gpu_memtype_helper(mr.memoryTypeBits, req);
-        
-        if (vk_alloc_mem(&ai, &gpu_mem(GPU_MI_V))) {
-            log_error("Failed to allocate vertex buffer memory");
-            return -1;
+        for(u32 i=0; i < gpu->heap.block_cnt; ++i) {
+            struct gpu_heap_block *b = &gpu->heap.blocks[i];
+            if (b->mem && b->type == type && b->unit == GPU_HEAP_MIN_ALLOC && b->free[0] > k) {
+                bi = i;
+                break;
+            }
         }
-        if (vk_map_mem(gpu_mem(GPU_MI_V), 0, mr.size, &gpu_buf(GPU_BI_V).data)) {
-            log_error("Failed to map vertex mem");
-            return -1;
+        if (bi == Max_u32)
+            bi = gpu_heap_create_block(type, GPU_HEAP_BLOCK_SIZE, GPU_HEAP_MIN_ALLOC);
+    }
+    if (bi == Max_u32) {
+        SDL_UnlockMutex(gpu->heap.lock);
+        return -1;
+    }
+    
+    struct gpu_heap_block *b = &gpu->heap.blocks[bi];
+    u32 node = 0;
+    for(u32 o = b->orders - 1; o > k; --o)
+        node = b->free[node * 2 + 1] > k ? node * 2 + 1 : node * 2 + 2;
+    b->free[node] = 0;
+    gpu_heap_fix(b, node, k);
+    
+    a->mem = b->mem;
+    a->size = b->unit << k;
+    a->ofs = (u64)(node - ((1u << (b->orders - 1 - k)) - 1)) * a->size;
+    a->data = b->data ? (u8*)b->data + a->ofs : NULL;
+    a->block = bi;
+    b->used += a->size;
+    
+    SDL_UnlockMutex(gpu->heap.lock);
+    return 0;
+}
+
+internal void gpu_heap_free(struct gpu_alloc *a)
+{
+    if (!a->mem)
+        return;
+    
+    SDL_LockMutex(gpu->heap.lock);
+    
+    struct gpu_heap_block *b = &gpu->heap.blocks[a->block];
+    u32 k = 0;
+    while((b->unit << k) < a->size)
+        ++k;
+    
+    u32 node = (1u << (b->orders - 1 - k)) - 1 + (u32)(a->ofs / a->size);
+    b->free[node] = k + 1;
+    gpu_heap_fix(b, node, k);
+    b->used -= a->size;
+    
+    // regular blocks are kept around for the next allocation, dedicated ones are not
+    if (b->orders == 1)
+        gpu_heap_destroy_block(b);
+    
+    SDL_UnlockMutex(gpu->heap.lock);
+    memset(a, 0, sizeof(*a));
+}
+
+#define gpu_upload_mem (VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
+
+internal void gpu_destroy_buf(VkBuffer *buf, struct gpu_alloc *mem)
+{
+    if (*buf)
+        vk_destroy_buf(*buf);
+    gpu_heap_free(mem);
+    *buf = VK_NULL_HANDLE;
+}
+
+internal int gpu_create_buf(u64 size, u32 usage, u32 req, VkBuffer *buf, struct gpu_alloc *mem)
+{
+    VkBufferCreateInfo ci = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+    ci.size = size;
+    ci.usage = usage;
+    if (vk_create_buf(&ci, buf))
+        return -1;
+    
+    VkMemoryRequirements mr;
+    vk_get_buf_memreq(*buf, &mr);
+    
+    if (gpu_heap_alloc(&mr, req, mem) || vk_bind_buf_mem(*buf, mem->mem, mem->ofs)) {
+        gpu_destroy_buf(buf, mem);
+        return -1;
+    }
+    return 0;
+}
+
+// Frame 'fi' has been waited on, so nothing it uploaded is needed any more
+internal void gpu_upload_reclaim(u32 fi)
+{
+    for(u32 i=0; i < gpu->upload.block_cnt; ++i)
+        gpu->upload.blocks[i].pending &= ~(1 << fi);
+    if (gpu->upload.block_cnt && !gpu->upload.blocks[gpu->upload.cur].pending)
+        gpu->upload.blocks[gpu->upload.cur].head = 0;
+}
+
+// The current block is full: move to one nothing in flight is using, or chain on a new one
+internal int gpu_upload_next_block(u64 min)
+{
+    for(u32 i=0; i < gpu->upload.block_cnt; ++i) {
+        if (i != gpu->upload.cur && !gpu->upload.blocks[i].pending && gpu->upload.blocks[i].size >= min) {
+            gpu->upload.blocks[i].head = 0;
+            gpu->upload.cur = i;
+            return 0;
         }
-        if (vk_bind_buf_mem(gpu_buf(GPU_BI_V).handle, gpu_mem(GPU_MI_V), 0)) {
-            log_error("Failed to bind vertex memory");
+    }
+    
+    if (gpu->upload.block_cnt == GPU_UPLOAD_MAX_BLOCKS) {
+        log_error("Upload ring is out of blocks (%u)", (u64)GPU_UPLOAD_MAX_BLOCKS);
+        return -1;
+    }
+    
+    u64 size = gpu->upload.block_cnt ? gpu->upload.blocks[gpu->upload.block_cnt-1].size * 2 : GPU_UPLOAD_BLOCK_SIZE;
+    while(size < min)
+        size *= 2;
+    
+    // integrated gpus draw straight out of the ring
+    u32 usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT|VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    u32 req = gpu_upload_mem;
+    if (gpu->props.deviceType != VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
+        req |= VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    
+    typeof(gpu->upload.blocks[0]) *b = &gpu->upload.blocks[gpu->upload.block_cnt];
+    if (gpu_create_buf(size, usage, req, &b->buf, &b->mem)) {
+        log_error("Failed to create %fmb upload block", (f64)size / mb(1));
+        return -1;
+    }
+    b->size = size;
+    b->head = 0;
+    b->pending = 0;
+    
+    println("Upload ring grew to %u blocks, newest %fmb", (u64)gpu->upload.block_cnt + 1, (f64)size / mb(1));
+    gpu->upload.cur = gpu->upload.block_cnt++;
+    return 0;
+}
+
+// Space for 'size' bytes, written by the cpu this frame and readable by the gpu until the frame's fence
+internal int gpu_upload_alloc(u64 size, u64 alignment, struct gpu_upload *u)
+{
+    typeof(gpu->upload.blocks[0]) *b = &gpu->upload.blocks[gpu->upload.cur];
+    u64 ofs = gpu->upload.block_cnt ? align(b->head, alignment) : 0;
+    
+    if (!gpu->upload.block_cnt || ofs + size > b->size) {
+        if (gpu_upload_next_block(size))
             return -1;
-        }
-        gpu->draw.elem = gpu_buf(GPU_BI_V).data;
+        b = &gpu->upload.blocks[gpu->upload.cur];
+        ofs = 0;
     }
     
+    b->head = ofs + size;
+    b->pending |= 1 << gpu->draw.build;
+    
+    u->buf = b->buf;
+    u->ofs = ofs;
+    u->data = (u8*)b->mem.data + ofs;
+    return 0;
+}
+
+internal int gpu_create_draw_objs(void)
+{
     for(u32 i=0; i < cl_array_size(gpu->draw.fence); ++i)
         vk_create_fence(true, &gpu->draw.fence[i]);
     
@@ -186,6 +348,14 @@ internal int gpu_create_draw_objs(void)
             vk_create_sem(&gpu->draw.sem[i][j]);
     }
     
+    if (gpu->props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU && gpu_que(GPU_QI_G).i != gpu_que(GPU_QI_T).i) {
+        if (vk_create_timeline_sem(&gpu->xfer.sem)) {
+            log_error("Failed to create transfer timeline semaphore");
+            return -1;
+        }
+        gpu->xfer.async = true;
+    }
+    
     for(u32 i=0; i < cl_array_size(gpu_que(GPU_QI_G).cmd); ++i) {
         VkCommandPoolCreateInfo ci = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
         ci.queueFamilyIndex = gpu_que(GPU_QI_G).i;
@@ -233,6 +403,116 @@ internal void gpu_dealloc_cmds(u32 ci)
     gpu_cmd(ci).buf_cnt = 0;
 }
 
+// Device local copy of segment 'i' of half 'fi', created the first time the index is used
+internal VkBuffer gpu_draw_seg_vb(u32 fi, u32 i)
+{
+    typeof(gpu->draw.vb[0][0]) *vb = &gpu->draw.vb[fi][i];
+    if (vb->handle)
+        return vb->handle;
+    
+    u64 size = sizeof(struct gpu_draw_elem) * GPU_DRAW_SEG_ELEMS;
+    u32 usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if (gpu_create_buf(size, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vb->handle, &vb->mem)) {
+        log_error("Failed to create vertex buffer for draw segment %u", (u64)i);
+        return VK_NULL_HANDLE;
+    }
+    return vb->handle;
+}
+
+// Submit copies for the finished segments [xfer.flushed, end) of the half being built, and
+// release them to the graphics family. Only the last batch of a half signals the timeline: a
+// signal covers everything submitted before it on the queue.
+internal int gpu_xfer_flush(u32 end, bool last)
+{
+    u32 beg = gpu->xfer.flushed[frm_i];
+    if (beg == end)
+        return 0;
+    
+    trc_beg("gpu_xfer_flush");
+    
+    VkCommandBuffer cmd;
+    {
+        u32 i = gpu_alloc_cmds(GPU_CI_T, 1);
+        if (i == Max_u32) {
+            log_error("Failed to allocate transfer command buffer");
+            trc_end();
+            return -1;
+        }
+        cmd = gpu_cmd(GPU_CI_T).bufs[i];
+        vk_begin_cmd(cmd, true);
+    }
+    
+    // the slots were reset from the host in gpu_begin_build, transfer queues cannot reset queries
+    if ((gpu->qry.flags & GPU_QRY_TS_T) && beg == 0) {
+        vk_cmd_write_ts(cmd, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, gpu->qry.ts[frm_i], GPU_TS_XFER_BEG);
+    }
+    
+    VkBufferMemoryBarrier2 b[GPU_DRAW_MAX_SEGS];
+    for(u32 i=beg; i < end; ++i) {
+        struct gpu_draw_seg *s = &gpu->draw.seg[frm_i][i];
+        VkBuffer vb = gpu_draw_seg_vb(frm_i, i);
+        if (!vb) {
+            vk_end_cmd(cmd);
+            trc_end();
+            return -1;
+        }
+        
+        VkBufferCopy r = {.srcOffset = s->ofs, .dstOffset = 0, .size = sizeof(struct gpu_draw_elem) * s->cnt};
+        vk_cmd_bufcpy(cmd, 1, &r, s->buf, vb);
+        
+        b[i - beg] = (VkBufferMemoryBarrier2) {VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2};
+        b[i - beg].srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT_KHR;
+        b[i - beg].srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
+        b[i - beg].srcQueueFamilyIndex = gpu_que(GPU_QI_T).i;
+        b[i - beg].dstQueueFamilyIndex = gpu_que(GPU_QI_G).i;
+        b[i - beg].buffer = vb;
+        b[i - beg].offset = 0;
+        b[i - beg].size = VK_WHOLE_SIZE;
+    }
+    
+    VkDependencyInfo dep = {VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+    dep.bufferMemoryBarrierCount = end - beg;
+    dep.pBufferMemoryBarriers = b;
+    
+    vk_cmd_pl_barr(cmd, &dep);
+    
+    if ((gpu->qry.flags & GPU_QRY_TS_T) && last) {
+        vk_cmd_write_ts(cmd, VK_PIPELINE_STAGE_2_COPY_BIT, gpu->qry.ts[frm_i], GPU_TS_XFER_END);
+        gpu->xfer.ts[frm_i] = true;
+    }
+    
+    vk_end_cmd(cmd);
+    
+    u64 val = gpu->xfer.val + 1;
+    
+    VkTimelineSemaphoreSubmitInfo tsi = {VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO};
+    tsi.signalSemaphoreValueCount = 1;
+    tsi.pSignalSemaphoreValues = &val;
+    
+    VkSubmitInfo si = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
+    si.commandBufferCount = 1;
+    si.pCommandBuffers = &cmd;
+    if (last) {
+        si.pNext = &tsi;
+        si.signalSemaphoreCount = 1;
+        si.pSignalSemaphores = &gpu->xfer.sem;
+    }
+    
+    // the build thread is the only one that submits to the transfer queue
+    if (vk_qsub(gpu_que(GPU_QI_T).handle, 1, &si, VK_NULL_HANDLE)) {
+        log_error("Failed to submit transfer commands");
+        trc_end();
+        return -1;
+    }
+    
+    if (last)
+        gpu->xfer.wait[frm_i] = gpu->xfer.val = val;
+    gpu->xfer.flushed[frm_i] = end;
+    
+    trc_end();
+    return 0;
+}
+
 internal void gpu_await_draw_fence(void)
 {
     vk_await_fences(1, &gpu->draw.fence[frm_i], false);
@@ -243,20 +523,162 @@ internal void gpu_reset_draw_fence(void)
     vk_reset_fences(1, &gpu->draw.fence[frm_i]);
 }
 
+enum gpu_qry_written {
+    GPU_QW_XFER = 0x01,
+    GPU_QW_DRAW = 0x02,
+    GPU_QW_PS = 0x04,
+};
+
+internal int gpu_create_qry(void)
+{
+    if (gpu->props.limits.timestampPeriod > 0) {
+        if (gpu_que(GPU_QI_G).ts_bits)
+            gpu->qry.flags |= GPU_QRY_TS_G;
+        if (gpu_que(GPU_QI_T).ts_bits)
+            gpu->qry.flags |= GPU_QRY_TS_T;
+    }
+    
+    for(u32 i=0; i < FRAME_WRAP; ++i) {
+        if (gpu->qry.flags & (GPU_QRY_TS_G|GPU_QRY_TS_T)) {
+            VkQueryPoolCreateInfo ci = {VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+            ci.queryType = VK_QUERY_TYPE_TIMESTAMP;
+            ci.queryCount = GPU_TS_CNT;
+            
+            if (vk_create_qp(&ci, &gpu->qry.ts[i])) {
+                log_error("Failed to create timestamp query pool, gpu timings will not be reported");
+                gpu->qry.flags &= ~(GPU_QRY_TS_G|GPU_QRY_TS_T);
+            }
+        }
+        if (gpu->qry.flags & GPU_QRY_PS) {
+            VkQueryPoolCreateInfo ci = {VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+            ci.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+            ci.queryCount = 1;
+            ci.pipelineStatistics = GPU_PS_FLAGS;
+            
+            if (vk_create_qp(&ci, &gpu->qry.ps[i])) {
+                log_error("Failed to create pipeline statistics query pool, statistics will not be reported");
+                gpu->qry.flags &= ~GPU_QRY_PS;
+            }
+        }
+    }
+    return 0;
+}
+
+// milliseconds between a pair of timestamps, or negative if they are not available yet
+internal f32 gpu_ts_pair_ms(u32 qi, u32 first)
+{
+    struct { u64 ts, avail; } r[2];
+    VkResult res = vk_get_qp_results(gpu->qry.ts[frm_i], first, 2, sizeof(r), r, sizeof(r[0]),
+                                     VK_QUERY_RESULT_64_BIT|VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if (res != VK_SUCCESS || !r[0].avail || !r[1].avail)
+        return -1;
+    
+    u64 mask = gpu_que(qi).ts_bits >= 64 ? Max_u64 : ((u64)1 << gpu_que(qi).ts_bits) - 1;
+    u64 ticks = (r[1].ts - r[0].ts) & mask;
+    return (f32)((f64)ticks * gpu->props.limits.timestampPeriod * 1e-6);
+}
+
+// Read back the queries recorded the last time this frame index was used. Only called
+// once the frame's fence has signalled, so this never waits on the gpu, and anything
+// that is somehow still unavailable is just skipped.
+internal void gpu_read_qry(void)
+{
+    u32 w = gpu->qry.written[frm_i];
+    gpu->qry.written[frm_i] = 0;
+    
+    if (w & GPU_QW_XFER) {
+        u32 qi = gpu_que(GPU_QI_G).i == gpu_que(GPU_QI_T).i ? GPU_QI_G : GPU_QI_T;
+        f32 ms = gpu_ts_pair_ms(qi, GPU_TS_XFER_BEG);
+        if (ms >= 0)
+            prg->frames.gpu_xfer_ms = ms;
+    }
+    if (w & GPU_QW_DRAW) {
+        f32 ms = gpu_ts_pair_ms(GPU_QI_G, GPU_TS_DRAW_BEG);
+        if (ms >= 0)
+            prg->frames.gpu_draw_ms = ms;
+    }
+    if (w & GPU_QW_PS) {
+        u64 r[GPU_PS_CNT + 1];
+        VkResult res = vk_get_qp_results(gpu->qry.ps[frm_i], 0, 1, sizeof(r), r, sizeof(r),
+                                         VK_QUERY_RESULT_64_BIT|VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if (res == VK_SUCCESS && r[GPU_PS_CNT])
+            memcpy(prg->frames.gpu_ps, r, sizeof(prg->frames.gpu_ps));
+    }
+}
+
+// returns the mode actually set
+internal u32 gpu_set_present_mode(u32 mode)
+{
+    if (mode >= GPU_PM_CNT || !(gpu->pm.supported & (1 << mode))) {
+        log_error("Present mode %s is not supported, using fifo", mode < GPU_PM_CNT ? gpu_pm_names[mode] : "?");
+        mode = GPU_PM_FIFO;
+    }
+    gpu->pm.cur = mode;
+    gpu->sc.info.presentMode = gpu_pm_vk[mode];
+    return mode;
+}
+
+// destroy whatever retired swapchains no frame in flight can still be using
+internal void gpu_sc_collect(void)
+{
+    for(u32 i=0; i < gpu->sc.retired_cnt;) {
+        if (gpu->sc.retired[i].pending) {
+            ++i;
+            continue;
+        }
+        for(u32 j=0; j < SC_MAX_IMGS; ++j) {
+            if (gpu->sc.retired[i].views[j]) vk_destroy_imgv(gpu->sc.retired[i].views[j]);
+            if (gpu->sc.retired[i].sems[j]) vk_destroy_sem(gpu->sc.retired[i].sems[j]);
+        }
+        if (gpu->sc.retired[i].handle)
+            vk_destroy_sc_khr(gpu->sc.retired[i].handle);
+        gpu->sc.retired[i] = gpu->sc.retired[--gpu->sc.retired_cnt];
+    }
+}
+
+// frame 'fi' has been waited on, nothing it submitted is using a retired swapchain any more
+internal void gpu_sc_frame_done(u32 fi)
+{
+    gpu->draw.in_flight &= ~(1 << fi);
+    for(u32 i=0; i < gpu->sc.retired_cnt; ++i)
+        gpu->sc.retired[i].pending &= ~(1 << fi);
+    gpu_sc_collect();
+}
+
+// Hand the current views and acquire semaphores, and 'sc', over to be destroyed later
+internal void gpu_sc_retire(VkSwapchainKHR sc)
+{
+    if (gpu->sc.retired_cnt == SC_MAX_RETIRED) {
+        // swapchains are being replaced faster than frames finish, so just drain
+        vk_await_fences(FRAME_WRAP, gpu->draw.fence, true);
+        for(u32 i=0; i < FRAME_WRAP; ++i)
+            gpu_sc_frame_done(i);
+    }
+    
+    typeof(gpu->sc.retired[0]) *r = &gpu->sc.retired[gpu->sc.retired_cnt++];
+    r->handle = sc;
+    r->pending = gpu->draw.in_flight;
+    for(u32 i=0; i < SC_MAX_IMGS; ++i) {
+        r->views[i] = gpu->sc.att[i].view;
+        r->sems[i] = gpu->sc.map[i].sem;
+        gpu->sc.att[i].view = VK_NULL_HANDLE;
+        gpu->sc.map[i].sem = VK_NULL_HANDLE;
+    }
+    gpu_sc_collect();
+}
+
+// Create a swapchain from oldSwapchain without waiting on the device. Frames already in
+// flight finish on the old images, which are destroyed once those frames' fences signal.
 internal int gpu_create_sc(void)
 {
     char msg[128];
     
-    for(u32 i=0; i < cl_array_size(gpu->sc.att); ++i) {
-        if (gpu->sc.map[i].sem)
-            vk_destroy_sem(gpu->sc.map[i].sem);
-        
-        if (vk_create_sem(&gpu->sc.map[i].sem)) {
+    VkSemaphore sems[SC_MAX_IMGS] = {};
+    for(u32 i=0; i < cl_array_size(sems); ++i) {
+        if (vk_create_sem(&sems[i])) {
             log_error("Failed to create swapchain semaphore %u (I would be very surprised if I ever hit this message)", i);
-            while(--i < Max_u32) {
-                vk_destroy_sem(gpu->sc.map[i].sem);
-                gpu->sc.map[i].sem = VK_NULL_HANDLE;
-            }
+            while(--i < Max_u32)
+                vk_destroy_sem(sems[i]);
             return -1;
         }
     }
@@ -268,6 +690,7 @@ internal int gpu_create_sc(void)
                  "Window dimensions do not match those reported by surface capabilities");
     
     VkSwapchainCreateInfoKHR sc_info = gpu->sc.info;
+    sc_info.pQueueFamilyIndices = &gpu->q[GPU_QI_P].i;
     sc_info.imageExtent = (VkExtent2D) {.width = win->dim.w, .height = win->dim.h};
     
     // I am not actually sure what the appropriate action to take is if this fails.
@@ -277,7 +700,6 @@ internal int gpu_create_sc(void)
         strcpy(CLSTR(msg), STR("failed to create swapchain object (TODO I cannot tell if I am handling this correctly, the spec is odd when creation fails but oldSwapchain was a valid handle...)"));
         goto fail_sc;
     }
-    vk_destroy_sc_khr(gpu->sc.info.oldSwapchain);
     
     VkImage imgs[SC_MAX_IMGS] = {};
     if (vk_get_sc_imgs_khr(&gpu->sc.img_cnt, imgs)) {
@@ -308,16 +730,18 @@ internal int gpu_create_sc(void)
         }
     }
     
+    gpu_sc_retire(gpu->sc.info.oldSwapchain);
+    
     gpu->sc.info.oldSwapchain = gpu->sc.handle;
     gpu->sc.info.imageExtent = sc_info.imageExtent;
     gpu->sc.i = 0;
     
     for(i=0; i < gpu->sc.img_cnt; ++i) {
-        if (gpu->sc.att[i].view)
-            vk_destroy_imgv(gpu->sc.att[i].view);
         gpu->sc.att[i].view = views[i];
         gpu->sc.att[i].img = imgs[i];
     }
+    for(i=0; i < SC_MAX_IMGS; ++i)
+        gpu->sc.map[i].sem = sems[i];
     
     return 0;
     
@@ -330,10 +754,15 @@ internal int gpu_create_sc(void)
     // to swapchain creation failure. The best I can come up with for now is destroy everything
     // and trigger a complete swapchain rebuild.
     vk_destroy_sc_khr(gpu->sc.handle);
+    
+    fail_sc:
+    // the old swapchain is retired whether or not creation worked
+    gpu_sc_retire(gpu->sc.info.oldSwapchain);
     gpu->sc.info.oldSwapchain = NULL;
     gpu->sc.handle = NULL;
+    for(u32 j=0; j < SC_MAX_IMGS; ++j)
+        vk_destroy_sem(sems[j]);
     
-    fail_sc:
     log_error("Swapchain creation failed - %s", msg);
     return -1;
 }
@@ -341,13 +770,23 @@ internal int gpu_create_sc(void)
 internal int gpu_sc_next_img(void) {
     gpu->sc.i = (gpu->sc.i + 1) % gpu->sc.img_cnt;
     
+    bool retried = false;
     while(true) {
         VkResult res = vk_acquire_img_khr(gpu->sc.map[gpu->sc.i].sem, VK_NULL_HANDLE, &gpu->sc.map[gpu->sc.i].i);
         switch(res) {
             case VK_SUCCESS:
-            case VK_SUBOPTIMAL_KHR:
             return res;
             
+            case VK_SUBOPTIMAL_KHR:
+            gpu->flags |= GPU_SC_STALE; // still usable, recreate before the next frame
+            return VK_SUCCESS;
+            
+            case VK_ERROR_OUT_OF_DATE_KHR:
+            if (retried || gpu_create_sc())
+                return -1;
+            retried = true;
+            break; // loop again on the new swapchain
+            
             case VK_TIMEOUT:
             case VK_NOT_READY:
             os_sleep_ms(0);
@@ -356,7 +795,6 @@ internal int gpu_sc_next_img(void) {
             case VK_ERROR_OUT_OF_HOST_MEMORY:
             case VK_ERROR_OUT_OF_DEVICE_MEMORY:
             case VK_ERROR_DEVICE_LOST:
-            case VK_ERROR_OUT_OF_DATE_KHR:
             case VK_ERROR_SURFACE_LOST_KHR:
             case VK_ERROR_FULL_SCREEN_EXCLUSIVE_MODE_LOST_EXT:
             log_error("Swapchain image acquisition returned failure code");
@@ -368,6 +806,9 @@ internal int gpu_sc_next_img(void) {
 
 internal VkShaderModule gpu_create_shader(struct string spv)
 {
+    if (!spv.size)
+        return VK_NULL_HANDLE;
+    
     VkShaderModuleCreateInfo ci = {VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO};
     ci.codeSize = spv.size;
     ci.pCode = (u32*)spv.data;
@@ -565,7 +1006,7 @@ internal int gpu_create_pl(void)
     
     local_persist VkVertexInputBindingDescription vi_b = {
         .binding = 0,
-        .stride = sizeof(*gpu->draw.elem),
+        .stride = sizeof(struct gpu_draw_elem),
         .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
     };
     
@@ -573,12 +1014,12 @@ internal int gpu_create_pl(void)
         [SH_COL_LOC] = {
             .location = SH_COL_LOC,
             .format = CELL_COL_FMT,
-            .offset = offsetof(typeof(*gpu->draw.elem), col),
+            .offset = offsetof(struct gpu_draw_elem, col),
         },
         [SH_POS_LOC] = {
             .location = SH_POS_LOC,
             .format = CELL_POS_FMT,
-            .offset = offsetof(typeof(*gpu->draw.elem), pos),
+            .offset = offsetof(struct gpu_draw_elem, pos),
         },
     };
     
@@ -689,39 +1130,220 @@ internal int gpu_create_pl(void)
     return 0;
 }
 
-/*******************************************************************/
-// Header functions
+// Compiled shader code and the pipeline cache file, neither of which needs a device
+struct gpu_spv {
+    struct string vert;
+    struct string frag;
+    struct string plc;
+    int res;
+    u64 ns;
+};
 
-def_create_gpu(create_gpu)
+// Whole file in heap memory rather than the scratch arena, as this runs off the main thread
+// at startup. A missing file comes back empty.
+internal struct string gpu_read_file(char *uri)
 {
-    {
-        u32 ver;
-        if (vkEnumerateInstanceVersion(&ver) == VK_ERROR_OUT_OF_HOST_MEMORY) {
-            log_error("Failed to enumerate vulkan instance version (note that this can only happen due to the loader or enabled layers).");
-            return -1;
-        }
-        if (VK_API_VERSION_MAJOR(ver) != 1 || VK_API_VERSION_MINOR(ver) < 3) {
-            log_error("Vulkan instance version is not 1.3 or higher");
-            return -1;
-        }
-        
-        VkApplicationInfo ai = {VK_STRUCTURE_TYPE_APPLICATION_INFO};
-        ai.pApplicationName = "name";
-        ai.applicationVersion = 0;
-        ai.pEngineName = "engine";
-        ai.engineVersion = 0;
-        ai.apiVersion = VK_API_VERSION_1_3;
-        
-#define MAX_EXTENSION_COUNT 8
-        u32 ext_count = 0;
-        char *exts[MAX_EXTENSION_COUNT];
-        win_inst_exts(&ext_count, NULL); assert(ext_count <= MAX_EXTENSION_COUNT);
-        win_inst_exts(&ext_count, exts);
-        
-        VkInstanceCreateInfo ci = {VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO};
-        ci.pApplicationInfo = &ai;
-        ci.enabledExtensionCount = ext_count;
-        ci.ppEnabledExtensionNames = exts;
+    struct string s = {};
+    SDL_RWops *f = SDL_RWFromFile(uri, "rb");
+    if (!f)
+        return s;
+    
+    s64 sz = SDL_RWsize(f);
+    if (sz > 0 && (s.data = SDL_malloc(sz)) && SDL_RWread(f, s.data, 1, sz) == (size_t)sz) {
+        s.size = sz;
+    } else {
+        SDL_free(s.data);
+        s.data = NULL;
+    }
+    SDL_RWclose(f);
+    return s;
+}
+
+internal void gpu_free_spv(struct gpu_spv *spv)
+{
+    SDL_free(spv->vert.data);
+    SDL_free(spv->frag.data);
+    SDL_free(spv->plc.data);
+}
+
+internal int gpu_compile_sh(struct gpu_spv *spv)
+{
+    struct string src = gpu_read_file(SH_SRC_URI);
+    char *buf = src.data;
+    if (!buf) {
+        log_error("Failed to read shader source %s", SH_SRC_URI);
+        return -1;
+    }
+    
+    // You have to look at the structure of shader.h to understand what is happening here.
+    // It is basically chopping the file up into vertex and fragment source code segments
+    // based on the position of some marker defines in the file.
+    u32 ofs = strfind(STR("SH_BEGIN"), src) + (u32)strlen("SH_BEGIN") + 1;
+    u32 sz = strfind(STR("SH_END"), src) + (u32)strlen("SH_END");
+    src.data += ofs;
+    src.size = sz - ofs;
+    
+    trunc_file(SH_SRC_OUT_URI, 0);
+    write_file(SH_SRC_OUT_URI, src.data, src.size);
+    
+    struct os_process vp = {.p = INVALID_HANDLE_VALUE};
+    struct os_process fp = {.p = INVALID_HANDLE_VALUE};
+    
+    char *va[] = {SH_CL_URI, "-fshader-stage=vert", SH_SRC_OUT_URI, "-Werror -std=450 -o", SH_VERT_OUT_URI, "-DVERT"};
+    char *fa[] = {SH_CL_URI, "-fshader-stage=frag", SH_SRC_OUT_URI, "-Werror -std=450 -o", SH_FRAG_OUT_URI};
+    
+    char vcmd_buf[256];
+    char fcmd_buf[256];
+    struct string vcmd = flatten_pchar_array(va, (u32)cl_array_size(va), vcmd_buf, (u32)sizeof(vcmd_buf), ' ');
+    struct string fcmd = flatten_pchar_array(fa, (u32)cl_array_size(fa), fcmd_buf, (u32)sizeof(vcmd_buf), ' ');
+    
+    int res = 0;
+    
+    if (os_create_process(vcmd.data, &vp)) {
+        log_error("Failed to create shader compiler (vertex)");
+        res = -1;
+        goto out;
+    }
+    
+    if (os_create_process(fcmd.data, &fp)) {
+        log_error("Failed to create shader compiler (fragment)");
+        res = -1;
+        goto out;
+    }
+    
+    int vr = os_await_process(&vp);
+    int fr = os_await_process(&fp);
+    
+    if (vr || fr) {
+        println("\nshader source dump:");
+        write_stdout(src.data, src.size);
+        println("\nend of shader source dump");
+        log_error_if(vr, "Vertex shader compiler return non-zero error code (%i)", (s64)vr);
+        log_error_if(fr, "Fragment shader compiler return non-zero error code (%i)", (s64)fr);
+        res = -1;
+        goto out;
+    }
+    
+    spv->vert = gpu_read_file(SH_VERT_OUT_URI);
+    spv->frag = gpu_read_file(SH_FRAG_OUT_URI);
+    
+    out:
+    if (vp.p != INVALID_HANDLE_VALUE)
+        os_destroy_process(&vp);
+    if (fp.p != INVALID_HANDLE_VALUE)
+        os_destroy_process(&fp);
+    SDL_free(buf);
+    return res;
+}
+
+internal int gpu_create_sh_mods(struct gpu_spv *spv)
+{
+    VkShaderModule vmod = gpu_create_shader(spv->vert);
+    VkShaderModule fmod = gpu_create_shader(spv->frag);
+    
+    if (!vmod || !fmod) {
+        log_error_if(!vmod, "Failed to create vertex shader module");
+        log_error_if(!fmod, "Failed to create fragment shader module");
+        if (vmod)
+            vk_destroy_shmod(vmod);
+        if (fmod)
+            vk_destroy_shmod(fmod);
+        return -1;
+    }
+    
+    gpu->sh.vert = vmod;
+    gpu->sh.frag = fmod;
+    return 0;
+}
+
+// The shader compiler is an external process and the pipeline cache a file, so both run
+// on their own thread while the driver loads and the device is created
+internal int gpu_sh_thread(void *arg)
+{
+    struct gpu_spv *spv = arg;
+    u64 pc = SDL_GetPerformanceCounter();
+    spv->plc = gpu_read_file(GPU_PLC_URI);
+    spv->res = gpu_compile_sh(spv);
+    spv->ns = prg_ns_since(pc);
+    return 0;
+}
+
+// A cache written by another device or driver is left out rather than trusted to the driver
+// to reject. Returns the size of the data the cache was created with.
+internal u64 gpu_create_plc(struct string data)
+{
+    VkPipelineCacheCreateInfo ci = {VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO};
+    VkPipelineCacheHeaderVersionOne *hdr = (VkPipelineCacheHeaderVersionOne*)data.data;
+    if (data.size >= sizeof(*hdr) &&
+        hdr->headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        hdr->vendorID == gpu->props.vendorID &&
+        hdr->deviceID == gpu->props.deviceID &&
+        !memcmp(hdr->pipelineCacheUUID, gpu->props.pipelineCacheUUID, VK_UUID_SIZE))
+    {
+        ci.initialDataSize = data.size;
+        ci.pInitialData = data.data;
+    }
+    
+    if (vk_create_plc(&ci, &gpu->plc)) {
+        log_error("Failed to create pipeline cache, building pipelines without one");
+        gpu->plc = VK_NULL_HANDLE;
+        return 0;
+    }
+    return ci.initialDataSize;
+}
+
+// Only written when building the pipelines added to what was loaded, so a warm start does
+// not pay for the write
+internal void gpu_save_plc(u64 loaded)
+{
+    size_t sz;
+    if (!gpu->plc || vk_get_plc_data(&sz, NULL) || sz == loaded)
+        return;
+    
+    void *data = SDL_malloc(sz);
+    if (data && !vk_get_plc_data(&sz, data)) {
+        SDL_RWops *f = SDL_RWFromFile(GPU_PLC_URI, "wb");
+        if (f) {
+            SDL_RWwrite(f, data, 1, sz);
+            SDL_RWclose(f);
+        } else {
+            log_error("Failed to write pipeline cache %s - %s", GPU_PLC_URI, SDL_GetError());
+        }
+    }
+    SDL_free(data);
+}
+
+// instance, device and swapchain
+internal int gpu_create_dev(void)
+{
+    {
+        u32 ver;
+        if (vkEnumerateInstanceVersion(&ver) == VK_ERROR_OUT_OF_HOST_MEMORY) {
+            log_error("Failed to enumerate vulkan instance version (note that this can only happen due to the loader or enabled layers).");
+            return -1;
+        }
+        if (VK_API_VERSION_MAJOR(ver) != 1 || VK_API_VERSION_MINOR(ver) < 3) {
+            log_error("Vulkan instance version is not 1.3 or higher");
+            return -1;
+        }
+        
+        VkApplicationInfo ai = {VK_STRUCTURE_TYPE_APPLICATION_INFO};
+        ai.pApplicationName = "name";
+        ai.applicationVersion = 0;
+        ai.pEngineName = "engine";
+        ai.engineVersion = 0;
+        ai.apiVersion = VK_API_VERSION_1_3;
+
+#define MAX_EXTENSION_COUNT 8
+        u32 ext_count = 0;
+        char *exts[MAX_EXTENSION_COUNT];
+        win_inst_exts(&ext_count, NULL); assert(ext_count <= MAX_EXTENSION_COUNT);
+        win_inst_exts(&ext_count, exts);
+        
+        VkInstanceCreateInfo ci = {VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO};
+        ci.pApplicationInfo = &ai;
+        ci.enabledExtensionCount = ext_count;
+        ci.ppEnabledExtensionNames = exts;
         
         if (vk_create_inst(&ci))
             return -1;
@@ -766,6 +1388,11 @@ def_create_gpu(create_gpu)
         }
         
         vk_get_phys_dev_memprops(gpu->phys_dev, &gpu->memprops);
+        
+        VkPhysicalDeviceFeatures feats;
+        vk_get_phys_dev_feats(gpu->phys_dev, &feats);
+        if (feats.pipelineStatisticsQuery)
+            gpu->qry.flags |= GPU_QRY_PS;
 #undef MAX_DEVICE_COUNT
     }
     
@@ -840,6 +1467,8 @@ def_create_gpu(create_gpu)
         VkPhysicalDeviceVulkan12Features feat12 = {
             .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
             .shaderSampledImageArrayNonUniformIndexing = VK_TRUE,
+            .timelineSemaphore = VK_TRUE,
+            .hostQueryReset = VK_TRUE,
         };
         
         VkPhysicalDeviceVulkan13Features feat13 = {
@@ -850,6 +1479,7 @@ def_create_gpu(create_gpu)
         
         VkPhysicalDeviceFeatures df = {};
         df.sampleRateShading = VK_TRUE;
+        df.pipelineStatisticsQuery = (gpu->qry.flags & GPU_QRY_PS) != 0;
         
         VkDeviceCreateInfo ci = {VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO};
         ci.pNext = &feat13;
@@ -863,8 +1493,10 @@ def_create_gpu(create_gpu)
             return -1;
         
         gpu->q_cnt = qc;
-        for(u32 i=0; i < GPU_Q_CNT; ++i)
+        for(u32 i=0; i < GPU_Q_CNT; ++i) {
             gpu->q[i].i = qi[i];
+            gpu->q[i].ts_bits = fp[qi[i]].timestampValidBits;
+        }
         
         create_vdt(); // initialize device api calls
         
@@ -919,112 +1551,87 @@ def_create_gpu(create_gpu)
         gpu->sc.info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
         gpu->sc.info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
         gpu->sc.info.clipped = VK_TRUE;
-        gpu->sc.info.queueFamilyIndexCount = 1;
-        gpu->sc.info.pQueueFamilyIndices = &gpu->q[GPU_QI_P].i;
-        gpu->sc.info.presentMode = VK_PRESENT_MODE_FIFO_KHR;
+        gpu->sc.info.queueFamilyIndexCount = 1; // pQueueFamilyIndices is set per create, gpu moves on reload
+        
+        VkPresentModeKHR pms[16];
+        u32 pm_cnt = cl_array_size(pms);
+        vk_get_phys_dev_surf_pms_khr(&pm_cnt, pms);
+        
+        gpu->pm.supported = 1 << GPU_PM_FIFO;
+        for(u32 i=0; i < pm_cnt; ++i) {
+            for(u32 j=0; j < GPU_PM_CNT; ++j)
+                gpu->pm.supported |= (pms[i] == gpu_pm_vk[j]) << j;
+        }
+        
+        u32 pm = GPU_PM_FIFO;
+        char *pm_name = SDL_getenv(GPU_ENV_PRESENT_MODE);
+        for(u32 i=0; pm_name && i < GPU_PM_CNT; ++i) {
+            if (!strcmp(pm_name, gpu_pm_names[i]))
+                pm = i;
+        }
+        gpu_set_present_mode(pm);
+        SDL_AtomicSet(&gpu->pm.req, GPU_PM_CNT);
         
         if (gpu_create_sc())
             return -1;
     }
     
-    gpu_create_sh();
-    gpu_create_dsl();
-    gpu_create_pll();
-    gpu_create_ds();
-    gpu_create_rp();
-    gpu_create_pl();
-    gpu_create_draw_objs();
-    
     return 0;
 }
 
-def_gpu_create_sh(gpu_create_sh)
+/*******************************************************************/
+// Header functions
+
+def_create_gpu(create_gpu)
 {
-    struct string src;
-    src.size = read_file(SH_SRC_URI, NULL, 0);
-    src.data = salloc(MT, src.size);
-    read_file(SH_SRC_URI, src.data, src.size);
-    
-    // You have to look at the structure of shader.h to understand what is happening here.
-    // It is basically chopping the file up into vertex and fragment source code segments
-    // based on the position of some marker defines in the file.
-    u32 ofs = strfind(STR("SH_BEGIN"), src) + (u32)strlen("SH_BEGIN") + 1;
-    u32 sz = strfind(STR("SH_END"), src) + (u32)strlen("SH_END");
-    src.data += ofs;
-    src.size = sz - ofs;
-    
-    trunc_file(SH_SRC_OUT_URI, 0);
-    write_file(SH_SRC_OUT_URI, src.data, src.size);
-    
-    struct os_process vp = {.p = INVALID_HANDLE_VALUE};
-    struct os_process fp = {.p = INVALID_HANDLE_VALUE};
-    
-    char *va[] = {SH_CL_URI, "-fshader-stage=vert", SH_SRC_OUT_URI, "-Werror -std=450 -o", SH_VERT_OUT_URI, "-DVERT"};
-    char *fa[] = {SH_CL_URI, "-fshader-stage=frag", SH_SRC_OUT_URI, "-Werror -std=450 -o", SH_FRAG_OUT_URI};
-    
-    char vcmd_buf[256];
-    char fcmd_buf[256];
-    struct string vcmd = flatten_pchar_array(va, (u32)cl_array_size(va), vcmd_buf, (u32)sizeof(vcmd_buf), ' ');
-    struct string fcmd = flatten_pchar_array(fa, (u32)cl_array_size(fa), fcmd_buf, (u32)sizeof(vcmd_buf), ' ');
-    
-    int res = 0;
-    
-    if (os_create_process(vcmd.data, &vp)) {
-        log_error("Failed to create shader compiler (vertex)");
-        res = -1;
-        goto out;
-    }
-    
-    if (os_create_process(fcmd.data, &fp)) {
-        log_error("Failed to create shader compiler (fragment)");
-        res = -1;
-        goto out;
-    }
-    
-    int vr = os_await_process(&vp);
-    int fr = os_await_process(&fp);
-    
-    if (vr || fr) {
-        println("\nshader source dump:");
-        write_stdout(src.data, src.size);
-        println("\nend of shader source dump");
-        log_error_if(vr, "Vertex shader compiler return non-zero error code (%i)", (s64)vr);
-        log_error_if(fr, "Fragment shader compiler return non-zero error code (%i)", (s64)fr);
-        res = -1;
-        goto out;
-    }
-    
-    struct string vspv,fspv;
-    
-    vspv.size = read_file(SH_VERT_OUT_URI, NULL, 0);
-    vspv.data = salloc(MT, vspv.size);
-    read_file(SH_VERT_OUT_URI, vspv.data, vspv.size);
-    
-    fspv.size = read_file(SH_FRAG_OUT_URI, NULL, 0);
-    fspv.data = salloc(MT, fspv.size);
-    read_file(SH_FRAG_OUT_URI, fspv.data, fspv.size);
-    
-    VkShaderModule vmod = gpu_create_shader(vspv);
-    VkShaderModule fmod = gpu_create_shader(fspv);
-    
-    if (!vmod || !fmod) {
-        log_error_if(!vmod, "Failed to create vertex shader module");
-        log_error_if(!fmod, "Failed to create fragment shader module");
-        if (vmod)
-            vk_destroy_shmod(vmod);
-        if (fmod)
-            vk_destroy_shmod(fmod);
+    gpu->heap.lock = SDL_CreateMutex();
+    if (!gpu->heap.lock) {
+        log_error("Failed to create gpu heap mutex - %s", SDL_GetError());
         return -1;
     }
     
-    gpu->sh.vert = vmod;
-    gpu->sh.frag = fmod;
+    struct gpu_spv spv = {};
+    SDL_Thread *sh = SDL_CreateThread(gpu_sh_thread, "gpu_sh", &spv);
+    if (!sh)
+        log_error("Failed to create shader compile thread, compiling after device creation - %s", SDL_GetError());
+    
+    u64 pc = SDL_GetPerformanceCounter();
+    int res = gpu_create_dev();
+    prg->boot.ns[PRG_BOOT_GPU_DEV] = prg_ns_since(pc);
+    
+    if (sh)
+        SDL_WaitThread(sh, NULL);
+    else
+        gpu_sh_thread(&spv);
+    prg->boot.ns[PRG_BOOT_GPU_SH] = spv.ns;
+    
+    if (!res) {
+        pc = SDL_GetPerformanceCounter();
+        u64 loaded = gpu_create_plc(spv.plc);
+        if (!spv.res)
+            gpu_create_sh_mods(&spv);
+        gpu_create_dsl();
+        gpu_create_pll();
+        gpu_create_ds();
+        gpu_create_rp();
+        gpu_create_pl();
+        gpu_create_draw_objs();
+        gpu_create_qry();
+        gpu_save_plc(loaded);
+        prg->boot.ns[PRG_BOOT_GPU_PL] = prg_ns_since(pc);
+    }
     
-    out:
-    if (vp.p != INVALID_HANDLE_VALUE)
-        os_destroy_process(&vp);
-    if (fp.p != INVALID_HANDLE_VALUE)
-        os_destroy_process(&fp);
+    gpu_free_spv(&spv);
+    return res;
+}
+
+def_gpu_create_sh(gpu_create_sh)
+{
+    struct gpu_spv spv = {};
+    int res = gpu_compile_sh(&spv);
+    if (!res)
+        res = gpu_create_sh_mods(&spv);
+    gpu_free_spv(&spv);
     return res;
 }
 
@@ -1032,8 +1639,7 @@ def_gpu_handle_win_resize(gpu_handle_win_resize)
 {
     println("GPU handling resize");
     
-    vkDeviceWaitIdle(gpu->dev);
-    
+    gpu->flags &= ~GPU_SC_STALE;
     if (gpu_create_sc()) {
         log_error("Failed to retire old swapchain, retrying from scratch...");
         if (gpu_create_sc()) {
@@ -1046,18 +1652,123 @@ def_gpu_handle_win_resize(gpu_handle_win_resize)
 
 def_gpu_add_draw_elem(gpu_add_draw_elem)
 {
-    if (gpu->draw.used >= (u32)win->max.w * win->max.h) {
-        log_error("Gpu draw buffer overflow");
-        return -1;
+    if (!gpu->dev)
+        return 0; // headless
+    
+    u32 fi = gpu->draw.build;
+    u32 *cnt = &gpu->draw.seg_cnt[fi];
+    struct gpu_draw_seg *s = *cnt ? &gpu->draw.seg[fi][*cnt - 1] : NULL;
+    
+    if (!s || s->cnt == s->cap) {
+        if (*cnt == GPU_DRAW_MAX_SEGS) {
+            log_error("Gpu draw list overflow (%u elements)", (u64)gpu->draw.used[fi]);
+            return -1;
+        }
+        
+        struct gpu_upload u;
+        u64 sz = sizeof(struct gpu_draw_elem) * GPU_DRAW_SEG_ELEMS;
+        if (gpu_upload_alloc(sz, gpu->props.limits.optimalBufferCopyOffsetAlignment, &u)) {
+            log_error("Failed to allocate draw segment");
+            return -1;
+        }
+        
+        // ship the finished segments while the rest of the frame is built, keeping a command
+        // buffer back for gpu_end_build
+        if (gpu->xfer.async && *cnt - gpu->xfer.flushed[fi] >= GPU_XFER_BATCH_SEGS &&
+            gpu_cmd(GPU_CI_T).buf_cnt < GPU_MAX_CMDS - 1)
+        {
+            gpu_xfer_flush(*cnt, false);
+        }
+        
+        s = &gpu->draw.seg[fi][(*cnt)++];
+        s->buf = u.buf;
+        s->ofs = u.ofs;
+        s->elem = u.data;
+        s->cnt = 0;
+        s->cap = GPU_DRAW_SEG_ELEMS;
     }
     
-    gpu->draw.elem[gpu->draw.used].col = col;
-    gpu->draw.elem[gpu->draw.used].pos = pos;
-    ++gpu->draw.used;
+    s->elem[s->cnt].col = col;
+    s->elem[s->cnt].pos = pos;
+    s->cnt++;
+    gpu->draw.used[fi]++;
     
     return 0;
 }
 
+def_gpu_heap_report(gpu_heap_report)
+{
+    if (!gpu->heap.lock)
+        return;
+    
+    SDL_LockMutex(gpu->heap.lock);
+    for(u32 i=0; i < gpu->heap.block_cnt; ++i) {
+        struct gpu_heap_block *b = &gpu->heap.blocks[i];
+        if (!b->mem)
+            continue;
+        
+        // how much of the free space a single allocation could not use
+        u64 size = b->unit << (b->orders - 1);
+        u64 largest = b->free[0] ? b->unit << (b->free[0] - 1) : 0;
+        f64 frag = size > b->used ? 1.0 - (f64)largest / (size - b->used) : 0;
+        println("  gpu heap block %u (type %u): %fmb of %fmb used, largest free %fmb, fragmentation %f",
+                (u64)i, (u64)b->type, (f64)b->used / mb(1), (f64)size / mb(1), (f64)largest / mb(1), frag);
+    }
+    SDL_UnlockMutex(gpu->heap.lock);
+}
+
+def_gpu_request_present_mode(gpu_request_present_mode)
+{
+    SDL_AtomicSet(&gpu->pm.req, mode);
+}
+
+def_gpu_begin_build(gpu_begin_build)
+{
+    if (!gpu->dev)
+        return;
+    
+    trc_beg("gpu_begin_build");
+    frm_i = gpu->draw.build;
+    vk_await_fences(1, &gpu->draw.fence[frm_i], false);
+    
+    if (gpu->xfer.async) {
+        // normally already complete by the fence, unless the half was built but never drawn
+        if (gpu->xfer.wait[frm_i])
+            vk_await_timeline(gpu->xfer.sem, gpu->xfer.wait[frm_i]);
+        
+        if (gpu->xfer.ts[frm_i]) {
+            f32 ms = gpu_ts_pair_ms(GPU_QI_T, GPU_TS_XFER_BEG);
+            if (ms >= 0)
+                prg->frames.gpu_xfer_ms = ms;
+        }
+        
+        // the fence and the timeline wait above mean neither queue still uses this half's slots
+        if (gpu->qry.flags & GPU_QRY_TS_T)
+            vk_reset_qp(gpu->qry.ts[frm_i], GPU_TS_XFER_BEG, 2);
+        
+        vk_reset_cmdpool(gpu_cmd(GPU_CI_T).pool, 0x0);
+        gpu_dealloc_cmds(GPU_CI_T);
+        gpu->xfer.wait[frm_i] = 0;
+        gpu->xfer.flushed[frm_i] = 0;
+        gpu->xfer.ts[frm_i] = false;
+    }
+    
+    gpu_upload_reclaim(frm_i);
+    gpu->draw.seg_cnt[frm_i] = 0;
+    gpu->draw.used[frm_i] = 0;
+    trc_end();
+}
+
+def_gpu_end_build(gpu_end_build)
+{
+    if (!gpu->dev || !gpu->xfer.async)
+        return;
+    
+    frm_i = gpu->draw.build;
+    if (gpu_xfer_flush(gpu->draw.seg_cnt[frm_i], true))
+        log_error("Failed to submit uploads for frame %u", (u64)frm_i);
+}
+
 def_gpu_draw(gpu_draw)
 {
     VkCommandBuffer cmd;
@@ -1072,79 +1783,65 @@ def_gpu_draw(gpu_draw)
         vk_begin_cmd(cmd, true);
     }
     
-    VkBufferCopy reg;
-    reg.srcOffset = gpu->buffer_size * frm_i;
-    reg.dstOffset = gpu->buffer_size * frm_i;
-    reg.size = gpu->draw.used * sizeof(*gpu->draw.elem);
-    
-    if (gpu->props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
-        if (gpu_que(GPU_QI_G).i == gpu_que(GPU_QI_T).i) {
-            vk_cmd_bufcpy(cmd, 1, &reg, gpu_buf(GPU_BI_T).handle, gpu_buf(GPU_BI_V).handle);
-            
-            VkMemoryBarrier2 b = {VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
-            b.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
-            b.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
-            b.dstStageMask = VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT;
-            b.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT;
-            
-            VkDependencyInfo dep = {VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
-            dep.memoryBarrierCount = 1;
-            dep.pMemoryBarriers = &b;
-            
-            vk_cmd_pl_barr(cmd, &dep);
-        } else {
-            VkCommandBuffer tcmd;
-            {
-                u32 i = gpu_alloc_cmds(GPU_CI_T, 1);
-                if (i == Max_u32) {
-                    log_error("Failed to allocate transfer command buffer");
-                    return -1;
-                }
-                tcmd = gpu_cmd(GPU_CI_T).bufs[i];
-                vk_begin_cmd(tcmd, true);
-            }
-            
-            vk_cmd_bufcpy(tcmd, 1, &reg, gpu_buf(GPU_BI_T).handle, gpu_buf(GPU_BI_V).handle);
-            
-            VkBufferMemoryBarrier2 b = {VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2};
-            b.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT_KHR;
-            b.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
-            b.srcQueueFamilyIndex = gpu_que(GPU_QI_T).i;
-            b.dstQueueFamilyIndex = gpu_que(GPU_QI_G).i;
-            b.buffer = gpu_buf(GPU_BI_V).handle;
-            b.offset = gpu->buffer_size * frm_i;
-            b.size = gpu->buffer_size;
-            
-            VkDependencyInfoKHR dep = {VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
-            dep.bufferMemoryBarrierCount = 1;
-            dep.pBufferMemoryBarriers = &b;
-            
-            vk_cmd_pl_barr(tcmd, &dep);
-            
-            vk_end_cmd(tcmd);
-            
-            b.srcStageMask = 0x0,
-            b.srcAccessMask = 0x0,
-            b.dstStageMask = VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT_KHR,
-            b.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT_KHR,
-            
+    if (gpu->qry.flags & GPU_QRY_TS_G)
+        vk_cmd_reset_qp(cmd, gpu->qry.ts[frm_i], GPU_TS_DRAW_BEG, 2);
+    if (gpu->qry.flags & GPU_QRY_PS)
+        vk_cmd_reset_qp(cmd, gpu->qry.ps[frm_i], 0, 1);
+    
+    if (gpu->xfer.async) {
+        // acquire what the build thread released on the transfer queue, see gpu_xfer_flush
+        VkBufferMemoryBarrier2 b[GPU_DRAW_MAX_SEGS];
+        for(u32 i=0; i < gpu->xfer.flushed[frm_i]; ++i) {
+            b[i] = (VkBufferMemoryBarrier2) {VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2};
+            b[i].dstStageMask = VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT;
+            b[i].dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT;
+            b[i].srcQueueFamilyIndex = gpu_que(GPU_QI_T).i;
+            b[i].dstQueueFamilyIndex = gpu_que(GPU_QI_G).i;
+            b[i].buffer = gpu->draw.vb[frm_i][i].handle;
+            b[i].offset = 0;
+            b[i].size = VK_WHOLE_SIZE;
+        }
+        
+        VkDependencyInfo dep = {VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+        dep.bufferMemoryBarrierCount = gpu->xfer.flushed[frm_i];
+        dep.pBufferMemoryBarriers = b;
+        
+        if (dep.bufferMemoryBarrierCount)
             vk_cmd_pl_barr(cmd, &dep);
-            
-            VkSubmitInfo tsi = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
-            tsi.commandBufferCount = 1;
-            tsi.pCommandBuffers = &tcmd;
-            tsi.signalSemaphoreCount = 1;
-            tsi.pSignalSemaphores = &gpu_draw_sem(GPU_BI_T);
-            
-            if (vk_qsub(gpu_que(GPU_QI_T).handle, 1, &tsi, VK_NULL_HANDLE)) {
-                log_error("Failed to submit transfer commands");
+    } else if (gpu->props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
+        if (gpu->qry.flags & GPU_QRY_TS_G) {
+            vk_cmd_reset_qp(cmd, gpu->qry.ts[frm_i], GPU_TS_XFER_BEG, 2);
+            vk_cmd_write_ts(cmd, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, gpu->qry.ts[frm_i], GPU_TS_XFER_BEG);
+        }
+        
+        for(u32 i=0; i < gpu->draw.seg_cnt[frm_i]; ++i) {
+            struct gpu_draw_seg *s = &gpu->draw.seg[frm_i][i];
+            VkBuffer vb = gpu_draw_seg_vb(frm_i, i);
+            if (!vb)
                 return -1;
-            }
+            
+            VkBufferCopy r = {.srcOffset = s->ofs, .dstOffset = 0, .size = sizeof(struct gpu_draw_elem) * s->cnt};
+            vk_cmd_bufcpy(cmd, 1, &r, s->buf, vb);
+        }
+        
+        if (gpu->qry.flags & GPU_QRY_TS_G) {
+            vk_cmd_write_ts(cmd, VK_PIPELINE_STAGE_2_COPY_BIT, gpu->qry.ts[frm_i], GPU_TS_XFER_END);
+            gpu->qry.written[frm_i] |= GPU_QW_XFER;
         }
+        
+        VkMemoryBarrier2 b = {VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+        b.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+        b.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
+        b.dstStageMask = VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT;
+        b.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT;
+        
+        VkDependencyInfo dep = {VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+        dep.memoryBarrierCount = 1;
+        dep.pMemoryBarriers = &b;
+        
+        vk_cmd_pl_barr(cmd, &dep);
     }
     
-    u64 ofs = 0;
-    
     VkViewport vp = {};
     vp.width = win->dim.w;
     vp.height = win->dim.h;
@@ -1170,49 +1867,61 @@ def_gpu_draw(gpu_draw)
     vk_cmd_set_viewport(cmd, 0, 1, &vp);
     vk_cmd_set_scissor(cmd, 0, 1, &sc);
     vk_cmd_bind_pl(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, gpu->pl);
-    vk_cmd_bind_vb(cmd, 0, 1, &gpu_buf(GPU_BI_V).handle, &ofs);
+    
+    if (gpu->qry.flags & GPU_QRY_TS_G)
+        vk_cmd_write_ts(cmd, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, gpu->qry.ts[frm_i], GPU_TS_DRAW_BEG);
+    if (gpu->qry.flags & GPU_QRY_PS)
+        vk_cmd_begin_qry(cmd, gpu->qry.ps[frm_i], 0);
     
     vk_cmd_begin_rp(cmd, &rbi, &sbi);
-    vk_cmd_draw(cmd, 1, gpu->draw.used);
+    
+    // discrete gpus draw from the device local copies, integrated gpus read the ring directly
+    bool discrete = gpu->props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
+    for(u32 i=0; i < gpu->draw.seg_cnt[frm_i]; ++i) {
+        struct gpu_draw_seg *s = &gpu->draw.seg[frm_i][i];
+        VkBuffer buf = discrete ? gpu->draw.vb[frm_i][i].handle : s->buf;
+        u64 ofs = discrete ? 0 : s->ofs;
+        vk_cmd_bind_vb(cmd, 0, 1, &buf, &ofs);
+        vk_cmd_draw(cmd, 1, s->cnt);
+    }
     vk_cmd_end_rp(cmd);
     
+    if (gpu->qry.flags & GPU_QRY_PS) {
+        vk_cmd_end_qry(cmd, gpu->qry.ps[frm_i], 0);
+        gpu->qry.written[frm_i] |= GPU_QW_PS;
+    }
+    if (gpu->qry.flags & GPU_QRY_TS_G) {
+        // after everything in the command buffer, not just color output
+        vk_cmd_write_ts(cmd, VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT, gpu->qry.ts[frm_i], GPU_TS_DRAW_END);
+        gpu->qry.written[frm_i] |= GPU_QW_DRAW;
+    }
+    
     vk_end_cmd(cmd);
     
-    if (gpu->props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
-        
-        VkSemaphore w_sem[] = {gpu_draw_sem(GPU_BI_T), gpu_sc_sem};
-        VkPipelineStageFlags w_stg[] = {VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-        
-        VkSubmitInfo si = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
-        si.waitSemaphoreCount = 2;
-        si.pWaitSemaphores = w_sem;
-        si.pWaitDstStageMask = w_stg;
-        si.commandBufferCount = 1;
-        si.pCommandBuffers = &cmd;
-        si.signalSemaphoreCount = 1;
-        si.pSignalSemaphores = &gpu_draw_sem(GPU_BI_V);
-        
-        if (vk_qsub(gpu_que(GPU_QI_G).handle, 1, &si, VK_NULL_HANDLE)) {
-            log_error("Failed to submit graphics commands");
-            return -1;
-        }
-    } else {
-        VkPipelineStageFlags w_stg = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        
-        VkSubmitInfo si = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
-        si.waitSemaphoreCount = 1;
-        si.pWaitSemaphores = &gpu_sc_sem;
-        si.pWaitDstStageMask = &w_stg;
-        si.commandBufferCount = 1;
-        si.pCommandBuffers = &cmd;
-        si.signalSemaphoreCount = 1;
-        si.pSignalSemaphores = &gpu_draw_sem(GPU_BI_V);
-        
-        if (vk_qsub(gpu_que(GPU_QI_G).handle, 1, &si, gpu->draw.fence[frm_i])) {
-            log_error("Failed to submit graphics commands");
-            return -1;
-        }
+    VkSemaphore w_sem[] = {gpu_sc_sem, gpu->xfer.sem};
+    VkPipelineStageFlags w_stg[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT};
+    u64 w_val[] = {0, gpu->xfer.wait[frm_i]};
+    
+    VkTimelineSemaphoreSubmitInfo tsi = {VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO};
+    tsi.waitSemaphoreValueCount = 2;
+    tsi.pWaitSemaphoreValues = w_val;
+    
+    VkSubmitInfo si = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
+    si.waitSemaphoreCount = gpu->xfer.wait[frm_i] ? 2 : 1;
+    si.pWaitSemaphores = w_sem;
+    si.pWaitDstStageMask = w_stg;
+    si.commandBufferCount = 1;
+    si.pCommandBuffers = &cmd;
+    si.signalSemaphoreCount = 1;
+    si.pSignalSemaphores = &gpu_draw_sem(GPU_BI_V);
+    if (si.waitSemaphoreCount == 2)
+        si.pNext = &tsi;
+    
+    if (vk_qsub(gpu_que(GPU_QI_G).handle, 1, &si, gpu->draw.fence[frm_i])) {
+        log_error("Failed to submit graphics commands");
+        return -1;
     }
+    gpu->draw.in_flight |= 1 << frm_i;
     
     VkPresentInfoKHR pi = {VK_STRUCTURE_TYPE_PRESENT_INFO_KHR};
     pi.waitSemaphoreCount = 1;
@@ -1222,13 +1931,14 @@ def_gpu_draw(gpu_draw)
     pi.pImageIndices = &gpu_sc_map.i;
     pi.pResults = VK_NULL_HANDLE;
     
-    if (vk_qpres(&pi)) {
+    VkResult res = vk_qpres(&pi);
+    if (res == VK_SUBOPTIMAL_KHR || res == VK_ERROR_OUT_OF_DATE_KHR) {
+        gpu->flags |= GPU_SC_STALE;
+    } else if (res) {
         log_error("Failed to present to swapchain");
         return -1;
     }
     
-    gpu->draw.used = 0;
-    
     return 0;
 }
 
@@ -1242,13 +1952,38 @@ def_gpu_update(gpu_update)
         return 0;
     }
     
-    if (gpu->draw.used == 0)
+    if (gpu->draw.used[gpu->draw.ready] == 0)
         return 0;
     
-    gpu_inc_frame();
+    frm_i = gpu->draw.ready;
+    
+    trc_beg("gpu_await_draw_fence");
     gpu_await_draw_fence();
-    if (cvk(gpu_sc_next_img()))
-        log_error("Failed to acquire proper image from swapchain");
+    trc_end();
+    
+    gpu_sc_frame_done(frm_i);
+    gpu_read_qry();
+    
+    u32 pm = SDL_AtomicSet(&gpu->pm.req, GPU_PM_CNT);
+    if (pm != GPU_PM_CNT && pm != gpu->pm.cur) {
+        println("Present mode %s", gpu_pm_names[gpu_set_present_mode(pm)]);
+        gpu->flags |= GPU_SC_STALE;
+    }
+    
+    if ((gpu->flags & GPU_SC_STALE) && gpu_handle_win_resize())
+        return -1;
+    
+    // Without an acquired image there is nothing to record into or present, and a failed
+    // recreate leaves no swapchain at all. Skip the frame and try a fresh swapchain next time.
+    trc_beg("gpu_sc_next_img");
+    if (cvk(gpu_sc_next_img())) {
+        log_error("Failed to acquire proper image from swapchain, skipping the frame");
+        gpu->flags |= GPU_SC_STALE;
+        trc_end();
+        return 0;
+    }
+    trc_end();
+    
     gpu_reset_draw_fence();
     
     if (gpu_next_fb()) {
@@ -1256,13 +1991,16 @@ def_gpu_update(gpu_update)
         return -1;
     }
     for(u32 i=0; i < GPU_CMD_CNT; ++i) {
-        if (gpu->props.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU && i == GPU_CI_T)
+        // the build thread owns the transfer pools when it submits uploads itself
+        if ((gpu->props.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU || gpu->xfer.async) && i == GPU_CI_T)
             continue;
         vk_reset_cmdpool(gpu_cmd(i).pool, 0x0);
         gpu_dealloc_cmds(i);
     }
     
+    trc_beg("gpu_draw");
     gpu_draw();
+    trc_end();
     
     if (frame_timer_trigger && REPORT_FRAME_TIME)
         check_timer(frame_timer, "Time to get image: ");
@@ -1288,17 +2026,24 @@ def_gpu_check_leaks(gpu_check_leaks)
     }
     frm_i = tmp;
     
-    for(u32 i=0; i < GPU_BUF_CNT; ++i) {
-        if (gpu->buf[i].handle)
-            vk_destroy_buf(gpu->buf[i].handle);
+    for(u32 i=0; i < gpu->upload.block_cnt; ++i)
+        gpu_destroy_buf(&gpu->upload.blocks[i].buf, &gpu->upload.blocks[i].mem);
+    gpu->upload.block_cnt = 0;
+    for(u32 i=0; i < FRAME_WRAP; ++i) {
+        for(u32 j=0; j < GPU_DRAW_MAX_SEGS; ++j)
+            gpu_destroy_buf(&gpu->draw.vb[i][j].handle, &gpu->draw.vb[i][j].mem);
+    }
+    for(u32 i=0; i < gpu->heap.block_cnt; ++i) {
+        if (gpu->heap.blocks[i].mem)
+            gpu_heap_destroy_block(&gpu->heap.blocks[i]);
     }
-    for(u32 i=0; i < GPU_MEM_CNT; ++i)
-        vk_free_mem(gpu->mem[i]);
+    gpu->heap.block_cnt = 0;
     
     vk_destroy_shmod(gpu->sh.vert);
     vk_destroy_shmod(gpu->sh.frag);
     vk_destroy_pll(gpu->pll);
     vk_destroy_pl(gpu->pl);
+    vk_destroy_plc(gpu->plc);
     vk_destroy_rp(gpu->rp);
     
     for(u32 i=0; i < cl_array_size(gpu->fb); ++i) {
@@ -1314,15 +2059,25 @@ def_gpu_check_leaks(gpu_check_leaks)
     }
     vk_destroy_sc_khr(gpu->sc.handle);
     
+    for(u32 i=0; i < gpu->sc.retired_cnt; ++i)
+        gpu->sc.retired[i].pending = 0;
+    gpu_sc_collect();
+    
     vk_destroy_dsl(gpu->dsl);
     vk_destroy_dp(gpu->dp);
     
     for(u32 i=0; i < cl_array_size(gpu->draw.fence); ++i)
         vk_destroy_fence(gpu->draw.fence[i]);
+    for(u32 i=0; i < FRAME_WRAP; ++i) {
+        if (gpu->qry.ts[i]) vk_destroy_qp(gpu->qry.ts[i]);
+        if (gpu->qry.ps[i]) vk_destroy_qp(gpu->qry.ps[i]);
+    }
     for(u32 i=0; i < cl_array_size(gpu->draw.sem); ++i) {
         for(u32 j=0; j < cl_array_size(gpu->draw.sem[i]); ++j)
             vk_destroy_sem(gpu->draw.sem[i][j]);
     }
+    if (gpu->xfer.sem)
+        vk_destroy_sem(gpu->xfer.sem);
     
     vkDestroyDevice(gpu->dev, NULL);
     
@@ -7,9 +7,10 @@
 
 #define SC_MAX_IMGS 4 /* Arbitrarily small size that I doubt will be exceeded */
 #define SC_MIN_IMGS 2
+#define SC_MAX_RETIRED 4 /* swapchains waiting on frames in flight before they are destroyed */
 #define FRAME_WRAP 2
 
-extern u32 frm_i; // frame index, is either 0 or 1
+extern thread_persist u32 frm_i; // frame index, is either 0 or 1, on the build thread it is draw.build
 
 enum {
     DB_SI_T, // transfer complete
@@ -19,12 +20,7 @@ enum {
 
 #define GPU_MAX_CMDS 16
 
-enum gpu_mem_indices {
-    GPU_MI_V,
-    GPU_MI_T,
-    GPU_MEM_CNT,
-};
-
+// index the per frame semaphores by the buffer whose work they signal
 enum gpu_buf_indices {
     GPU_BI_V,
     GPU_BI_T,
@@ -45,6 +41,104 @@ enum gpu_cmdq_indices {
     GPU_CMD_CNT
 };
 
+// timestamp query slots, written in pairs on a single queue
+enum gpu_ts_indices {
+    GPU_TS_XFER_BEG,
+    GPU_TS_XFER_END,
+    GPU_TS_DRAW_BEG,
+    GPU_TS_DRAW_END,
+    GPU_TS_CNT,
+};
+
+// results come back in bit order, so keep this in the same order as the enum below
+enum gpu_ps_indices {
+    GPU_PS_VS, // vertex shader invocations
+    GPU_PS_CLIP, // primitives that made it past clipping
+    GPU_PS_FS, // fragment shader invocations
+    GPU_PS_CNT,
+};
+
+#define GPU_PS_FLAGS (VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT|\
+VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT|\
+VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT)
+
+enum gpu_qry_flags {
+    GPU_QRY_TS_G = 0x01, // graphics queue supports timestamps
+    GPU_QRY_TS_T = 0x02, // transfer queue supports timestamps
+    GPU_QRY_PS = 0x04, // pipeline statistics are supported
+};
+
+#define GPU_PLC_URI "pipeline.cache" /* kept between runs so pipelines are not rebuilt from scratch at startup */
+
+#define GPU_ENV_PRESENT_MODE "PRG_PRESENT_MODE" /* fifo, mailbox or immediate, F3 cycles them at runtime */
+
+enum gpu_present_modes {
+    GPU_PM_FIFO, // vsync, always supported
+    GPU_PM_MAILBOX, // vsync, newest frame wins
+    GPU_PM_IMMEDIATE, // tears
+    GPU_PM_CNT,
+};
+
+#define GPU_HEAP_BLOCK_SIZE mb(64) /* device memory is allocated in blocks of this per memory type */
+#define GPU_HEAP_MIN_ALLOC kb(4) /* smallest buddy */
+#define GPU_HEAP_ORDERS 15 /* GPU_HEAP_MIN_ALLOC << (GPU_HEAP_ORDERS - 1) == GPU_HEAP_BLOCK_SIZE */
+#define GPU_HEAP_MAX_BLOCKS 32
+
+// A piece of device memory from the gpu heap
+struct gpu_alloc {
+    VkDeviceMemory mem;
+    u64 ofs;
+    u64 size; // a power of 2 multiple of the block's unit
+    void *data; // mapped pointer, NULL unless the memory type is host visible
+    u32 block;
+};
+
+// One vkAllocateMemory, split buddy style. 'free' is a complete binary tree over the block,
+// each node holding 1 + the order of the largest free run below it (0 == full). Allocations
+// bigger than a block get a block of their own with a single order.
+struct gpu_heap_block {
+    VkDeviceMemory mem;
+    void *data; // whole block mapped persistently if host visible
+    u64 unit; // size of order 0
+    u64 used;
+    u32 orders;
+    u32 type; // memory type index
+    u8 *free;
+};
+
+#define GPU_UPLOAD_BLOCK_SIZE mb(4) /* first upload block, each one chained on after is twice the last */
+#define GPU_UPLOAD_MAX_BLOCKS 16
+#define GPU_DRAW_SEG_ELEMS 65536 /* draw elements taken from the upload ring at a time */
+#define GPU_DRAW_MAX_SEGS 256
+#define GPU_XFER_BATCH_SEGS 4 /* finished draw segments per transfer submit */
+
+struct gpu_draw_elem {
+    struct rgba col;
+    struct offset_u16 pos;
+};
+
+// Space handed out by the upload ring
+struct gpu_upload {
+    VkBuffer buf;
+    u64 ofs;
+    void *data;
+};
+
+// A run of draw elements in the upload ring
+struct gpu_draw_seg {
+    VkBuffer buf;
+    u64 ofs;
+    struct gpu_draw_elem *elem;
+    u32 cnt;
+    u32 cap;
+};
+
+enum gpu_flags {
+    GPU_SC_STALE = 0x01, // swapchain reported suboptimal or out of date, recreate before the next acquire
+};
+
+#define GPU_LAYOUT_VERSION 1 /* see struct prg_layout */
+
 struct gpu {
     VkInstance inst;
     VkSurfaceKHR surf;
@@ -53,12 +147,13 @@ struct gpu {
     VkPhysicalDevice phys_dev;
     VkDevice dev;
     
-    u32 flags;
+    u32 flags; // enum gpu_flags
     u32 q_cnt;
     
     struct {
         VkQueue handle;
         u32 i;
+        u32 ts_bits; // timestampValidBits
         struct {
             u32 buf_cnt;
             VkCommandPool pool;
@@ -66,16 +161,39 @@ struct gpu {
         } cmd[FRAME_WRAP];
     } q[GPU_Q_CNT];
     
-    VkDeviceMemory mem[GPU_MEM_CNT];
+    struct {
+        SDL_mutex *lock;
+        struct gpu_heap_block blocks[GPU_HEAP_MAX_BLOCKS];
+        u32 block_cnt;
+    } heap;
     
+    // Persistently mapped host memory for everything uploaded per frame, handed out in order
+    // from the current block. A block is reused once no frame in flight has anything in it, and
+    // a new one chained on when none is free, so memory follows the real upload volume. Owned
+    // by whichever thread is building the frame.
     struct {
-        VkBuffer handle;
-        void *data;
-        u64 size;
-        u64 used;
-    } buf[GPU_BUF_CNT];
+        struct {
+            VkBuffer buf;
+            struct gpu_alloc mem;
+            u64 size;
+            u64 head;
+            u32 pending; // bit per frame index with uploads in the block
+        } blocks[GPU_UPLOAD_MAX_BLOCKS];
+        u32 block_cnt;
+        u32 cur;
+    } upload;
     
-    u32 buffer_size; // true buffer size is double this, but buffers are split in half per frame
+    // When the transfer queue is its own family, the build thread submits segment copies as
+    // each batch fills rather than gpu_draw submitting them all right before the draw. Graphics
+    // only waits for them at vertex input, on a timeline value set by the last batch of the half.
+    struct {
+        bool async;
+        VkSemaphore sem; // timeline
+        u64 val; // last value signalled
+        u64 wait[FRAME_WRAP]; // value each half's copies are complete at, 0 == nothing to wait on
+        u32 flushed[FRAME_WRAP]; // segments already submitted
+        bool ts[FRAME_WRAP]; // transfer timestamps written
+    } xfer;
     
     struct {
         VkSwapchainKHR handle;
@@ -92,8 +210,24 @@ struct gpu {
             u32 i;
             VkSemaphore sem;
         } map[SC_MAX_IMGS];
+        
+        // Replaced swapchains, destroyed along with their views and acquire semaphores once
+        // the frames that were in flight when they were replaced have been waited on.
+        struct {
+            VkSwapchainKHR handle;
+            VkImageView views[SC_MAX_IMGS];
+            VkSemaphore sems[SC_MAX_IMGS];
+            u32 pending; // bit per frame index
+        } retired[SC_MAX_RETIRED];
+        u32 retired_cnt;
     } sc;
     
+    struct {
+        u32 cur; // enum gpu_present_modes
+        u32 supported; // bit per enum gpu_present_modes
+        SDL_atomic_t req; // set from any thread, applied by gpu_update, GPU_PM_CNT == no request
+    } pm;
+    
     struct {
         VkShaderModule vert;
         VkShaderModule frag;
@@ -101,6 +235,7 @@ struct gpu {
     
     VkPipelineLayout pll;
     VkPipeline pl;
+    VkPipelineCache plc; // VK_NULL_HANDLE == pipelines are built without one
     VkRenderPass rp;
     VkFramebuffer fb[FRAME_WRAP];
     
@@ -109,17 +244,32 @@ struct gpu {
     VkDescriptorSet ds;
     
     struct {
+        struct gpu_draw_seg seg[FRAME_WRAP][GPU_DRAW_MAX_SEGS];
+        u32 seg_cnt[FRAME_WRAP];
+        
+        // Discrete gpus draw from a device local copy of each segment, created the first time
+        // a segment index is used
         struct {
-            struct rgba col;
-            struct offset_u16 pos;
-        } *elem; // pointer into transfer/vertex buffer
+            VkBuffer handle;
+            struct gpu_alloc mem;
+        } vb[FRAME_WRAP][GPU_DRAW_MAX_SEGS];
         
-        u32 used;
+        u32 used[FRAME_WRAP]; // elements in each half
+        u32 build; // half the world is drawing into, owned by whichever thread runs world_draw
+        u32 ready; // half gpu_update submits
+        u32 in_flight; // bit per frame index submitted and not yet waited on by the main thread
         VkFence fence[FRAME_WRAP];
         
         VkSemaphore sem[FRAME_WRAP][GPU_BUF_CNT];
         
     } draw;
+    
+    struct {
+        u32 flags; // enum gpu_qry_flags
+        VkQueryPool ts[FRAME_WRAP];
+        VkQueryPool ps[FRAME_WRAP];
+        u32 written[FRAME_WRAP]; // bit per timestamp pair/statistics query recorded in that frame
+    } qry;
 };
 
 #ifdef LIB
@@ -137,6 +287,23 @@ def_gpu_handle_win_resize(gpu_handle_win_resize);
 #define def_gpu_add_draw_elem(name) int name(struct rgba col, struct offset_u16 pos)
 def_gpu_add_draw_elem(gpu_add_draw_elem);
 
+// Wait until the gpu is done with the half in draw.build and empty it. Safe to call
+// off the main thread, as that half's fence is left alone until it is submitted again.
+#define def_gpu_begin_build(name) void name(void)
+def_gpu_begin_build(gpu_begin_build);
+
+// Submit whatever uploads for draw.build are still outstanding
+#define def_gpu_end_build(name) void name(void)
+def_gpu_end_build(gpu_end_build);
+
+// Usage and fragmentation of each device memory block
+#define def_gpu_heap_report(name) void name(void)
+def_gpu_heap_report(gpu_heap_report);
+
+// Switch present mode before the next frame, falls back to fifo if 'mode' is unsupported. Any thread.
+#define def_gpu_request_present_mode(name) void name(u32 mode)
+def_gpu_request_present_mode(gpu_request_present_mode);
+
 #define def_gpu_draw(name) int name(void)
 def_gpu_draw(gpu_draw);
 
@@ -177,13 +344,9 @@ enum gpu_fb_attachment_indices {
 };
 
 extern u32 gpu_ci_to_qi[GPU_CMD_CNT];
-extern char* gpu_mem_names[GPU_MEM_CNT];
 extern char *gpu_cmdq_names[GPU_CMD_CNT];
 
 #define gpu_que(qi) gpu->q[qi]
-#define gpu_mem(mi) gpu->mem[mi]
-#define gpu_buf(bi) gpu->buf[bi]
-#define gpu_buf_name(bi) gpu_mem_names[bi]
 #define gpu_cmd_name(ci) gpu_cmdq_names[ci]
 #define gpu_cmd(ci) gpu->q[gpu_ci_to_qi[ci]].cmd[frm_i]
 
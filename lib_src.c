@@ -6,7 +6,11 @@
 
 #define LIB
 #include "prg.c"
+#include "trc.c"
+#include "rec.c"
 #include "win.c"
 #include "gpu.c"
 #include "vdt.c"
-#include "world.c"
\ No newline at end of file
+#include "world.c"
+#include "fsw.c"
+#include "mem.c"
\ No newline at end of file
@@ -3,12 +3,14 @@
 #include "prg.h"
 #include "vdt.h"
 
-struct program exeprg;
+struct prg_exe exeprg;
 
 int load_lib(void)
 {
     local_persist void *lib = 0;
     
+    u64 pc = SDL_GetPerformanceCounter();
+    
     if (lib) os_destroy_lib(lib);
     copy_file(LIB_SRC, LIB_SRC_TEMP);
     lib = os_create_lib(LIB_SRC);
@@ -25,15 +27,20 @@ int load_lib(void)
     }
     
     load(&exeprg);
-    println("Loaded library code");
+    println("Loaded library code in %fms", (f64)(SDL_GetPerformanceCounter() - pc) * 1e3 / SDL_GetPerformanceFrequency());
     return 0;
 }
 
 int main() {
-    exeprg.vdt.table = exevdt;
+    exeprg.start = SDL_GetPerformanceCounter();
+    exeprg.vdt_table = exevdt;
     
     // cannot be called from inside the lib.
-    if (SDL_Init(SDL_INIT_TIMER|SDL_INIT_VIDEO|SDL_INIT_EVENTS)) {
+    u32 sdl_flags = SDL_INIT_TIMER|SDL_INIT_EVENTS;
+    if (!SDL_getenv(PRG_ENV_HEADLESS))
+        sdl_flags |= SDL_INIT_VIDEO;
+    
+    if (SDL_Init(sdl_flags)) {
         log_error("Failed to init sdl");
         return -1;
     }
@@ -0,0 +1,248 @@
+#include "mem.h"
+#include "prg.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#pragma comment(lib, "advapi32.lib")
+#else
+#include <sys/mman.h>
+#endif
+
+char *mem_pages_names[MEM_PAGES_CNT] = {
+    [MEM_PAGES_SMALL] = "off",
+    [MEM_PAGES_THP] = "thp",
+    [MEM_PAGES_HUGE] = "explicit",
+};
+
+// Transparent huge pages only back 2mb aligned runs, so for those the range is reserved with
+// room to slide up to the next boundary and the ends are trimmed
+internal void* mem_os_reserve(u64 size, u32 pages)
+{
+#ifdef _WIN32
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    u64 pad = pages == MEM_PAGES_THP ? MEM_HUGE_PAGE : 0;
+    u8 *p = mmap(NULL, size + pad, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (pad) {
+        u8 *a = (u8*)align((u64)p, MEM_HUGE_PAGE);
+        if (a > p)
+            munmap(p, a - p);
+        if (p + pad > a)
+            munmap(a + size, p + pad - a);
+        p = a;
+    }
+    return p;
+#endif
+}
+
+internal bool mem_os_commit(void *p, u64 size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(p, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+    return mprotect(p, size, PROT_READ|PROT_WRITE) == 0;
+#endif
+}
+
+// the contents are gone, committing the range again gives back zeroed pages
+internal void mem_os_decommit(void *p, u64 size)
+{
+#ifdef _WIN32
+    VirtualFree(p, size, MEM_DECOMMIT);
+#else
+    madvise(p, size, MADV_DONTNEED);
+    mprotect(p, size, PROT_NONE);
+#endif
+}
+
+#ifdef _WIN32
+// Large pages are refused unless the user has the lock pages in memory right, and it is
+// enabled on the process token
+internal bool mem_lock_memory_privilege(void)
+{
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES|TOKEN_QUERY, &token))
+        return false;
+    
+    TOKEN_PRIVILEGES tp = {.PrivilegeCount = 1};
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool ok = LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &tp.Privileges[0].Luid) &&
+              AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) &&
+              GetLastError() == ERROR_SUCCESS; // not all privileges assigned still returns true
+    CloseHandle(token);
+    return ok;
+}
+#endif
+
+internal void mem_report_arena(char *name, struct mem_arena *a)
+{
+    println("    %s: used %fmb (%fmb at the last reset), committed %fmb, high water %fmb of %fmb, %u allocations, huge pages %s",
+            name, (f64)a->used / mb(1), (f64)a->prev / mb(1), (f64)a->committed / mb(1),
+            (f64)a->high / mb(1), (f64)a->reserved / mb(1), a->allocs, mem_pages_names[a->pages]);
+}
+
+/**************************************************************************/
+// Header functions
+
+def_create_mem_arena(create_mem_arena)
+{
+    memset(arena, 0, sizeof(*arena));
+#ifdef _WIN32
+    pages = MEM_PAGES_SMALL; // nothing transparent, and large pages cannot be committed lazily
+#else
+    if (pages == MEM_PAGES_HUGE)
+        pages = MEM_PAGES_THP;
+#endif
+    arena->grain = pages == MEM_PAGES_THP ? MEM_HUGE_PAGE : MEM_COMMIT_GRAIN;
+    reserve = align(reserve, arena->grain);
+    
+    arena->base = mem_os_reserve(reserve, pages);
+    if (!arena->base) {
+        log_error("Failed to reserve %fmb of address space", (f64)reserve / mb(1));
+        return -1;
+    }
+    arena->reserved = reserve;
+
+#ifndef _WIN32
+    if (pages == MEM_PAGES_THP && madvise(arena->base, reserve, MADV_HUGEPAGE)) {
+        log_error("Transparent huge pages unavailable, arena is using small pages");
+        pages = MEM_PAGES_SMALL;
+    }
+#endif
+    arena->pages = pages;
+    return 0;
+}
+
+def_mem_alloc(mem_alloc)
+{
+    u64 ofs = align(arena->used, MEM_ALIGN);
+    u64 end = ofs + size;
+    
+    if (end > arena->committed) {
+        if (end > arena->reserved) {
+            log_error("Arena out of address space, %u bytes asked for with %u of %u used",
+                      size, arena->used, arena->reserved);
+            return NULL;
+        }
+        // reserved is a multiple of the grain, so this stays inside it
+        u64 c = align(end, arena->grain);
+        if (!mem_os_commit(arena->base + arena->committed, c - arena->committed)) {
+            log_error("Failed to commit %u bytes of memory", c - arena->committed);
+            return NULL;
+        }
+        arena->committed = c;
+    }
+    
+    arena->used = end;
+    arena->last = ofs;
+    arena->allocs++;
+    if (end > arena->high)
+        arena->high = end;
+    return arena->base + ofs;
+}
+
+def_mem_free(mem_free)
+{
+    if (p && (u8*)p == arena->base + arena->last)
+        arena->used = arena->last;
+}
+
+// What the arena used since the last reset stays committed for the next round. Anything past
+// it was a spike, e.g. one big brush stroke, and is not held on to.
+def_mem_reset(mem_reset)
+{
+    u64 keep = align(arena->used, arena->grain);
+    if (keep < MEM_RESET_KEEP)
+        keep = align(MEM_RESET_KEEP, arena->grain);
+    if (keep < arena->committed) {
+        mem_os_decommit(arena->base + keep, arena->committed - keep);
+        arena->committed = keep;
+    }
+    
+    arena->prev = arena->used;
+    arena->used = 0;
+    arena->last = 0;
+}
+
+def_mem_pages_wanted(mem_pages_wanted)
+{
+    char *name = SDL_getenv(MEM_ENV_PAGES);
+    for(u32 i=0; name && i < MEM_PAGES_CNT; ++i) {
+        if (!strcmp(name, mem_pages_names[i]))
+            return i;
+    }
+    return MEM_PAGES_THP;
+}
+
+// Sizes are rounded up to a huge page whatever the pages, so that freeing never needs to know
+// which ones a block got
+def_mem_alloc_pages(mem_alloc_pages)
+{
+    size = align(size, MEM_HUGE_PAGE);
+#ifdef _WIN32
+    if (want == MEM_PAGES_HUGE) {
+        u64 lp = GetLargePageMinimum();
+        void *p = NULL;
+        if (lp && mem_lock_memory_privilege())
+            p = VirtualAlloc(NULL, align(size, lp), MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (p) {
+            *got = MEM_PAGES_HUGE;
+            return p;
+        }
+        log_error("Large pages unavailable, does the user have the lock pages in memory right? Using small pages");
+    }
+    *got = MEM_PAGES_SMALL;
+    return VirtualAlloc(NULL, size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+#else
+    if (want == MEM_PAGES_HUGE) {
+        void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *got = MEM_PAGES_HUGE;
+            return p;
+        }
+        log_error("Explicit huge pages unavailable, is vm.nr_hugepages set? Trying transparent ones");
+        want = MEM_PAGES_THP;
+    }
+    
+    u8 *p = mem_os_reserve(size, want);
+    if (!p)
+        return NULL;
+    if (!mem_os_commit(p, size)) {
+        munmap(p, size);
+        return NULL;
+    }
+    
+    *got = want;
+    if (want == MEM_PAGES_THP && madvise(p, size, MADV_HUGEPAGE)) {
+        log_error("Transparent huge pages unavailable, using small pages");
+        *got = MEM_PAGES_SMALL;
+    }
+    return p;
+#endif
+}
+
+def_mem_free_pages(mem_free_pages)
+{
+    if (!p)
+        return;
+#ifdef _WIN32
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, align(size, MEM_HUGE_PAGE));
+#endif
+}
+
+def_mem_report(mem_report)
+{
+    println("Memory:");
+    for(u32 i=0; i < prg->thread_count; ++i) {
+        struct mem_arena *s = &prg->allocs[i].scratch;
+        struct mem_arena *p = &prg->allocs[i].persist;
+        println("  thread %u: committed %fmb, high water %fmb", (u64)i,
+                (f64)(s->committed + p->committed) / mb(1), (f64)(s->high + p->high) / mb(1));
+        mem_report_arena("scratch", s);
+        mem_report_arena("persist", p);
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include "../solh/sol.h"
+
+#define MEM_COMMIT_GRAIN kb(64) /* pages are committed and handed back in steps of this */
+#define MEM_RESET_KEEP mb(1) /* committed memory a reset never hands back */
+#define MEM_ALIGN 16
+
+#define MEM_HUGE_PAGE mb(2)
+#define MEM_ENV_PAGES "PRG_HUGE_PAGES" /* off, thp or explicit, for the world active region and chunk pool, default thp */
+
+// Page sizes a block of memory can be backed by
+enum mem_pages {
+    MEM_PAGES_SMALL, // whatever the os gives by default
+    MEM_PAGES_THP, // transparent huge pages, asked for with madvise, the kernel can still say no
+    MEM_PAGES_HUGE, // explicit 2mb pages, need vm.nr_hugepages on linux and SeLockMemoryPrivilege on windows
+    MEM_PAGES_CNT,
+};
+
+// Reserves a range of address space up front and commits pages as allocations grow into it,
+// so an arena can be sized for the worst case while only what is used costs memory. Single
+// owner, no locking. The members are the stats, read them directly.
+struct mem_arena {
+    u8 *base;
+    u64 reserved;
+    u64 committed;
+    u64 used;
+    u64 last; // offset of the most recent allocation, for mem_free
+    u64 prev; // used at the last reset
+    u64 high; // most ever used at once
+    u64 allocs; // total
+    u64 grain; // commit step, a huge page for arenas backed by them
+    u32 pages; // enum mem_pages
+};
+
+#ifdef LIB
+
+extern char *mem_pages_names[MEM_PAGES_CNT];
+
+// Explicit huge pages cannot be committed a piece at a time, so MEM_PAGES_HUGE gives an
+// arena transparent ones
+#define def_create_mem_arena(name) int name(u64 reserve, u32 pages, struct mem_arena *arena)
+def_create_mem_arena(create_mem_arena);
+
+// NULL when the reserved range is used up or the pages cannot be committed
+#define def_mem_alloc(name) void* name(struct mem_arena *arena, u64 size)
+def_mem_alloc(mem_alloc);
+
+// Only the most recent allocation can be handed back, anything else stays until a reset
+#define def_mem_free(name) void name(struct mem_arena *arena, void *p)
+def_mem_free(mem_free);
+
+// Empty the arena, and return pages beyond what it used since the last reset to the os
+#define def_mem_reset(name) void name(struct mem_arena *arena)
+def_mem_reset(mem_reset);
+
+// Page size asked for in MEM_ENV_PAGES
+#define def_mem_pages_wanted(name) u32 name(void)
+def_mem_pages_wanted(mem_pages_wanted);
+
+// A block with a mapping of its own, committed up front, for large long lived arrays that
+// are scanned every frame and so gain the most from fewer tlb entries. Falls back to the
+// next smaller page size when 'want' is unavailable, 'got' is what it ended up with.
+#define def_mem_alloc_pages(name) void* name(u64 size, u32 want, u32 *got)
+def_mem_alloc_pages(mem_alloc_pages);
+
+#define def_mem_free_pages(name) void name(void *p, u64 size)
+def_mem_free_pages(mem_free_pages);
+
+// Usage and high water marks of every thread's arenas
+#define def_mem_report(name) void name(void)
+def_mem_report(mem_report);
+
+#endif // LIB
+
+#endif // MEM_H
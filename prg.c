@@ -2,26 +2,318 @@
 #include "gpu.h"
 
 struct program *prg;
+thread_persist u32 prg_ti;
 
 def_create_prg(create_prg);
 def_should_prg_shutdown(should_prg_shutdown);
 def_should_prg_reload(should_prg_reload);
 def_prg_update(prg_update);
 
+internal void prg_start_threads(void);
+internal void prg_build_frame(void);
+
+internal struct prg_field prg_fields[] = {
+    prg_field(struct program, allocs),
+#if TRACE
+    prg_field(struct program, trc),
+#endif
+    prg_field(struct program, rec),
+    prg_field(struct program, fsw),
+    prg_field(struct program, wt),
+    prg_field(struct program, flags),
+    prg_field(struct program, thread_count),
+    prg_field(struct program, time),
+    prg_field(struct program, pace),
+    prg_field(struct program, sim),
+    prg_field(struct program, frames),
+    prg_field(struct program, boot),
+};
+internal prg_layout(prg_layout_prg, struct program, PRG_LAYOUT_VERSION, prg_fields);
+
+internal struct prg_layout *prg_layouts[PRG_ST_CNT] = {
+    [PRG_ST_PRG] = &prg_layout_prg,
+    [PRG_ST_VDT] = &prg_layout_vdt,
+    [PRG_ST_WIN] = &prg_layout_win,
+    [PRG_ST_GPU] = &prg_layout_gpu,
+    [PRG_ST_WORLD] = &prg_layout_world,
+};
+
+internal u64 prg_fnv(u64 h, void *p, u64 n)
+{
+    for(u64 i=0; i < n; ++i)
+        h = (h ^ ((u8*)p)[i]) * 1099511628211ull;
+    return h;
+}
+
+internal u64 prg_layout_hash(struct prg_layout *l)
+{
+    u64 h = prg_fnv(14695981039346656037ull, l->name, SDL_strlen(l->name));
+    h = prg_fnv(h, &l->version, sizeof(l->version));
+    h = prg_fnv(h, &l->size, sizeof(l->size));
+    for(u32 i=0; i < l->field_cnt; ++i) {
+        h = prg_fnv(h, l->fields[i].name, SDL_strlen(l->fields[i].name));
+        h = prg_fnv(h, &l->fields[i].ofs, sizeof(l->fields[i].ofs));
+        h = prg_fnv(h, &l->fields[i].size, sizeof(l->fields[i].size));
+    }
+    return h;
+}
+
+// A member left out of a descriptor is silently dropped on every migration, so check that
+// the members cover the struct, give or take padding.
+internal void prg_layout_check(struct prg_layout *l)
+{
+    u32 end = 0;
+    for(u32 i=0; i < l->field_cnt; ++i) {
+        if (l->fields[i].ofs >= end + 16)
+            log_error("Layout for %s has a gap before %s, is a member missing?", l->name, l->fields[i].name);
+        end = l->fields[i].ofs + l->fields[i].size;
+    }
+    if (l->size >= end + 16)
+        log_error("Layout for %s does not reach the end of the struct, is a member missing?", l->name);
+}
+
+// The library's descriptors and their strings are unmapped on reload, so the state keeps
+// its own copy in one allocation.
+internal struct prg_layout* prg_layout_copy(struct prg_layout *l)
+{
+    u64 sz = sizeof(*l) + sizeof(*l->fields) * l->field_cnt + SDL_strlen(l->name) + 1;
+    for(u32 i=0; i < l->field_cnt; ++i)
+        sz += SDL_strlen(l->fields[i].name) + 1;
+    
+    struct prg_layout *c = SDL_malloc(sz);
+    *c = *l;
+    c->fields = (struct prg_field*)(c + 1);
+    
+    char *s = (char*)(c->fields + l->field_cnt);
+    u64 n = SDL_strlen(l->name) + 1;
+    memcpy(s, l->name, n);
+    c->name = s;
+    s += n;
+    
+    for(u32 i=0; i < l->field_cnt; ++i) {
+        c->fields[i] = l->fields[i];
+        n = SDL_strlen(l->fields[i].name) + 1;
+        memcpy(s, l->fields[i].name, n);
+        c->fields[i].name = s;
+        s += n;
+    }
+    return c;
+}
+
+// Bring a state block in line with the library's descriptor. A block whose layout did not
+// change stays where it is, so a reload that touches no state struct costs nothing here.
+// Otherwise it moves to a block of the new size, copying every member with the same name
+// and size and zeroing the rest. Returns the number of old members that were not carried.
+// Since the block can move, state never keeps pointers into its own block, only indices.
+internal u32 prg_migrate(struct prg_state *st, struct prg_layout *l)
+{
+    u64 h = prg_layout_hash(l);
+    if (st->data && st->hash == h)
+        return 0;
+    
+    prg_layout_check(l);
+    
+    void *data = SDL_calloc(1, l->size);
+    u32 lost = 0;
+    
+    if (st->data) {
+        struct prg_layout *o = st->layout;
+        println("Migrating %s, %u bytes to %u", l->name, (u64)o->size, (u64)l->size);
+        
+        for(u32 i=0; i < o->field_cnt; ++i) {
+            struct prg_field *f = &o->fields[i];
+            struct prg_field *g = NULL;
+            for(u32 j=0; j < l->field_cnt && o->version == l->version; ++j) {
+                if (!SDL_strcmp(f->name, l->fields[j].name)) {
+                    g = &l->fields[j];
+                    break;
+                }
+            }
+            if (g && g->size == f->size) {
+                memcpy((u8*)data + g->ofs, (u8*)st->data + f->ofs, f->size);
+            } else {
+                println("  %s dropped", f->name);
+                lost++;
+            }
+        }
+        SDL_free(st->data);
+        SDL_free(st->layout);
+    }
+    
+    st->data = data;
+    st->layout = prg_layout_copy(l);
+    st->hash = h;
+    return lost;
+}
+
 def_prg_load(prg_load)
 {
-    prg = p;
-    gpu = &prg->gpu;
-    win = &prg->win;
-    vdt = &prg->vdt;
-    world = &prg->world;
+    u64 pc = SDL_GetPerformanceCounter();
+    
+    u32 lost[PRG_ST_CNT];
+    bool rld = exe->st[PRG_ST_PRG].data != NULL;
+    for(u32 i=0; i < PRG_ST_CNT; ++i)
+        lost[i] = prg_migrate(&exe->st[i], prg_layouts[i]);
     
-    prg->fn.create = create_prg;
-    prg->fn.should_shutdown = should_prg_shutdown;
-    prg->fn.should_reload = should_prg_reload;
-    prg->fn.update = prg_update;
+    prg = exe->st[PRG_ST_PRG].data;
+    vdt = exe->st[PRG_ST_VDT].data;
+    win = exe->st[PRG_ST_WIN].data;
+    gpu = exe->st[PRG_ST_GPU].data;
+    world = exe->st[PRG_ST_WORLD].data;
+    
+    vdt->table = exe->vdt_table;
+    
+    exe->fn.create = create_prg;
+    exe->fn.should_shutdown = should_prg_shutdown;
+    exe->fn.should_reload = should_prg_reload;
+    exe->fn.update = prg_update;
+    
+    if (!rld) {
+        prg->boot.start = exe->start;
+        return;
+    }
+    
+    // Whatever could not be carried over is started again from nothing. What the old state
+    // owned (windows, vulkan objects, files) is leaked rather than freed by code that no
+    // longer knows its layout, which is fine for a development reload. The one exception is
+    // the window: a second one would stay open next to the first, so a handle that survived
+    // the migration is closed, and the gpu is started again with it since its surface and
+    // swapchain belong to the old window.
+    if (lost[PRG_ST_PRG])
+        log_error("Program state lost %u members in the reload, restart if anything misbehaves", (u64)lost[PRG_ST_PRG]);
+    if (lost[PRG_ST_WIN]) {
+        if (win->handle) {
+            if (!lost[PRG_ST_GPU] && gpu->dev)
+                vkDeviceWaitIdle(gpu->dev); // nothing may still be presenting to it
+            SDL_DestroyWindow(win->handle);
+        }
+        memset(win, 0, sizeof(*win));
+        create_win();
+    }
+    if ((lost[PRG_ST_GPU] || lost[PRG_ST_WIN]) && !(prg->flags & PRG_HEADLESS)) {
+        memset(gpu, 0, sizeof(*gpu));
+        create_gpu();
+    }
+    if (lost[PRG_ST_WORLD]) {
+        memset(world, 0, sizeof(*world));
+        create_world();
+    }
+    
+    if (prg->flags & PRG_RLD)
+        prg_start_threads();
     
     prg->flags &= ~PRG_RLD;
+    
+    println("State carried over in %fms", (f64)(SDL_GetPerformanceCounter() - pc) * 1e3 / SDL_GetPerformanceFrequency());
+}
+
+internal int prg_worker(void *arg)
+{
+    prg_ti = WT;
+    trc_thread(WT);
+    
+    while(1) {
+        SDL_SemWait(prg->wt.work);
+        if (SDL_AtomicGet(&prg->wt.quit))
+            break;
+        
+        mem_reset(&prg->allocs[WT].scratch);
+        
+        trc_beg("build_frame");
+        prg_build_frame();
+        trc_end();
+        
+        SDL_SemPost(prg->wt.done);
+    }
+    return 0;
+}
+
+// Wait until the next frame is due. SDL_Delay only promises to sleep at least as long as it
+// is asked to, often a millisecond or more over, so it stops short and the rest is spun.
+internal void prg_pace(void)
+{
+    if (!prg->pace.period || (prg->rec.flags & REC_REPLAY))
+        return;
+    
+    u64 pf = SDL_GetPerformanceFrequency();
+    u64 now = SDL_GetPerformanceCounter();
+    if (!prg->pace.next) {
+        prg->pace.next = now + prg->pace.period;
+        return;
+    }
+    
+    u64 spin = pf * PACE_SPIN_US / 1000000;
+    if (prg->pace.next > now + spin)
+        SDL_Delay((u32)((prg->pace.next - spin - now) * 1000 / pf));
+    while((now = SDL_GetPerformanceCounter()) < prg->pace.next)
+        _mm_pause();
+    
+    u64 err = (u64)((f64)(now - prg->pace.next) * 1e9 / pf);
+    prg->pace.err_sum += err;
+    prg->pace.err_cnt++;
+    if (err > prg->pace.err_max)
+        prg->pace.err_max = err;
+    
+    // A frame that overran by more than a whole period starts a new schedule rather than
+    // letting the following frames run back to back to catch up.
+    prg->pace.next += prg->pace.period;
+    if (prg->pace.next <= now)
+        prg->pace.next = now + prg->pace.period;
+}
+
+// Returns whether a frame was built since the last call
+internal bool prg_await_worker(void)
+{
+    if (!prg->wt.busy)
+        return false;
+    
+    trc_beg("prg_await_worker");
+    u64 pc = SDL_GetPerformanceCounter();
+    SDL_SemWait(prg->wt.done);
+    prg->wt.wait_ns += (u64)((f64)(SDL_GetPerformanceCounter() - pc) * 1e9 / SDL_GetPerformanceFrequency());
+    trc_end();
+    
+    prg->wt.busy = false;
+    return true;
+}
+
+internal void prg_kick_worker(void)
+{
+    prg->wt.busy = true;
+    SDL_SemPost(prg->wt.work);
+}
+
+// Anything running on another thread is executing library code, so it has to be
+// stopped before the library is unloaded and restarted once the new one is bound.
+internal void prg_start_threads(void)
+{
+    trc_thread(MT);
+    if (trc_start())
+        log_error("Failed to restart trace thread");
+    if (fsw_start())
+        log_error("Failed to restart file watcher");
+    
+    if (prg->thread_count <= WT || !prg->wt.work)
+        return;
+    
+    SDL_AtomicSet(&prg->wt.quit, 0);
+    prg->wt.thread = SDL_CreateThread(prg_worker, "wt", NULL);
+    if (!prg->wt.thread)
+        log_error("Failed to create worker thread, building frames on the main thread - %s", SDL_GetError());
+}
+
+internal void prg_stop_threads(void)
+{
+    if (prg->wt.thread) {
+        prg_await_worker();
+        SDL_AtomicSet(&prg->wt.quit, 1);
+        SDL_SemPost(prg->wt.work);
+        SDL_WaitThread(prg->wt.thread, NULL);
+        prg->wt.thread = NULL;
+    }
+    world_await_save();
+    fsw_stop();
+    trc_stop();
 }
 
 internal struct thread_config {
@@ -30,37 +322,135 @@ internal struct thread_config {
 } thread_configs[] = {
     [MT] = {
         .scratch_size = MAIN_THREAD_SCRATCH_SIZE,
-        .persist_size = MAIN_THREAD_BLOCK_SIZE,
+        .persist_size = MAIN_THREAD_PERSIST_SIZE,
+    },
+    [WT] = {
+        .scratch_size = 0,
+        .persist_size = 0,
     },
 };
 
+// The world only needs the window's maximum extent, so it is set up while the window and the
+// gpu are, which both spend most of their time waiting on the driver
+internal int prg_world_thread(void *arg)
+{
+    u64 pc = SDL_GetPerformanceCounter();
+    create_world();
+    prg->boot.ns[PRG_BOOT_WORLD] = prg_ns_since(pc);
+    return 0;
+}
+
+internal char *prg_boot_names[PRG_BOOT_CNT] = {
+    [PRG_BOOT_LOAD] =    "library load:  ",
+    [PRG_BOOT_OS] =      "os, allocators:",
+    [PRG_BOOT_REC] =     "trace, record: ",
+    [PRG_BOOT_WIN] =     "window:        ",
+    [PRG_BOOT_GPU_DEV] = "gpu device:    ",
+    [PRG_BOOT_GPU_SH] =  "gpu shaders:   ",
+    [PRG_BOOT_GPU_PL] =  "gpu pipeline:  ",
+    [PRG_BOOT_WORLD] =   "world:         ",
+    [PRG_BOOT_THREADS] = "threads:       ",
+    [PRG_BOOT_FRAME] =   "first frame:   ",
+};
+
+internal void prg_boot_report(void)
+{
+    prg->boot.ns[PRG_BOOT_FRAME] = prg_ns_since(prg->boot.created);
+    prg->boot.done = true;
+    
+    println("\nStartup took %fms to the first frame", (f64)prg_ns_since(prg->boot.start) / 1e6);
+    for(u32 i=0; i < PRG_BOOT_CNT; ++i)
+        println("  %s %fms", prg_boot_names[i], (f64)prg->boot.ns[i] / 1e6);
+}
+
 def_create_prg(create_prg)
 {
+    prg->boot.ns[PRG_BOOT_LOAD] = prg_ns_since(prg->boot.start);
+    u64 pc = SDL_GetPerformanceCounter();
+    
     create_os();
     prg->thread_count = MAX_THREADS < (os.thread_count >> 1) ? MAX_THREADS : (os.thread_count >> 1);
     
     for(u32 i=0; i < prg->thread_count; ++i) {
         if (thread_configs[i].scratch_size == 0) {
-            create_allocator_linear(NULL, THREAD_DEFAULT_SCRATCH_SIZE, &prg->allocs[i].scratch);
+            create_mem_arena(THREAD_DEFAULT_SCRATCH_SIZE, MEM_PAGES_SMALL, &prg->allocs[i].scratch);
         } else {
-            create_allocator_linear(NULL, thread_configs[i].scratch_size, &prg->allocs[i].scratch);
+            create_mem_arena(thread_configs[i].scratch_size, MEM_PAGES_SMALL, &prg->allocs[i].scratch);
         }
         
         if (thread_configs[i].persist_size == 0) {
-            create_allocator_arena(os.page_size, &prg->allocs[i].persist);
+            create_mem_arena(THREAD_DEFAULT_PERSIST_SIZE, MEM_PAGES_SMALL, &prg->allocs[i].persist);
         } else {
-            create_allocator_arena(thread_configs[i].persist_size, &prg->allocs[i].persist);
+            create_mem_arena(thread_configs[i].persist_size, MEM_PAGES_SMALL, &prg->allocs[i].persist);
         }
     }
+    prg->boot.ns[PRG_BOOT_OS] = prg_ns_since(pc);
+    pc = SDL_GetPerformanceCounter();
+    
+    if (SDL_getenv(WORLD_ENV_BENCH_PAGES)) {
+        world_bench_pages();
+        prg->flags |= PRG_EXIT;
+        return;
+    }
+    
+    if (create_trc())
+        log_error("Failed to create tracer, continuing without it");
+    
+    if (SDL_getenv(PRG_ENV_HEADLESS))
+        prg->flags |= PRG_HEADLESS;
+    
+    char *tick_hz = SDL_getenv(SIM_ENV_TICK_HZ);
+    u32 hz = tick_hz ? (u32)SDL_atoi(tick_hz) : SIM_TICK_HZ;
+    prg->sim.tick_ns = 1000000000ull / (hz ? hz : SIM_TICK_HZ);
     
+    char *fps = SDL_getenv(PRG_ENV_FPS);
+    if (fps && SDL_atoi(fps) > 0)
+        prg->pace.period = SDL_GetPerformanceFrequency() / (u64)SDL_atoi(fps);
+    
+    if (create_rec())
+        log_error("Failed to set up input recording, continuing with live input");
+    
+    if (create_fsw())
+        log_error("Failed to start file watcher, continuing without hot reloading");
+    
+    prg->boot.ns[PRG_BOOT_REC] = prg_ns_since(pc);
+    
+    // Nothing else may allocate from the main thread's persist arena until the world is done
+    win_query_max();
+    SDL_Thread *world_thread = SDL_CreateThread(prg_world_thread, "world", NULL);
+    if (!world_thread)
+        log_error("Failed to create world setup thread, setting up the world after the gpu - %s", SDL_GetError());
+    
+    pc = SDL_GetPerformanceCounter();
     create_win();
-    create_gpu();
-    create_world();
+    prg->boot.ns[PRG_BOOT_WIN] = prg_ns_since(pc);
+    
+    if (!(prg->flags & PRG_HEADLESS))
+        create_gpu();
+    
+    if (world_thread)
+        SDL_WaitThread(world_thread, NULL);
+    else
+        prg_world_thread(NULL);
+    
+    pc = SDL_GetPerformanceCounter();
+    
+    // the semaphores live as long as the program, only the thread is restarted across reloads
+    prg->wt.work = SDL_CreateSemaphore(0);
+    prg->wt.done = SDL_CreateSemaphore(0);
+    if (!prg->wt.work || !prg->wt.done) {
+        log_error("Failed to create worker semaphores, building frames on the main thread - %s", SDL_GetError());
+        prg->wt.work = NULL;
+    } else {
+        prg_start_threads();
+    }
+    prg->boot.ns[PRG_BOOT_THREADS] = prg_ns_since(pc);
+    prg->boot.created = SDL_GetPerformanceCounter();
 }
 
 def_should_prg_shutdown(should_prg_shutdown)
 {
-    return win_should_close();
+    return (prg->flags & PRG_EXIT) || win_should_close();
 }
 
 def_should_prg_reload(should_prg_reload)
@@ -68,14 +458,54 @@ def_should_prg_reload(should_prg_reload)
     return prg->flags & PRG_RLD;
 }
 
-#define RLD_WT secs_to_ms(2) /* Time the hot reloader waits before checking for source changes */
+// Simulate and fill gpu->draw.build. Runs on the worker when there is one, so it must
+// only touch the world, the window's input queue and the build half of the draw buffer.
+internal void prg_build_frame(void)
+{
+    trc_beg("world_update");
+    world_update();
+    trc_end();
+    
+    // Fixed step simulation: run however many ticks the frame's time covers. Past SIM_MAX_TICKS
+    // the simulation runs slow rather than spending ever longer frames trying to catch up.
+    trc_beg("world_tick");
+    prg->sim.acc += prg->time.dns;
+    for(u32 i=0; prg->sim.acc >= prg->sim.tick_ns; ++i) {
+        if (i == SIM_MAX_TICKS) {
+            prg->sim.dropped += prg->sim.acc / prg->sim.tick_ns;
+            prg->sim.acc %= prg->sim.tick_ns;
+            break;
+        }
+        world_tick();
+        prg->sim.acc -= prg->sim.tick_ns;
+        prg->sim.ticks++;
+    }
+    trc_end();
+    
+    world_publish();
+    gpu_begin_build();
+    
+    trc_beg("world_draw");
+    world_draw();
+    trc_end();
+    
+    gpu_end_build();
+}
 
 def_prg_update(prg_update)
 {
-    for(u32 i=0; i < cl_array_size(prg->allocs); ++i) {
-        reset_allocator(&prg->allocs[i].scratch);
-        reset_allocator(&prg->allocs[i].persist);
-    }
+    trc_beg("frame");
+    
+    // Everything the worker touches is ours again until it is kicked below
+    bool built = prg_await_worker();
+    
+    // Any frame cap wait goes before the timers and the window poll, so input is sampled as
+    // late as possible, right before the worker builds the draw list from it.
+    trc_beg("prg_pace");
+    prg_pace();
+    trc_end();
+    
+    mem_reset(&prg->allocs[MT].scratch);
     
     prg->frames.cnt++;
     
@@ -83,42 +513,76 @@ def_prg_update(prg_update)
     prg->time.dms = SDL_GetTicks() - prg->time.ms;
     prg->time.ms += prg->time.dms;
     
+    u64 pc = SDL_GetPerformanceCounter();
+    prg->time.dns = prg->time.pc ? (u64)((f64)(pc - prg->time.pc) * 1e9 / SDL_GetPerformanceFrequency()) : 0;
+    prg->time.ns += prg->time.dns;
+    prg->time.pc = pc;
+    
     if (prg->frames.cnt > 5 && prg->time.dms > prg->frames.worst)
         prg->frames.worst = prg->time.dms;
     
     prg->frames.avg = prg->time.ms / prg->frames.cnt;
+    vdt_frame(); // close out the last frame's vulkan call counts before reporting them
     {
         timed_trigger(frame_time_trigger, false, secs_to_ms(2));
-        if (frame_time_trigger && REPORT_FRAME_TIME)
+        if (frame_time_trigger)
+            vdt_report();
+        if (frame_time_trigger && REPORT_FRAME_TIME) {
             println("average frame time: %ums", prg->frames.avg);
+            println("  simulation ticks: %u, dropped: %u", prg->sim.ticks, prg->sim.dropped);
+            println("  waiting on worker: %fms in the last 2s", (f64)prg->wt.wait_ns / 1e6);
+            if (prg->pace.err_cnt)
+                println("  pacing target: %fms, late by avg %fms, max %fms", (f64)prg->pace.period * 1e3 / SDL_GetPerformanceFrequency(),
+                        (f64)prg->pace.err_sum / prg->pace.err_cnt / 1e6, (f64)prg->pace.err_max / 1e6);
+            println("  gpu transfer: %fms, gpu draw: %fms", (f64)prg->frames.gpu_xfer_ms, (f64)prg->frames.gpu_draw_ms);
+            println("  vs invocations: %u, primitives: %u, fs invocations: %u",
+                    prg->frames.gpu_ps[GPU_PS_VS], prg->frames.gpu_ps[GPU_PS_CLIP], prg->frames.gpu_ps[GPU_PS_FS]);
+            gpu_heap_report();
+            mem_report();
+        }
+        if (frame_time_trigger) {
+            prg->wt.wait_ns = 0;
+            prg->pace.err_sum = 0;
+            prg->pace.err_max = 0;
+            prg->pace.err_cnt = 0;
+        }
     }
     
+    /* window */
+    // Minimised, or nothing happening in the world: block on events rather than spinning.
+    // A wait ends as soon as anything arrives, and the next frame is back at full rate.
+    u32 wait_ms = 0;
+    if (!(prg->rec.flags & REC_REPLAY) && ((win->flags & WIN_MIN) || world_asleep()))
+        wait_ms = PRG_IDLE_MS;
+    
+    trc_beg("win_poll");
+    win_poll(wait_ms);
+    trc_end();
+    
+    if (rec_frame())
+        log_error("Input recording failed");
+    
     /* hotloader */
-    internal u32 rld_timer = 0;
-    if (rld_timer == 0)
-        rld_timer = win_ms();
+    // the file watcher's changes arrive with the window events
+    u32 changed = fsw_take();
+    if (changed & (1 << FSW_LIB))
+        prg->flags |= PRG_RLD;
     
-    if (rld_timer < win_ms()) {
-        rld_timer += RLD_WT;
-        
-        if (cmpftim(FTIM_MOD, LIB_SRC, LIB_SRC_TEMP) < 0)
-            prg->flags |= PRG_RLD;
-        
-        if (cmpftim(FTIM_MOD, SH_SRC_OUT_URI, SH_SRC_URI) < 0) {
-            println("Recompiling shaders");
-            // spirv parser to recreate pipeline layout?
-            if (gpu_create_sh()) {
-                log_error("Failed to recompile shader code after source change");
-                if (!gpu->sh.vert || !gpu->sh.frag)
-                    return -1;
-            }
+    if ((changed & (1 << FSW_SH)) && !(prg->flags & PRG_HEADLESS)) {
+        println("Recompiling shaders");
+        // spirv parser to recreate pipeline layout?
+        if (gpu_create_sh()) {
+            log_error("Failed to recompile shader code after source change");
+            if (!gpu->sh.vert || !gpu->sh.frag)
+                return -1;
         }
     }
     
-    /* window */
-    win_poll();
+    // loading it under a running simulation and its snapshots is left to a restart
+    if ((changed & (1 << FSW_WORLD)) && world_file_changed())
+        println("World file changed on disk, restart to load it");
     
-    if (win->flags & WIN_RSZ) {
+    if ((win->flags & WIN_RSZ) && !(prg->flags & PRG_HEADLESS)) {
         if (gpu_handle_win_resize()) {
             log_error("Failed to handle window resize");
             return -1;
@@ -126,13 +590,46 @@ def_prg_update(prg_update)
     }
     
     /* update */
-    world_update();
+    // Nothing is simulated or drawn while minimised. Frames still tick over every PRG_IDLE_MS
+    // so the hotloader keeps working.
+    bool paused = win->flags & WIN_MIN;
     
+    // With a worker, frame N is submitted from the half it finished last frame while it builds
+    // N+1 into the other one, so a frame costs about max(build, submit) rather than the sum.
+    if (!prg->wt.thread && !paused) {
+        prg_build_frame();
+        built = true;
+    }
+    if (built) {
+        gpu->draw.ready = gpu->draw.build;
+        gpu->draw.build = (gpu->draw.build + 1) % FRAME_WRAP;
+    }
+    if (prg->wt.thread && !paused && !(prg->flags & PRG_RLD) && !win_should_close())
+        prg_kick_worker();
     
-    gpu_update();
+    if (built && !paused && !(prg->flags & PRG_HEADLESS)) {
+        trc_beg("gpu_update");
+        int res = gpu_update();
+        trc_end();
+        if (res) {
+            log_error("Failed to update gpu");
+            return -1;
+        }
+    }
+    
+    if (built && !paused && prg->boot.created && !prg->boot.done)
+        prg_boot_report();
     
     /* end frame */
     //os_sleep_ms(0); // relinquish time slice
     
+    trc_end();
+    
+    if ((prg->flags & PRG_RLD) || win_should_close())
+        prg_stop_threads();
+    
+    if (win_should_close())
+        rec_close();
+    
     return 0;
 }
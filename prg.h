@@ -3,6 +3,10 @@
 
 #include "../solh/sol.h"
 
+#include "mem.h"
+#include "trc.h"
+#include "rec.h"
+#include "fsw.h"
 #include "gpu.h"
 #include "win.h"
 #include "vdt.h"
@@ -10,23 +14,31 @@
 
 #define REPORT_FRAME_TIME 0
 
-#define INIT_WIN_W 640
-#define INIT_WIN_H 480
+#define SIM_TICK_HZ 60 /* simulation rate, independent of the frame rate */
+#define SIM_MAX_TICKS 8 /* ticks one frame may run to catch up before time is dropped */
+#define SIM_ENV_TICK_HZ "PRG_TICK_HZ" /* overrides SIM_TICK_HZ */
 
-#define TOTAL_MEM mb(32)
-#define MAX_THREADS 1 /* 1 == only main thread */
-#define MT 0
+// Longest a frame blocks on window events while minimised or while the world is asleep. The
+// simulation has to keep up at this rate, SIM_MAX_TICKS ticks must cover at least this long.
+#define PRG_IDLE_MS 100
 
-#define MAIN_THREAD_SCRATCH_SIZE (TOTAL_MEM >> 2)
-#define THREAD_DEFAULT_SCRATCH_SIZE ((TOTAL_MEM - MAIN_THREAD_SCRATCH_SIZE) / MAX_THREADS)
+#define PRG_ENV_FPS "PRG_FPS" /* frame rate cap, unset or 0 == uncapped */
+#define PACE_SPIN_US 1500 /* frames sleep until this close to being due, then spin */
+
+#define INIT_WIN_W 640
+#define INIT_WIN_H 480
 
-// 0 == use page size
-#define MAIN_THREAD_BLOCK_SIZE 0
-#define THREAD_DEFAULT_BLOCK_SIZE 0
+// Address space reserved for each thread's arenas. Pages are only committed as an arena grows
+// into its range, so these are limits rather than costs. Scratch is emptied every frame,
+// persist lives as long as the program.
+#define MAIN_THREAD_SCRATCH_SIZE (1ull << 32) /* 4gb */
+#define THREAD_DEFAULT_SCRATCH_SIZE (1ull << 32)
+#define MAIN_THREAD_PERSIST_SIZE (1ull << 32)
+#define THREAD_DEFAULT_PERSIST_SIZE (1ull << 30) /* 1gb */
 
-struct program;
+struct prg_exe;
 
-#define def_prg_load(name) void name(struct program *p)
+#define def_prg_load(name) void name(struct prg_exe *exe)
 typedef def_prg_load(prg_load_t);
 dll_export def_prg_load(prg_load);
 
@@ -42,11 +54,77 @@ typedef def_should_prg_reload(should_prg_reload_t);
 #define def_prg_update(name) int name(void)
 typedef def_prg_update(prg_update_t);
 
+#define PRG_ENV_HEADLESS "PRG_HEADLESS" /* no window or gpu, for replays on machines without a display */
+
 enum program_flags {
     PRG_RLD = 0x01,
+    PRG_HEADLESS = 0x02,
+    PRG_EXIT = 0x04, // create_prg ran a one-off job instead of setting up, shut down straight away
 };
 
-struct program {
+// Startup stages in the order they are reported. The gpu shader stage and the world run on
+// their own threads alongside the stages next to them, so the stages add up to more than the
+// total.
+enum prg_boot_stages {
+    PRG_BOOT_LOAD, // process start to create_prg, sdl init and the first library load
+    PRG_BOOT_OS, // os info and allocators
+    PRG_BOOT_REC, // tracer, input recording and file watcher
+    PRG_BOOT_WIN,
+    PRG_BOOT_GPU_DEV, // instance, device and swapchain
+    PRG_BOOT_GPU_SH, // shader compile and pipeline cache read, alongside GPU_DEV
+    PRG_BOOT_GPU_PL, // shader modules, pipeline and the rest of the draw objects
+    PRG_BOOT_WORLD, // alongside WIN and the gpu
+    PRG_BOOT_THREADS,
+    PRG_BOOT_FRAME, // end of create_prg to the first frame presented
+    PRG_BOOT_CNT,
+};
+
+#define prg_ns_since(pc) ((u64)((f64)(SDL_GetPerformanceCounter() - (pc)) * 1e9 / SDL_GetPerformanceFrequency()))
+
+// Blocks of state that live across reloads, each with a layout descriptor so that a library
+// built with a different struct can take them over. In the order they are migrated.
+enum prg_state_indices {
+    PRG_ST_PRG,
+    PRG_ST_VDT,
+    PRG_ST_WIN,
+    PRG_ST_GPU,
+    PRG_ST_WORLD,
+    PRG_ST_CNT,
+};
+
+// A top level member of a state struct. Members are matched by name across reloads and
+// carried over as long as their size is unchanged.
+struct prg_field {
+    char *name;
+    u32 ofs;
+    u32 size;
+};
+
+// Bump version when a member keeps its name and size but changes meaning, e.g. a nested
+// struct reordered internally, since the descriptor cannot see that. A version change
+// carries nothing over.
+struct prg_layout {
+    char *name;
+    u32 version;
+    u32 size;
+    u32 field_cnt;
+    struct prg_field *fields;
+};
+
+#define prg_field(type, member) {#member, offsetof(type, member), sizeof(((type*)0)->member)}
+#define prg_layout(layout_name, type, ver, field_array) \
+    struct prg_layout layout_name = {#type, ver, sizeof(type), cl_array_size(field_array), field_array}
+
+struct prg_state {
+    void *data;
+    struct prg_layout *layout; // copy of the descriptor data was laid out with, names and all
+    u64 hash;
+};
+
+// All the exe sees of the program. The exe is never reloaded, so this is the one struct
+// that cannot change without a restart. Everything else is allocated by the library and
+// checked against its descriptor on every load.
+struct prg_exe {
     struct {
         create_prg_t (*create);
         should_prg_shutdown_t (*should_shutdown);
@@ -54,16 +132,36 @@ struct program {
         prg_update_t (*update);
     } fn;
     
+    struct vdt_elem *vdt_table;
+    struct prg_state st[PRG_ST_CNT];
+    u64 start; // performance counter at process start
+};
+
+#define PRG_LAYOUT_VERSION 1
+
+struct program {
     struct {
-        allocator_t scratch;
-        allocator_t persist;
+        struct mem_arena scratch;
+        struct mem_arena persist;
     } allocs[MAX_THREADS];
+
+#if TRACE
+    struct trc trc;
+#endif
     
-    struct gpu gpu;
-    struct win win;
-    struct vdt vdt;
+    struct rec rec;
+    struct fsw fsw;
     
-    struct world world;
+    // Frame pipeline: the worker runs world_update, the ticks and world_draw for the next
+    // frame while the main thread records and submits the last one the worker finished.
+    struct {
+        SDL_Thread *thread;
+        SDL_sem *work;
+        SDL_sem *done;
+        SDL_atomic_t quit;
+        bool busy;
+        u64 wait_ns; // main thread time spent waiting on the worker since the last report
+    } wt;
     
     u32 flags;
     u32 thread_count;
@@ -71,22 +169,60 @@ struct program {
     struct {
         u32 ms; // time elapsed
         u32 dms;
+        
+        u64 pc; // performance counter at the start of the frame
+        u64 ns; // time elapsed, high resolution
+        u64 dns;
     } time;
     
+    struct {
+        u64 period; // performance counter ticks per frame, 0 == uncapped
+        u64 next; // when the next frame is due
+        u64 err_sum; // ns frames started late, since the last report
+        u64 err_max;
+        u32 err_cnt;
+    } pace;
+    
+    struct {
+        u64 tick_ns;
+        u64 acc; // time not yet simulated
+        u64 ticks; // total
+        u64 dropped; // ticks skipped because frames fell too far behind
+    } sim;
+    
     struct {
         u32 cnt;
         u32 avg; // 1ms
         u32 worst; // 7-10ms
+        
+        // gpu side, read back from query pools a frame or more late
+        f32 gpu_xfer_ms;
+        f32 gpu_draw_ms;
+        u64 gpu_ps[GPU_PS_CNT];
     } frames;
+    
+    // Time from process start to the first presented frame is what an instance started on
+    // demand has to wait for, so it is reported once that frame is out
+    struct {
+        u64 start; // performance counter at process start
+        u64 created; // performance counter when create_prg returned, 0 == still starting
+        u64 ns[PRG_BOOT_CNT];
+        bool done;
+    } boot;
 };
 
 #ifdef LIB
 extern struct program *prg;
 
+extern struct prg_layout prg_layout_vdt;
+extern struct prg_layout prg_layout_win;
+extern struct prg_layout prg_layout_gpu;
+extern struct prg_layout prg_layout_world;
+
 #define get_thread_alloc(thread_index) prg->allocs[thread_index]
-#define salloc(thread_index, sz) allocate(&prg->allocs[thread_index].scratch, sz)
-#define palloc(thread_index, sz) allocate(&prg->allocs[thread_index].persist, sz)
-#define pfree(thread_index, p) deallocate(&prg->allocs[thread_index].persist, p)
+#define salloc(thread_index, sz) mem_alloc(&prg->allocs[thread_index].scratch, sz)
+#define palloc(thread_index, sz) mem_alloc(&prg->allocs[thread_index].persist, sz)
+#define pfree(thread_index, p) mem_free(&prg->allocs[thread_index].persist, p)
 #endif
 
 #endif // PRG_H
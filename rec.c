@@ -0,0 +1,189 @@
+#include "rec.h"
+#include "prg.h"
+
+internal int rec_open_replay(char *uri)
+{
+    prg->rec.file = SDL_RWFromFile(uri, "rb");
+    if (!prg->rec.file) {
+        log_error("Failed to open replay %s - %s", uri, SDL_GetError());
+        return -1;
+    }
+    
+    if (SDL_RWread(prg->rec.file, &prg->rec.hdr, sizeof(prg->rec.hdr), 1) != 1 ||
+        prg->rec.hdr.magic != REC_MAGIC || prg->rec.hdr.version != REC_VERSION ||
+        prg->rec.hdr.ev_size != sizeof(struct window_input))
+    {
+        log_error("%s is not a replay this build can read", uri);
+        SDL_RWclose(prg->rec.file);
+        prg->rec.file = NULL;
+        return -1;
+    }
+    
+    char *rate = SDL_getenv(REC_ENV_RATE);
+    prg->rec.rate = rate ? SDL_atof(rate) : 1.0;
+    prg->rec.flags |= REC_REPLAY;
+    
+    println("Replaying %s at %fx", uri, prg->rec.rate);
+    return 0;
+}
+
+internal int rec_open_record(char *uri)
+{
+    prg->rec.file = SDL_RWFromFile(uri, "wb");
+    if (!prg->rec.file) {
+        log_error("Failed to open recording %s - %s", uri, SDL_GetError());
+        return -1;
+    }
+    prg->rec.flags |= REC_RECORD;
+    
+    println("Recording input to %s", uri);
+    return 0;
+}
+
+// wait until the wall clock catches up with the recorded time, scaled by the replay rate
+internal void rec_pace(void)
+{
+    if (prg->rec.rate <= 0)
+        return;
+    
+    f64 target = (f64)prg->rec.replay_ms / prg->rec.rate;
+    for(;;) {
+        f64 now = (f64)(SDL_GetPerformanceCounter() - prg->rec.replay_pc) * 1000 / SDL_GetPerformanceFrequency();
+        if (now >= target)
+            break;
+        if (target - now > 2)
+            SDL_Delay((u32)(target - now) - 1);
+    }
+}
+
+internal int rec_replay_frame(void)
+{
+    if (!prg->rec.replay_pc)
+        prg->rec.replay_pc = SDL_GetPerformanceCounter();
+    
+    struct rec_frame f;
+    if (SDL_RWread(prg->rec.file, &f, sizeof(f), 1) != 1) {
+        f64 ms = (f64)(SDL_GetPerformanceCounter() - prg->rec.replay_pc) * 1000 / SDL_GetPerformanceFrequency();
+        println("Replay finished: %u frames in %fms, %fms per frame",
+                (u64)prg->rec.replay_frames, ms, ms / (prg->rec.replay_frames ? prg->rec.replay_frames : 1));
+        win->flags |= WIN_CLO;
+        return 0;
+    }
+    
+    prg->rec.replay_ms += f.dms;
+    prg->rec.replay_frames++;
+    rec_pace();
+    
+    // the recorded frame time replaces the measured one, so the simulation runs the same ticks
+    prg->time.ms += f.dms - prg->time.dms;
+    prg->time.dms = f.dms;
+    prg->time.ns += f.dns - prg->time.dns;
+    prg->time.dns = f.dns;
+    
+    if (f.dim.w != win->dim.w || f.dim.h != win->dim.h) {
+        if (prg->flags & PRG_HEADLESS) {
+            win->dim = f.dim;
+            win->rdim.w = 1.0f / win->dim.w;
+            win->rdim.h = 1.0f / win->dim.h;
+        } else {
+            SDL_SetWindowSize(win->handle, f.dim.w, f.dim.h);
+        }
+    }
+    
+    for(u32 i=0; i < f.ev_cnt; ++i) {
+        struct window_input ev;
+        if (SDL_RWread(prg->rec.file, &ev, sizeof(ev), 1) != 1) {
+            log_error("Replay is truncated");
+            win->flags |= WIN_CLO;
+            return -1;
+        }
+        if (win_push(&ev))
+            return -1;
+    }
+    return 0;
+}
+
+internal int rec_record_frame(void)
+{
+    struct rec_frame f = {.dns = prg->time.dns, .dms = prg->time.dms, .ev_cnt = prg->rec.ev_cnt, .dim = win->dim};
+    if (SDL_RWwrite(prg->rec.file, &f, sizeof(f), 1) != 1 ||
+        SDL_RWwrite(prg->rec.file, prg->rec.evs, sizeof(*prg->rec.evs), f.ev_cnt) != f.ev_cnt)
+    {
+        log_error("Failed to write recording, stopping - %s", SDL_GetError());
+        rec_close();
+        return -1;
+    }
+    prg->rec.ev_cnt = 0;
+    return 0;
+}
+
+/**************************************************************************/
+// Header functions
+
+def_create_rec(create_rec)
+{
+    char *replay = SDL_getenv(REC_ENV_REPLAY);
+    char *record = SDL_getenv(REC_ENV_RECORD);
+    
+    if (replay) {
+        if (record)
+            log_error("%s and %s are both set, only replaying", REC_ENV_REPLAY, REC_ENV_RECORD);
+        return rec_open_replay(replay);
+    }
+    if (record)
+        return rec_open_record(record);
+    return 0;
+}
+
+def_rec_event(rec_event)
+{
+    if (!(prg->rec.flags & REC_RECORD))
+        return;
+    
+    if (prg->rec.ev_cnt == prg->rec.ev_cap) {
+        u32 cap = prg->rec.ev_cap ? prg->rec.ev_cap * 2 : 256;
+        void *evs = SDL_realloc(prg->rec.evs, sizeof(*ev) * cap);
+        if (!evs) {
+            log_error("Failed to grow the recording event buffer, stopping");
+            rec_close();
+            return;
+        }
+        prg->rec.evs = evs;
+        prg->rec.ev_cap = cap;
+    }
+    prg->rec.evs[prg->rec.ev_cnt++] = *ev;
+}
+
+def_rec_frame(rec_frame)
+{
+    if (prg->rec.flags & REC_REPLAY)
+        return rec_replay_frame();
+    
+    if (!(prg->rec.flags & REC_RECORD))
+        return 0;
+    
+    // the header waits for the first frame so it has the window's final dimensions
+    if (!prg->rec.hdr.magic) {
+        prg->rec.hdr = (struct rec_header) {
+            .magic = REC_MAGIC,
+            .version = REC_VERSION,
+            .ev_size = sizeof(struct window_input),
+            .max = win->max,
+            .dim = win->dim,
+        };
+        if (SDL_RWwrite(prg->rec.file, &prg->rec.hdr, sizeof(prg->rec.hdr), 1) != 1) {
+            log_error("Failed to write recording header - %s", SDL_GetError());
+            rec_close();
+            return -1;
+        }
+    }
+    return rec_record_frame();
+}
+
+def_rec_close(rec_close)
+{
+    if (prg->rec.file)
+        SDL_RWclose(prg->rec.file);
+    prg->rec.file = NULL;
+    prg->rec.flags = 0;
+}
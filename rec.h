@@ -0,0 +1,73 @@
+#ifndef REC_H
+#define REC_H
+
+#include "SDL2/SDL.h"
+
+#include "../solh/sol.h"
+#include "win.h"
+
+#define REC_MAGIC 0x52475250 /* "PRGR" */
+#define REC_VERSION 2
+
+#define REC_ENV_RECORD "PRG_RECORD" /* file to record input to */
+#define REC_ENV_REPLAY "PRG_REPLAY" /* file to replay input from, live input is ignored */
+#define REC_ENV_RATE "PRG_REPLAY_RATE" /* replay speed multiplier, 0 == as fast as possible, default 1 */
+
+enum rec_flags {
+    REC_RECORD = 0x01,
+    REC_REPLAY = 0x02,
+};
+
+struct rec_header {
+    u32 magic;
+    u32 version;
+    u32 ev_size; // sizeof(struct window_input) when recorded
+    u32 pad;
+    struct extent_u16 max; // window dimensions when recorded
+    struct extent_u16 dim;
+};
+
+// one per frame, followed by the events win_poll published that frame
+struct rec_frame {
+    u64 dns;
+    u32 dms;
+    u32 ev_cnt;
+    struct extent_u16 dim;
+    u32 pad;
+};
+
+struct rec {
+    SDL_RWops *file;
+    u32 flags; // enum rec_flags
+    struct rec_header hdr;
+    
+    // events published this frame, written out at the frame boundary
+    struct window_input *evs;
+    u32 ev_cnt;
+    u32 ev_cap;
+    
+    f64 rate;
+    u64 replay_pc; // performance counter when the replay started
+    u64 replay_ms; // recorded time replayed so far
+    u32 replay_frames;
+};
+
+#ifdef LIB
+
+#define def_create_rec(name) int name(void)
+def_create_rec(create_rec);
+
+#define def_rec_event(name) void name(struct window_input *ev)
+def_rec_event(rec_event);
+
+// Called once per frame after win_poll: writes the frame when recording,
+// reads the next one and feeds its events to the window when replaying.
+#define def_rec_frame(name) int name(void)
+def_rec_frame(rec_frame);
+
+#define def_rec_close(name) void name(void)
+def_rec_close(rec_close);
+
+#endif // LIB
+
+#endif // REC_H
@@ -0,0 +1,42 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include "../solh/sol.h"
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"). Counter based,
+// so a number depends only on what it is keyed by and never on what was drawn before it, which
+// keeps results identical however the work is split between threads. World rules should key
+// it by the chunk's position in the world rather than its war slot, which moves with the player.
+
+#define RNG_PHILOX_M0 0xD2511F53u
+#define RNG_PHILOX_M1 0xCD9E8D57u
+#define RNG_PHILOX_W0 0x9E3779B9u
+#define RNG_PHILOX_W1 0xBB67AE85u
+
+struct rng_ctr {
+    u32 v[4];
+};
+
+static inline struct rng_ctr rng_philox(struct rng_ctr c, u32 k0, u32 k1)
+{
+    for(u32 i=0; i < 10; ++i) {
+        u64 p0 = (u64)RNG_PHILOX_M0 * c.v[0];
+        u64 p1 = (u64)RNG_PHILOX_M1 * c.v[2];
+        u32 c1 = c.v[1], c3 = c.v[3];
+        c.v[0] = (u32)(p1 >> 32) ^ c1 ^ k0;
+        c.v[1] = (u32)p1;
+        c.v[2] = (u32)(p0 >> 32) ^ c3 ^ k1;
+        c.v[3] = (u32)p0;
+        k0 += RNG_PHILOX_W0;
+        k1 += RNG_PHILOX_W1;
+    }
+    return c;
+}
+
+// uniform in [0, 1) from the top 24 bits
+static inline f32 rng_f32(u32 r)
+{
+    return (f32)(r >> 8) * (1.0f / 16777216.0f);
+}
+
+#endif // RNG_H
@@ -0,0 +1,115 @@
+#include "trc.h"
+#include "prg.h"
+
+#if TRACE
+
+thread_persist struct trc_ring *trc_ring;
+
+// Write everything currently in a ring as chrome trace events. Uses the json array format,
+// which does not require the closing bracket, so the file is valid at every flush.
+internal void trc_flush_ring(u32 ti)
+{
+    struct trc_ring *r = &prg->trc.ring[ti];
+    
+    u32 w = r->write;
+    SDL_MemoryBarrierAcquire();
+    
+    char buf[kb(16)];
+    u32 sz = 0;
+    
+    for(u32 i = r->read; i != w; ++i) {
+        struct trc_event *e = &r->buf[i & (TRC_RING_SIZE-1)];
+        f64 ts = (f64)(e->tsc - prg->trc.tsc_base) / prg->trc.tsc_per_us;
+        
+        if (sz > sizeof(buf) - 256) {
+            SDL_RWwrite(prg->trc.out, buf, 1, sz);
+            sz = 0;
+        }
+        
+        if (e->type == TRC_BEG) {
+            sz += SDL_snprintf(buf + sz, sizeof(buf) - sz,
+                               "{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":0,\"tid\":%u},\n",
+                               e->name, ts, ti);
+        } else {
+            sz += SDL_snprintf(buf + sz, sizeof(buf) - sz,
+                               "{\"ph\":\"E\",\"ts\":%.3f,\"pid\":0,\"tid\":%u},\n", ts, ti);
+        }
+    }
+    SDL_RWwrite(prg->trc.out, buf, 1, sz);
+    
+    SDL_MemoryBarrierRelease();
+    r->read = w;
+    
+    if (r->dropped) {
+        log_error("Trace ring for thread %u overflowed, %u events dropped", (u64)ti, (u64)r->dropped);
+        r->dropped = 0;
+    }
+}
+
+internal int trc_flush_thread(void *arg)
+{
+    while(!SDL_AtomicGet(&prg->trc.quit)) {
+        for(u32 i=0; i < MAX_THREADS; ++i)
+            trc_flush_ring(i);
+        SDL_Delay(TRC_FLUSH_MS);
+    }
+    for(u32 i=0; i < MAX_THREADS; ++i)
+        trc_flush_ring(i);
+    return 0;
+}
+
+/**************************************************************************/
+// Header functions
+
+def_create_trc(create_trc)
+{
+    prg->trc.out = SDL_RWFromFile(TRC_OUT_URI, "wb");
+    if (!prg->trc.out) {
+        log_error("Failed to open trace output %s - %s", TRC_OUT_URI, SDL_GetError());
+        return -1;
+    }
+    SDL_RWwrite(prg->trc.out, "[\n", 1, 2);
+    
+    // rdtsc is invariant on anything we care about, so one calibration against the os clock is enough
+    u64 pf = SDL_GetPerformanceFrequency();
+    u64 pc = SDL_GetPerformanceCounter();
+    prg->trc.tsc_base = __rdtsc();
+    SDL_Delay(10);
+    u64 tsc = __rdtsc() - prg->trc.tsc_base;
+    pc = SDL_GetPerformanceCounter() - pc;
+    prg->trc.tsc_per_us = (f64)tsc / ((f64)pc * 1e6 / pf);
+    
+    trc_thread(MT);
+    return trc_start();
+}
+
+def_trc_thread(trc_thread)
+{
+    trc_ring = &prg->trc.ring[thread_index];
+}
+
+def_trc_start(trc_start)
+{
+    if (prg->trc.thread || !prg->trc.out)
+        return 0;
+    
+    SDL_AtomicSet(&prg->trc.quit, 0);
+    prg->trc.thread = SDL_CreateThread(trc_flush_thread, "trc", NULL);
+    if (!prg->trc.thread) {
+        log_error("Failed to create trace flush thread - %s", SDL_GetError());
+        return -1;
+    }
+    return 0;
+}
+
+def_trc_stop(trc_stop)
+{
+    if (!prg->trc.thread)
+        return;
+    
+    SDL_AtomicSet(&prg->trc.quit, 1);
+    SDL_WaitThread(prg->trc.thread, NULL);
+    prg->trc.thread = NULL;
+}
+
+#endif // TRACE
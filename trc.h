@@ -0,0 +1,105 @@
+#ifndef TRC_H
+#define TRC_H
+
+#include "SDL2/SDL.h"
+
+#include "../solh/sol.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#define TRACE 0 /* 0 == trace scopes compile to nothing */
+
+#define TRC_OUT_URI "trace.json" /* chrome://tracing or ui.perfetto.dev */
+#define TRC_RING_SIZE 8192 /* events per thread, must be a power of 2 */
+#define TRC_FLUSH_MS 50
+
+enum trc_event_types {
+    TRC_BEG,
+    TRC_END,
+};
+
+struct trc_event {
+    u64 tsc;
+    char *name;
+    u32 type;
+};
+
+// single producer (the traced thread), single consumer (the flush thread)
+struct trc_ring {
+    volatile u32 write;
+    volatile u32 read;
+    u32 read_cache; // producer's last view of read
+    u32 dropped;
+    struct trc_event buf[TRC_RING_SIZE];
+};
+
+struct trc {
+    struct trc_ring ring[MAX_THREADS];
+    SDL_Thread *thread;
+    SDL_RWops *out;
+    SDL_atomic_t quit;
+    u64 tsc_base;
+    f64 tsc_per_us;
+};
+
+#ifdef LIB
+#if TRACE
+
+extern thread_persist struct trc_ring *trc_ring;
+
+static inline void trc_push(char *name, u32 type)
+{
+    struct trc_ring *r = trc_ring;
+    if (!r) return;
+    
+    u32 w = r->write;
+    if (w - r->read_cache == TRC_RING_SIZE) {
+        r->read_cache = r->read;
+        if (w - r->read_cache == TRC_RING_SIZE) {
+            r->dropped++;
+            return;
+        }
+    }
+    
+    struct trc_event *e = &r->buf[w & (TRC_RING_SIZE-1)];
+    e->tsc = __rdtsc();
+    e->name = name;
+    e->type = type;
+    
+    SDL_MemoryBarrierRelease();
+    r->write = w + 1;
+}
+
+// 'name' must outlive a library reload (string literals are fine, rings are flushed before unload)
+#define trc_beg(name) trc_push(name, TRC_BEG)
+#define trc_end() trc_push(NULL, TRC_END)
+
+#define def_create_trc(name) int name(void)
+def_create_trc(create_trc);
+
+#define def_trc_thread(name) void name(u32 thread_index)
+def_trc_thread(trc_thread);
+
+#define def_trc_start(name) int name(void)
+def_trc_start(trc_start);
+
+#define def_trc_stop(name) void name(void)
+def_trc_stop(trc_stop);
+
+#else
+
+#define trc_beg(name)
+#define trc_end()
+#define create_trc() 0
+#define trc_thread(thread_index)
+#define trc_start() 0
+#define trc_stop()
+
+#endif // TRACE
+#endif // LIB
+
+#endif // TRC_H
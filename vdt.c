@@ -4,6 +4,7 @@
 struct vdt_elem exevdt[VDT_SIZE] = {
     [VDT_EnumeratePhysicalDevices] = {.name = "vkEnumeratePhysicalDevices"},
     [VDT_GetPhysicalDeviceProperties] = {.name = "vkGetPhysicalDeviceProperties"},
+    [VDT_GetPhysicalDeviceFeatures] = {.name = "vkGetPhysicalDeviceFeatures"},
     [VDT_GetPhysicalDeviceMemoryProperties] = {.name = "vkGetPhysicalDeviceMemoryProperties"},
     [VDT_GetPhysicalDeviceQueueFamilyProperties] = {.name = "vkGetPhysicalDeviceQueueFamilyProperties"},
     [VDT_GetPhysicalDeviceSurfaceSupportKHR] = {.name = "vkGetPhysicalDeviceSurfaceSupportKHR"},
@@ -58,6 +59,9 @@ struct vdt_elem exevdt[VDT_SIZE] = {
     [VDT_DestroyFramebuffer] = {.name = "vkDestroyFramebuffer"},
     [VDT_CreateGraphicsPipelines] = {.name = "vkCreateGraphicsPipelines"},
     [VDT_DestroyPipeline] = {.name = "vkDestroyPipeline"},
+    [VDT_CreatePipelineCache] = {.name = "vkCreatePipelineCache"},
+    [VDT_GetPipelineCacheData] = {.name = "vkGetPipelineCacheData"},
+    [VDT_DestroyPipelineCache] = {.name = "vkDestroyPipelineCache"},
     [VDT_CreateSemaphore] = {.name = "vkCreateSemaphore"},
     [VDT_DestroySemaphore] = {.name = "vkDestroySemaphore"},
     [VDT_CreateFence] = {.name = "vkCreateFence"},
@@ -65,6 +69,7 @@ struct vdt_elem exevdt[VDT_SIZE] = {
     [VDT_WaitForFences] = {.name = "vkWaitForFences"},
     [VDT_ResetFences] = {.name = "vkResetFences"},
     [VDT_GetFenceStatus] = {.name = "vkGetFenceStatus"},
+    [VDT_WaitSemaphores] = {.name = "vkWaitSemaphores"},
     
     // Command
     [VDT_CreateCommandPool] = {.name = "vkCreateCommandPool"},
@@ -87,6 +92,16 @@ struct vdt_elem exevdt[VDT_SIZE] = {
     [VDT_CmdEndRenderPass] = {.name = "vkCmdEndRenderPass"},
     [VDT_CmdSetViewport] = {.name = "vkCmdSetViewport"},
     [VDT_CmdSetScissor] = {.name = "vkCmdSetScissor"},
+    [VDT_CmdResetQueryPool] = {.name = "vkCmdResetQueryPool"},
+    [VDT_CmdWriteTimestamp2] = {.name = "vkCmdWriteTimestamp2"},
+    [VDT_CmdBeginQuery] = {.name = "vkCmdBeginQuery"},
+    [VDT_CmdEndQuery] = {.name = "vkCmdEndQuery"},
+    
+    // Query
+    [VDT_CreateQueryPool] = {.name = "vkCreateQueryPool"},
+    [VDT_DestroyQueryPool] = {.name = "vkDestroyQueryPool"},
+    [VDT_GetQueryPoolResults] = {.name = "vkGetQueryPoolResults"},
+    [VDT_ResetQueryPool] = {.name = "vkResetQueryPool"},
     
     // Queue
     [VDT_GetDeviceQueue] = {.name = "vkGetDeviceQueue"},
@@ -94,6 +109,18 @@ struct vdt_elem exevdt[VDT_SIZE] = {
 };
 #else
 struct vdt *vdt;
+
+internal struct prg_field vdt_fields[] = {
+    prg_field(struct vdt, table),
+    prg_field(struct vdt, flags),
+    prg_field(struct vdt, tsc_base),
+    prg_field(struct vdt, pc_base),
+    prg_field(struct vdt, stat),
+    prg_field(struct vdt, prev),
+    prg_field(struct vdt, frame),
+};
+prg_layout(prg_layout_vdt, struct vdt, VDT_LAYOUT_VERSION, vdt_fields);
+
 def_create_vdt(create_vdt)
 {
     for(u32 i = VDT_INST_START; gpu->inst && !gpu->dev && i < VDT_INST_END; ++i) {
@@ -113,4 +140,89 @@ def_create_vdt(create_vdt)
     return 0;
 }
 
+thread_persist u64 vdt_tsc;
+
+// Only while the worker is parked, since this clears the rows it writes to.
+internal void vdt_instr(bool on)
+{
+    if (on && !(vdt->flags & VDT_INSTR)) {
+        vdt->tsc_base = __rdtsc();
+        vdt->pc_base = SDL_GetPerformanceCounter();
+        memset(vdt->stat, 0, sizeof(vdt->stat));
+        memset(vdt->prev, 0, sizeof(vdt->prev));
+        memset(vdt->frame, 0, sizeof(vdt->frame));
+    }
+    vdt->flags = on ? vdt->flags | VDT_INSTR : vdt->flags & ~VDT_INSTR;
+    println("Vulkan call instrumenting %s", on ? "on" : "off");
+}
+
+def_vdt_request_instr(vdt_request_instr)
+{
+    SDL_AtomicSet(&vdt->req, on + 1);
+}
+
+// Called from the main thread between the worker finishing a frame and being kicked again,
+// so nothing else is writing the stat rows.
+def_vdt_frame(vdt_frame)
+{
+    u32 req = SDL_AtomicSet(&vdt->req, 0);
+    if (req)
+        vdt_instr(req - 1);
+    
+    if (!(vdt->flags & VDT_INSTR))
+        return;
+    
+    for(u32 i=0; i < VDT_SIZE; ++i) {
+        struct vdt_stat tot = {};
+        for(u32 j=0; j < MAX_THREADS; ++j) {
+            tot.cnt += vdt->stat[j][i].cnt;
+            tot.tsc += vdt->stat[j][i].tsc;
+            if (vdt->stat[j][i].max > tot.max) tot.max = vdt->stat[j][i].max;
+            vdt->stat[j][i].max = 0; // so the next frame's max is its own
+        }
+        vdt->frame[i].cnt = tot.cnt - vdt->prev[i].cnt;
+        vdt->frame[i].tsc = tot.tsc - vdt->prev[i].tsc;
+        vdt->frame[i].max = tot.max;
+        vdt->prev[i].cnt = tot.cnt;
+        vdt->prev[i].tsc = tot.tsc;
+        if (tot.max > vdt->prev[i].max) vdt->prev[i].max = tot.max;
+    }
+}
+
+def_vdt_report(vdt_report)
+{
+    if (!(vdt->flags & VDT_INSTR))
+        return;
+    
+    u64 pc = SDL_GetPerformanceCounter() - vdt->pc_base;
+    if (!pc) return;
+    f64 tsc_per_us = (f64)(__rdtsc() - vdt->tsc_base) / ((f64)pc * 1e6 / SDL_GetPerformanceFrequency());
+    
+    // insertion sort the most expensive entries of the last frame
+    u32 top[VDT_REPORT_CNT];
+    u32 top_cnt = 0;
+    u64 cnt = 0, tsc = 0;
+    for(u32 i=0; i < VDT_SIZE; ++i) {
+        cnt += vdt->frame[i].cnt;
+        tsc += vdt->frame[i].tsc;
+        if (!vdt->frame[i].cnt)
+            continue;
+        
+        u32 j = top_cnt < VDT_REPORT_CNT ? top_cnt++ : VDT_REPORT_CNT;
+        for(; j > 0 && vdt->frame[top[j-1]].tsc < vdt->frame[i].tsc; --j) {
+            if (j < VDT_REPORT_CNT) top[j] = top[j-1];
+        }
+        if (j < VDT_REPORT_CNT) top[j] = i;
+    }
+    
+    println("vulkan calls last frame: %u, %fus", cnt, (f64)tsc / tsc_per_us);
+    for(u32 i=0; i < top_cnt; ++i) {
+        struct vdt_stat *f = &vdt->frame[top[i]];
+        struct vdt_stat *p = &vdt->prev[top[i]];
+        println("  %s: %u calls, %fus, max %fus (avg %fus, max %fus, %u calls total)",
+                vdt->table[top[i]].name, f->cnt, (f64)f->tsc / tsc_per_us, (f64)f->max / tsc_per_us,
+                (f64)p->tsc / p->cnt / tsc_per_us, (f64)p->max / tsc_per_us, p->cnt);
+    }
+}
+
 #endif // ifdef EXE
\ No newline at end of file
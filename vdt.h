@@ -7,6 +7,7 @@ enum {
     /* Instance API */
     VDT_EnumeratePhysicalDevices,
     VDT_GetPhysicalDeviceProperties,
+    VDT_GetPhysicalDeviceFeatures,
     VDT_GetPhysicalDeviceMemoryProperties,
     VDT_GetPhysicalDeviceQueueFamilyProperties,
     VDT_GetPhysicalDeviceSurfaceSupportKHR,
@@ -65,6 +66,9 @@ enum {
     VDT_DestroyFramebuffer,
     VDT_CreateGraphicsPipelines,
     VDT_DestroyPipeline,
+    VDT_CreatePipelineCache,
+    VDT_GetPipelineCacheData,
+    VDT_DestroyPipelineCache,
     VDT_CreateSemaphore,
     VDT_DestroySemaphore,
     VDT_CreateFence,
@@ -72,6 +76,7 @@ enum {
     VDT_WaitForFences,
     VDT_ResetFences,
     VDT_GetFenceStatus,
+    VDT_WaitSemaphores,
     
     // Command
     VDT_CreateCommandPool,
@@ -94,6 +99,16 @@ enum {
     VDT_CmdEndRenderPass,
     VDT_CmdSetViewport,
     VDT_CmdSetScissor,
+    VDT_CmdResetQueryPool,
+    VDT_CmdWriteTimestamp2,
+    VDT_CmdBeginQuery,
+    VDT_CmdEndQuery,
+    
+    // Query
+    VDT_CreateQueryPool,
+    VDT_DestroyQueryPool,
+    VDT_GetQueryPoolResults,
+    VDT_ResetQueryPool,
     
     // Queue
     VDT_GetDeviceQueue,
@@ -112,8 +127,35 @@ struct vdt_elem {
     PFN_vkVoidFunction fn;
 };
 
+enum vdt_flags {
+    VDT_INSTR = 0x01, // time and count every call through the table
+};
+
+#define VDT_REPORT_CNT 8 /* entries printed per report, most expensive first */
+
+struct vdt_stat {
+    u64 cnt;
+    u64 tsc;
+    u64 max;
+};
+
+#define VDT_LAYOUT_VERSION 1 /* see struct prg_layout */
+
+// Allocated by the library like the other state blocks, only the table it points at lives in
+// the exe. The counters carry over a reload as long as the layout does not change.
 struct vdt {
     struct vdt_elem *table;
+    u32 flags; // enum vdt_flags
+    
+    // rdtsc is calibrated against the os clock from the moment instrumenting was switched on
+    u64 tsc_base;
+    u64 pc_base;
+    
+    struct vdt_stat stat[MAX_THREADS][VDT_SIZE]; // each thread only writes its own row
+    struct vdt_stat prev[VDT_SIZE]; // totals at the last frame boundary, max is the longest call ever
+    struct vdt_stat frame[VDT_SIZE]; // deltas over the last frame, max is the longest call in it
+    
+    SDL_atomic_t req; // set from any thread, applied by vdt_frame, 0 == no request, else on + 1
 };
 
 #ifdef EXE
@@ -125,6 +167,15 @@ extern struct vdt *vdt;
 #define def_create_vdt(name) int name(void)
 def_create_vdt(create_vdt);
 
+#define def_vdt_request_instr(name) void name(bool on)
+def_vdt_request_instr(vdt_request_instr);
+
+#define def_vdt_frame(name) void name(void)
+def_vdt_frame(vdt_frame);
+
+#define def_vdt_report(name) void name(void)
+def_vdt_report(vdt_report);
+
 /***************************************************************/
 
 #define GAC NULL
@@ -139,236 +190,305 @@ def_cvk(cvk_fn);
 
 #define vdt_call(name) ((PFN_vk ## name)(vdt->table[VDT_ ## name].fn))
 
+// Calls through the table, wrapped in a trace scope named after the entry point, and
+// timed when instrumenting. vdt_res is for entry points that return VkResult, vdt_void for the rest.
+#define vdt_void(name, ...) (vdt_beg(VDT_ ## name), vdt_call(name)(__VA_ARGS__), vdt_end(VDT_ ## name))
+#define vdt_res(name, ...) vdt_end_res(VDT_ ## name, (vdt_beg(VDT_ ## name), vdt_call(name)(__VA_ARGS__)))
+
+extern thread_persist u64 vdt_tsc;
+
+static inline void vdt_beg(u32 i) {
+    trc_beg(vdt->table[i].name);
+    if (vdt->flags & VDT_INSTR)
+        vdt_tsc = __rdtsc();
+}
+
+static inline void vdt_end(u32 i) {
+    // check the start time rather than the flag, which can flip mid-call
+    if (vdt_tsc) {
+        u64 t = __rdtsc() - vdt_tsc;
+        struct vdt_stat *s = &vdt->stat[prg_ti][i];
+        s->cnt++;
+        s->tsc += t;
+        if (t > s->max) s->max = t;
+        vdt_tsc = 0;
+    }
+    trc_end();
+}
+
+static inline VkResult vdt_end_res(u32 i, VkResult res) {
+    vdt_end(i);
+    return res;
+}
+
 static inline VkResult vk_create_inst(VkInstanceCreateInfo *info) {
     return cvk(vkCreateInstance(info, GAC, &gpu->inst));
 }
 
 static inline VkResult vk_enum_phys_devs(u32 *cnt, VkPhysicalDevice *devs) {
-    return cvk(vdt_call(EnumeratePhysicalDevices)(gpu->inst, cnt, devs));
+    return cvk(vdt_res(EnumeratePhysicalDevices, gpu->inst, cnt, devs));
 }
 
 static inline void vk_get_phys_dev_props(VkPhysicalDevice dev, VkPhysicalDeviceProperties *props) {
-    vdt_call(GetPhysicalDeviceProperties)(dev, props);
+    vdt_void(GetPhysicalDeviceProperties, dev, props);
+}
+
+static inline void vk_get_phys_dev_feats(VkPhysicalDevice dev, VkPhysicalDeviceFeatures *feats) {
+    vdt_void(GetPhysicalDeviceFeatures, dev, feats);
 }
 
 static inline void vk_get_phys_dev_memprops(VkPhysicalDevice dev, VkPhysicalDeviceMemoryProperties *props) {
-    vdt_call(GetPhysicalDeviceMemoryProperties)(dev, props);
+    vdt_void(GetPhysicalDeviceMemoryProperties, dev, props);
 }
 
 static inline void vk_get_phys_devq_fam_props(u32 *cnt, VkQueueFamilyProperties *props) {
-    vdt_call(GetPhysicalDeviceQueueFamilyProperties)(gpu->phys_dev, cnt, props);
+    vdt_void(GetPhysicalDeviceQueueFamilyProperties, gpu->phys_dev, cnt, props);
 }
 
 static inline VkResult vk_get_phys_dev_surf_support_khr(u32 qfi, b32 *support) {
-    return cvk(vdt_call(GetPhysicalDeviceSurfaceSupportKHR)(gpu->phys_dev, qfi, gpu->surf, support));
+    return cvk(vdt_res(GetPhysicalDeviceSurfaceSupportKHR, gpu->phys_dev, qfi, gpu->surf, support));
 }
 
 static inline VkResult vk_create_dev(VkDeviceCreateInfo *ci) {
-    return cvk(vdt_call(CreateDevice)(gpu->phys_dev, ci, GAC, &gpu->dev));
+    return cvk(vdt_res(CreateDevice, gpu->phys_dev, ci, GAC, &gpu->dev));
 }
 
 static inline void vk_get_phys_dev_surf_cap_khr(VkSurfaceCapabilitiesKHR *cap) {
-    vdt_call(GetPhysicalDeviceSurfaceCapabilitiesKHR)(gpu->phys_dev, gpu->surf, cap);
+    vdt_res(GetPhysicalDeviceSurfaceCapabilitiesKHR, gpu->phys_dev, gpu->surf, cap);
 }
 
 static inline void vk_get_phys_dev_surf_fmts_khr(u32 *cnt, VkSurfaceFormatKHR *fmts) {
-    vdt_call(GetPhysicalDeviceSurfaceFormatsKHR)(gpu->phys_dev, gpu->surf, cnt, fmts);
+    vdt_res(GetPhysicalDeviceSurfaceFormatsKHR, gpu->phys_dev, gpu->surf, cnt, fmts);
+}
+
+static inline void vk_get_phys_dev_surf_pms_khr(u32 *cnt, VkPresentModeKHR *pms) {
+    vdt_res(GetPhysicalDeviceSurfacePresentModesKHR, gpu->phys_dev, gpu->surf, cnt, pms);
 }
 
 static inline VkResult vk_create_sc_khr(VkSwapchainCreateInfoKHR *ci, VkSwapchainKHR *sc) {
-    return cvk(vdt_call(CreateSwapchainKHR)(gpu->dev, ci, GAC, sc));
+    return cvk(vdt_res(CreateSwapchainKHR, gpu->dev, ci, GAC, sc));
 }
 
 static inline void vk_destroy_sc_khr(VkSwapchainKHR sc) {
-    return vdt_call(DestroySwapchainKHR)(gpu->dev, sc, GAC);
+    vdt_void(DestroySwapchainKHR, gpu->dev, sc, GAC);
 }
 
 static inline VkResult vk_get_sc_imgs_khr(u32 *cnt, VkImage *imgs) {
-    return cvk(vdt_call(GetSwapchainImagesKHR)(gpu->dev, gpu->sc.handle, cnt, imgs));
+    return cvk(vdt_res(GetSwapchainImagesKHR, gpu->dev, gpu->sc.handle, cnt, imgs));
 }
 
 static inline VkResult vk_acquire_img_khr(VkSemaphore s, VkFence f, u32 *i) {
-    return vdt_call(AcquireNextImageKHR)(gpu->dev, gpu->sc.handle, secs_to_ns(1), s, f, i);
+    return vdt_res(AcquireNextImageKHR, gpu->dev, gpu->sc.handle, secs_to_ns(1), s, f, i);
 }
 
 static inline VkResult vk_qpres(VkPresentInfoKHR *pi) {
-    return vdt_call(QueuePresentKHR)(gpu->q[GPU_QI_P].handle, pi);
+    return vdt_res(QueuePresentKHR, gpu->q[GPU_QI_P].handle, pi);
 }
 
 static inline VkResult vk_create_buf(VkBufferCreateInfo *ci, VkBuffer *buf) {
-    return cvk(vdt_call(CreateBuffer)(gpu->dev, ci, GAC, buf));
+    return cvk(vdt_res(CreateBuffer, gpu->dev, ci, GAC, buf));
 }
 
 static inline void vk_destroy_buf(VkBuffer buf) {
-    vdt_call(DestroyBuffer)(gpu->dev, buf, GAC);
+    vdt_void(DestroyBuffer, gpu->dev, buf, GAC);
 }
 
 static inline VkResult vk_create_img(VkImageCreateInfo *ci, VkImage *img) {
-    return cvk(vdt_call(CreateImage)(gpu->dev, ci, GAC, img));
+    return cvk(vdt_res(CreateImage, gpu->dev, ci, GAC, img));
 }
 
 static inline void vk_destroy_img(VkImage img) {
-    vdt_call(DestroyImage)(gpu->dev, img, GAC);
+    vdt_void(DestroyImage, gpu->dev, img, GAC);
 }
 
 static inline void vk_get_buf_memreq(VkBuffer buf, VkMemoryRequirements *mr) {
-    vdt_call(GetBufferMemoryRequirements)(gpu->dev, buf, mr);
+    vdt_void(GetBufferMemoryRequirements, gpu->dev, buf, mr);
 }
 
 static inline void vk_get_img_memreq(VkImage img, VkMemoryRequirements *mr) {
-    vdt_call(GetImageMemoryRequirements)(gpu->dev, img, mr);
+    vdt_void(GetImageMemoryRequirements, gpu->dev, img, mr);
 }
 
 static inline VkResult vk_alloc_mem(VkMemoryAllocateInfo *ci, VkDeviceMemory *mem) {
-    return cvk(vdt_call(AllocateMemory)(gpu->dev, ci, GAC, mem));
+    return cvk(vdt_res(AllocateMemory, gpu->dev, ci, GAC, mem));
 }
 
 static inline VkResult vk_map_mem(VkDeviceMemory mem, u64 ofs, u64 sz, void **p) {
-    return cvk(vdt_call(MapMemory)(gpu->dev, mem, ofs, sz, 0x0, p));
+    return cvk(vdt_res(MapMemory, gpu->dev, mem, ofs, sz, 0x0, p));
 }
 
 static inline void vk_free_mem(VkDeviceMemory mem) {
-    vdt_call(FreeMemory)(gpu->dev, mem, GAC);
+    vdt_void(FreeMemory, gpu->dev, mem, GAC);
 }
 
 static inline VkResult vk_bind_img_mem(VkImage img, VkDeviceMemory mem, u64 ofs) {
-    return cvk(vdt_call(BindImageMemory)(gpu->dev, img, mem, ofs));
+    return cvk(vdt_res(BindImageMemory, gpu->dev, img, mem, ofs));
 }
 
 static inline VkResult vk_bind_buf_mem(VkBuffer buf, VkDeviceMemory mem, u64 ofs) {
-    return cvk(vdt_call(BindBufferMemory)(gpu->dev, buf, mem, ofs));
+    return cvk(vdt_res(BindBufferMemory, gpu->dev, buf, mem, ofs));
 }
 
 static inline VkResult vk_create_imgv(VkImageViewCreateInfo *ci, VkImageView *view) {
-    return cvk(vdt_call(CreateImageView)(gpu->dev, ci, GAC, view));
+    return cvk(vdt_res(CreateImageView, gpu->dev, ci, GAC, view));
 }
 
 static inline void vk_destroy_imgv(VkImageView view) {
-    vdt_call(DestroyImageView)(gpu->dev, view, GAC);
+    vdt_void(DestroyImageView, gpu->dev, view, GAC);
 }
 
 static inline VkResult vk_create_sampler(VkSamplerCreateInfo *ci, VkSampler *sampler) {
-    return cvk(vdt_call(CreateSampler)(gpu->dev, ci, GAC, sampler));
+    return cvk(vdt_res(CreateSampler, gpu->dev, ci, GAC, sampler));
 }
 
 static inline void vk_destroy_sampler(VkSampler sampler) {
-    vdt_call(DestroySampler)(gpu->dev, sampler, GAC);
+    vdt_void(DestroySampler, gpu->dev, sampler, GAC);
 }
 
 static inline VkResult vk_create_shmod(VkShaderModuleCreateInfo *ci, VkShaderModule *mod) {
-    return cvk(vdt_call(CreateShaderModule)(gpu->dev, ci, GAC, mod));
+    return cvk(vdt_res(CreateShaderModule, gpu->dev, ci, GAC, mod));
 }
 
 static inline void vk_destroy_shmod(VkShaderModule mod) {
-    vdt_call(DestroyShaderModule)(gpu->dev, mod, GAC);
+    vdt_void(DestroyShaderModule, gpu->dev, mod, GAC);
 }
 
 static inline VkResult vk_create_dsl(VkDescriptorSetLayoutCreateInfo *ci, VkDescriptorSetLayout *dsl) {
-    return cvk(vdt_call(CreateDescriptorSetLayout)(gpu->dev, ci, GAC, dsl));
+    return cvk(vdt_res(CreateDescriptorSetLayout, gpu->dev, ci, GAC, dsl));
 }
 
 static inline void vk_destroy_dsl(VkDescriptorSetLayout dsl) {
-    vdt_call(DestroyDescriptorSetLayout)(gpu->dev, dsl, GAC);
+    vdt_void(DestroyDescriptorSetLayout, gpu->dev, dsl, GAC);
 }
 
 static inline VkResult vk_create_pll(VkPipelineLayoutCreateInfo *ci, VkPipelineLayout *pll) {
-    return cvk(vdt_call(CreatePipelineLayout)(gpu->dev, ci, GAC, pll));
+    return cvk(vdt_res(CreatePipelineLayout, gpu->dev, ci, GAC, pll));
 }
 
 static inline void vk_destroy_pll(VkPipelineLayout pll) {
-    vdt_call(DestroyPipelineLayout)(gpu->dev, pll, GAC);
+    vdt_void(DestroyPipelineLayout, gpu->dev, pll, GAC);
 }
 
 static inline VkResult vk_create_dp(VkDescriptorPoolCreateInfo *ci, VkDescriptorPool *dp) {
-    return cvk(vdt_call(CreateDescriptorPool)(gpu->dev, ci, GAC, dp));
+    return cvk(vdt_res(CreateDescriptorPool, gpu->dev, ci, GAC, dp));
 }
 
 static inline void vk_destroy_dp(VkDescriptorPool dp) {
-    vdt_call(DestroyDescriptorPool)(gpu->dev, dp, GAC);
+    vdt_void(DestroyDescriptorPool, gpu->dev, dp, GAC);
 }
 
 static inline void vk_reset_dp(VkDescriptorPool dp) {
-    vdt_call(ResetDescriptorPool)(gpu->dev, dp, 0x0);
+    vdt_res(ResetDescriptorPool, gpu->dev, dp, 0x0);
 }
 
 static inline VkResult vk_alloc_ds(VkDescriptorSetAllocateInfo *ai, VkDescriptorSet *ds) {
-    return cvk(vdt_call(AllocateDescriptorSets)(gpu->dev, ai, ds));
+    return cvk(vdt_res(AllocateDescriptorSets, gpu->dev, ai, ds));
 }
 
 static inline void vk_update_ds(u32 cnt, VkWriteDescriptorSet *writes) {
-    vdt_call(UpdateDescriptorSets)(gpu->dev, cnt, writes, 0, NULL);
+    vdt_void(UpdateDescriptorSets, gpu->dev, cnt, writes, 0, NULL);
 }
 
 static inline VkResult vk_create_rp(VkRenderPassCreateInfo *ci, VkRenderPass *rp) {
-    return cvk(vdt_call(CreateRenderPass)(gpu->dev, ci, GAC, rp));
+    return cvk(vdt_res(CreateRenderPass, gpu->dev, ci, GAC, rp));
 }
 
 static inline void vk_destroy_rp(VkRenderPass rp) {
-    vdt_call(DestroyRenderPass)(gpu->dev, rp, GAC);
+    vdt_void(DestroyRenderPass, gpu->dev, rp, GAC);
 }
 
 static inline VkResult vk_create_fb(VkFramebufferCreateInfo *ci, VkFramebuffer *fb) {
-    return cvk(vdt_call(CreateFramebuffer)(gpu->dev, ci, GAC, fb));
+    return cvk(vdt_res(CreateFramebuffer, gpu->dev, ci, GAC, fb));
 }
 
 static inline void vk_destroy_fb(VkFramebuffer fb) {
-    vdt_call(DestroyFramebuffer)(gpu->dev, fb, GAC);
+    vdt_void(DestroyFramebuffer, gpu->dev, fb, GAC);
 }
 
 static inline VkResult vk_create_gpl(u32 cnt, VkGraphicsPipelineCreateInfo *ci, VkPipeline *pl) {
-    return cvk(vdt_call(CreateGraphicsPipelines)(gpu->dev, NULL, cnt, ci, GAC, pl));
+    return cvk(vdt_res(CreateGraphicsPipelines, gpu->dev, gpu->plc, cnt, ci, GAC, pl));
+}
+
+static inline VkResult vk_create_plc(VkPipelineCacheCreateInfo *ci, VkPipelineCache *plc) {
+    return cvk(vdt_res(CreatePipelineCache, gpu->dev, ci, GAC, plc));
+}
+
+// 'data' == NULL for just the size
+static inline VkResult vk_get_plc_data(size_t *size, void *data) {
+    return cvk(vdt_res(GetPipelineCacheData, gpu->dev, gpu->plc, size, data));
+}
+
+static inline void vk_destroy_plc(VkPipelineCache plc) {
+    vdt_void(DestroyPipelineCache, gpu->dev, plc, GAC);
 }
 
 static inline void vk_destroy_pl(VkPipeline pl) {
-    vdt_call(DestroyPipeline)(gpu->dev, pl, GAC);
+    vdt_void(DestroyPipeline, gpu->dev, pl, GAC);
 }
 
 static inline VkResult vk_create_sem(VkSemaphore *sem) {
     VkSemaphoreCreateInfo ci = {VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
-    return cvk(vdt_call(CreateSemaphore)(gpu->dev, &ci, GAC, sem));
+    return cvk(vdt_res(CreateSemaphore, gpu->dev, &ci, GAC, sem));
+}
+
+static inline VkResult vk_create_timeline_sem(VkSemaphore *sem) {
+    VkSemaphoreTypeCreateInfo ti = {VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO};
+    ti.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    VkSemaphoreCreateInfo ci = {VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+    ci.pNext = &ti;
+    return cvk(vdt_res(CreateSemaphore, gpu->dev, &ci, GAC, sem));
+}
+
+static inline void vk_await_timeline(VkSemaphore sem, u64 val) {
+    VkSemaphoreWaitInfo wi = {VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO};
+    wi.semaphoreCount = 1;
+    wi.pSemaphores = &sem;
+    wi.pValues = &val;
+    // Deliberately ignoring the result, same as fences
+    cvk(vdt_res(WaitSemaphores, gpu->dev, &wi, (u64)10e9));
 }
 
 static inline void vk_destroy_sem(VkSemaphore sem) {
-    vdt_call(DestroySemaphore)(gpu->dev, sem, GAC);
+    vdt_void(DestroySemaphore, gpu->dev, sem, GAC);
 }
 
 static inline VkResult vk_create_fence(bool signalled, VkFence *fence) {
     VkFenceCreateInfo ci = {VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
     ci.flags = signalled;
-    return cvk(vdt_call(CreateFence)(gpu->dev, &ci, GAC, fence));
+    return cvk(vdt_res(CreateFence, gpu->dev, &ci, GAC, fence));
 }
 
 static inline void vk_destroy_fence(VkFence fence) {
-    vdt_call(DestroyFence)(gpu->dev, fence, GAC);
+    vdt_void(DestroyFence, gpu->dev, fence, GAC);
 }
 
 static inline void vk_await_fences(u32 cnt, VkFence *fences, bool await_all) {
     // Deliberately ignoring the result
-    cvk(vdt_call(WaitForFences)(gpu->dev, cnt, fences, await_all, (u64)10e9));
+    cvk(vdt_res(WaitForFences, gpu->dev, cnt, fences, await_all, (u64)10e9));
 }
 
 static inline VkResult vk_fence_status(VkFence f) {
-    return vdt_call(GetFenceStatus)(gpu->dev, f);
+    return vdt_res(GetFenceStatus, gpu->dev, f);
 }
 
 static inline void vk_reset_fences(u32 cnt, VkFence *fences) {
     // Deliberately ignoring the result
-    cvk(vdt_call(ResetFences)(gpu->dev, cnt, fences));
+    cvk(vdt_res(ResetFences, gpu->dev, cnt, fences));
 }
 
 static inline VkResult vk_create_cmdpool(VkCommandPoolCreateInfo *ci, VkCommandPool *pool) {
-    return cvk(vdt_call(CreateCommandPool)(gpu->dev, ci, GAC, pool));
+    return cvk(vdt_res(CreateCommandPool, gpu->dev, ci, GAC, pool));
 }
 
 static inline void vk_destroy_cmdpool(VkCommandPool pool) {
-    vdt_call(DestroyCommandPool)(gpu->dev, pool, GAC);
+    vdt_void(DestroyCommandPool, gpu->dev, pool, GAC);
 }
 
 static inline VkResult vk_alloc_cmds(u32 ci, u32 cnt) {
     VkCommandBufferAllocateInfo ai = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
     ai.commandPool = gpu_cmd(ci).pool;
     ai.commandBufferCount = cnt;
-    return cvk(vdt_call(AllocateCommandBuffers)(gpu->dev, &ai, gpu_cmd(ci).bufs + gpu_cmd(ci).buf_cnt));
+    return cvk(vdt_res(AllocateCommandBuffers, gpu->dev, &ai, gpu_cmd(ci).bufs + gpu_cmd(ci).buf_cnt));
 }
 
 static inline void vk_begin_cmd(VkCommandBuffer cmd, bool one_time) {
@@ -379,26 +499,26 @@ static inline void vk_begin_cmd(VkCommandBuffer cmd, bool one_time) {
     // Deliberately assuming that this will never fail by not returning the result.
     // Maybe that is a bad idea, but command buffers are supposed to be basically
     // bottomless, and I will always be submitting a rather tiny number of commands.
-    cvk(vdt_call(BeginCommandBuffer)(cmd, &bi));
+    cvk(vdt_res(BeginCommandBuffer, cmd, &bi));
 }
 
 static inline void vk_end_cmd(VkCommandBuffer cmd) {
     // Deliberately assuming that this will never fail by not returning the result.
     // Maybe that is a bad idea, but command buffers are supposed to be basically
     // bottomless, and I will always be submitting a rather tiny number of commands.
-    cvk(vdt_call(EndCommandBuffer)(cmd));
+    cvk(vdt_res(EndCommandBuffer, cmd));
 }
 
 static inline void vk_reset_cmdpool(VkCommandPool pool, bool release_resources) {
-    vdt_call(ResetCommandPool)(gpu->dev, pool, release_resources);
+    vdt_res(ResetCommandPool, gpu->dev, pool, release_resources);
 }
 
 static inline void vk_free_cmds(u32 ci) {
-    vdt_call(FreeCommandBuffers)(gpu->dev, gpu_cmd(ci).pool, gpu_cmd(ci).buf_cnt, gpu_cmd(ci).bufs);
+    vdt_void(FreeCommandBuffers, gpu->dev, gpu_cmd(ci).pool, gpu_cmd(ci).buf_cnt, gpu_cmd(ci).bufs);
 }
 
 static inline void vk_cmd_pl_barr(VkCommandBuffer cmd, VkDependencyInfo *dep) {
-    vdt_call(CmdPipelineBarrier2)(cmd, dep);
+    vdt_void(CmdPipelineBarrier2, cmd, dep);
 }
 
 static inline void vk_cmd_copy_buf_to_img(VkCommandBuffer cmd, VkBuffer buf, VkImage img, u64 ofs, u32 w, u32 h) {
@@ -407,51 +527,85 @@ static inline void vk_cmd_copy_buf_to_img(VkCommandBuffer cmd, VkBuffer buf, VkI
         .imageSubresource = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,.layerCount = 1},
         .imageExtent = {.width = w, .height = h, .depth = 1},
     };
-    vdt_call(CmdCopyBufferToImage)(cmd, buf, img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &r);
+    vdt_void(CmdCopyBufferToImage, cmd, buf, img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &r);
 }
 
 static inline void vk_cmd_bufcpy(VkCommandBuffer cmd, u32 cnt, VkBufferCopy *regs, VkBuffer from, VkBuffer to) {
-    vdt_call(CmdCopyBuffer)(cmd, from, to, cnt, regs);
+    vdt_void(CmdCopyBuffer, cmd, from, to, cnt, regs);
 }
 
 static inline void vk_cmd_begin_rp(VkCommandBuffer cmd, VkRenderPassBeginInfo *rbi, VkSubpassBeginInfo *sbi) {
-    vdt_call(CmdBeginRenderPass2)(cmd, rbi, sbi);
+    vdt_void(CmdBeginRenderPass2, cmd, rbi, sbi);
 }
 
 static inline void vk_cmd_bind_pl(VkCommandBuffer cmd, VkPipelineBindPoint bp, VkPipeline pl) {
-    vdt_call(CmdBindPipeline)(cmd, bp, pl);
+    vdt_void(CmdBindPipeline, cmd, bp, pl);
 }
 
 static inline void vk_cmd_bind_ds(VkCommandBuffer cmd, VkPipelineBindPoint bp, VkPipelineLayout pll, u32 first, u32 cnt, VkDescriptorSet *ds) {
-    vdt_call(CmdBindDescriptorSets)(cmd, bp, pll, first, cnt, ds, 0, NULL);
+    vdt_void(CmdBindDescriptorSets, cmd, bp, pll, first, cnt, ds, 0, NULL);
 }
 
 static inline void vk_cmd_bind_vb(VkCommandBuffer cmd, u32 first, u32 cnt, VkBuffer *bufs, u64 *ofs) {
-    vdt_call(CmdBindVertexBuffers)(cmd, first, cnt, bufs, ofs);
+    vdt_void(CmdBindVertexBuffers, cmd, first, cnt, bufs, ofs);
 }
 
 static inline void vk_cmd_draw(VkCommandBuffer cmd, u32 vcnt, u32 icnt) {
-    vdt_call(CmdDraw)(cmd, vcnt, icnt, 0, 0);
+    vdt_void(CmdDraw, cmd, vcnt, icnt, 0, 0);
 }
 
 static inline void vk_cmd_end_rp(VkCommandBuffer cmd) {
-    vdt_call(CmdEndRenderPass)(cmd);
+    vdt_void(CmdEndRenderPass, cmd);
 }
 
 static inline void vk_cmd_set_viewport(VkCommandBuffer cmd, u32 first, u32 cnt, VkViewport *vp) {
-    vdt_call(CmdSetViewport)(cmd, first, cnt, vp);
+    vdt_void(CmdSetViewport, cmd, first, cnt, vp);
 }
 
 static inline void vk_cmd_set_scissor(VkCommandBuffer cmd, u32 first, u32 cnt, VkRect2D *s) {
-    vdt_call(CmdSetScissor)(cmd, first, cnt, s);
+    vdt_void(CmdSetScissor, cmd, first, cnt, s);
+}
+
+static inline void vk_cmd_reset_qp(VkCommandBuffer cmd, VkQueryPool qp, u32 first, u32 cnt) {
+    vdt_void(CmdResetQueryPool, cmd, qp, first, cnt);
+}
+
+static inline void vk_cmd_write_ts(VkCommandBuffer cmd, VkPipelineStageFlags2 stage, VkQueryPool qp, u32 i) {
+    vdt_void(CmdWriteTimestamp2, cmd, stage, qp, i);
+}
+
+static inline void vk_cmd_begin_qry(VkCommandBuffer cmd, VkQueryPool qp, u32 i) {
+    vdt_void(CmdBeginQuery, cmd, qp, i, 0x0);
+}
+
+static inline void vk_cmd_end_qry(VkCommandBuffer cmd, VkQueryPool qp, u32 i) {
+    vdt_void(CmdEndQuery, cmd, qp, i);
+}
+
+static inline VkResult vk_create_qp(VkQueryPoolCreateInfo *ci, VkQueryPool *qp) {
+    return cvk(vdt_res(CreateQueryPool, gpu->dev, ci, GAC, qp));
+}
+
+static inline void vk_destroy_qp(VkQueryPool qp) {
+    vdt_void(DestroyQueryPool, gpu->dev, qp, GAC);
+}
+
+// Not checked, VK_NOT_READY is the expected result when the gpu has not caught up yet.
+static inline VkResult vk_get_qp_results(VkQueryPool qp, u32 first, u32 cnt, u64 sz, void *data, u64 stride, VkQueryResultFlags flags) {
+    return vdt_res(GetQueryPoolResults, gpu->dev, qp, first, cnt, sz, data, stride, flags);
+}
+
+// Host side reset, needs hostQueryReset. The queries must not be in use by the gpu.
+static inline void vk_reset_qp(VkQueryPool qp, u32 first, u32 cnt) {
+    vdt_void(ResetQueryPool, gpu->dev, qp, first, cnt);
 }
 
 static inline void vk_get_devq(u32 qi, VkQueue *qh) {
-    vdt_call(GetDeviceQueue)(gpu->dev, qi, 0, qh);
+    vdt_void(GetDeviceQueue, gpu->dev, qi, 0, qh);
 }
 
 static inline VkResult vk_qsub(VkQueue q, u32 cnt, VkSubmitInfo *si, VkFence fence) {
-    return cvk(vdt_call(QueueSubmit)(q, cnt, si, fence));
+    return cvk(vdt_res(QueueSubmit, q, cnt, si, fence));
 }
 
 #ifdef DEBUG
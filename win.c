@@ -3,34 +3,107 @@
 
 struct win *win;
 
-typedef typeof(win->input.read) keycode_t;
+internal struct prg_field win_fields[] = {
+    prg_field(struct win, handle),
+    prg_field(struct win, max),
+    prg_field(struct win, dim),
+    prg_field(struct win, rdim),
+    prg_field(struct win, evq),
+    prg_field(struct win, flags),
+};
+prg_layout(prg_layout_win, struct win, WIN_LAYOUT_VERSION, win_fields);
+
+typedef u16 keycode_t;
 
 keycode_t win_scancode_to_key(SDL_Scancode sc)
 {
     return (keycode_t) sc;
 }
 
-internal inline keycode_t win_input_inc(keycode_t pos)
+internal struct win_evq_block* win_evq_block(void)
 {
-    return (keycode_t) inc_and_wrap(pos, cl_array_size(win->input.buf));
+    struct win_evq_block *b = SDL_AtomicSetPtr(&win->evq.spare, NULL);
+    if (!b) {
+        b = SDL_malloc(sizeof(*b));
+        if (!b) return NULL;
+    }
+    b->next = NULL;
+    b->write = 0;
+    return b;
 }
 
-internal int win_kb_add(struct window_input ki)
+internal int win_evq_push(struct window_input *ev)
 {
-    keycode_t w = win_input_inc(win->input.write);
-    if (w == win->input.read) return -1;
+    struct win_evq_block *t = win->evq.tail;
+    if (t->write == WIN_EVQ_BLOCK_SIZE) {
+        struct win_evq_block *b = win_evq_block();
+        if (!b) {
+            log_error("Failed to grow the window event queue");
+            return -1;
+        }
+        SDL_MemoryBarrierRelease();
+        t->next = b;
+        win->evq.tail = t = b;
+    }
+    t->buf[t->write] = *ev;
+    SDL_MemoryBarrierRelease();
+    t->write = t->write + 1;
     
-    win->input.buf[w] = ki;
-    win->input.write = w;
+    rec_event(ev);
     return 0;
 }
 
+internal int win_evq_flush_hover(void)
+{
+    if (!win->evq.hovering)
+        return 0;
+    win->evq.hovering = false;
+    return win_evq_push(&win->evq.hover);
+}
+
+internal int win_evq_add(struct window_input *ev)
+{
+    if (prg->rec.flags & REC_REPLAY)
+        return 0; // only the replay drives input
+    
+    if (ev->type == WIN_INPUT_MOTION && !ev->motion.button_state) {
+        if (win->evq.hovering) {
+            struct offset_s32 mov = win->evq.hover.motion.mov;
+            win->evq.hover = *ev;
+            win->evq.hover.motion.mov = OFFSET_OP(mov, ev->motion.mov, +, s32);
+        } else {
+            win->evq.hover = *ev;
+            win->evq.hovering = true;
+        }
+        return 0;
+    }
+    if (win_evq_flush_hover())
+        return -1;
+    return win_evq_push(ev);
+}
+
 def_create_win(create_win)
 {
     win->dim.w = INIT_WIN_W;
     win->dim.h = INIT_WIN_H;
+    if (prg->rec.flags & REC_REPLAY)
+        win->dim = prg->rec.hdr.dim;
     win->rdim.w = 1.0f / win->dim.w;
     win->rdim.h = 1.0f / win->dim.h;
+    
+    win->evq.head = win->evq.tail = win_evq_block();
+    if (!win->evq.head) {
+        log_error("Failed to allocate window event queue");
+        return -1;
+    }
+    
+    // create_prg sets it up front for the world, a reload that lost it does not
+    if (!win->max.w && win_query_max())
+        return -1;
+    
+    if (prg->flags & PRG_HEADLESS)
+        return 0;
+    
     win->handle = SDL_CreateWindow("Window Title",
                                    SDL_WINDOWPOS_CENTERED,
                                    SDL_WINDOWPOS_CENTERED,
@@ -42,6 +115,23 @@ def_create_win(create_win)
         return -1;
     }
     
+    return 0;
+}
+
+def_win_query_max(win_query_max)
+{
+    // the world active region is sized from this, so a replay needs the recorded one
+    if (prg->rec.flags & REC_REPLAY) {
+        win->max = prg->rec.hdr.max;
+        return 0;
+    }
+    
+    // no window, but the world is still sized by its dimensions
+    if (prg->flags & PRG_HEADLESS) {
+        win->max = EXTENT(INIT_WIN_W, INIT_WIN_H, u16);
+        return 0;
+    }
+    
     SDL_DisplayMode dm;
     if (SDL_GetDesktopDisplayMode(0, &dm)) {
         log_error("Failed to get screen extent");
@@ -49,7 +139,6 @@ def_create_win(create_win)
     }
     win->max.w = (u16)dm.w;
     win->max.h = (u16)dm.h;
-    
     return 0;
 }
 
@@ -71,21 +160,15 @@ def_win_create_surf(win_create_surf)
 
 def_win_poll(win_poll)
 {
-    win->flags &= ~WIN_SZ;
-    
-    memset(&win->mouse.current_motion.mov, 0, sizeof(win->mouse.current_motion.mov));
-    for(u32 i=0; i <  cl_array_size(win->mouse.current_button.buttons); ++i) {
-        if (win->mouse.current_button.buttons[i] == RELEASE)
-            win->mouse.current_button.buttons[i] = 0x0;
-    }
-    
-    memset(&win->mouse.motion_buffer, 0, sizeof(win->mouse.motion_buffer));
-    memset(&win->mouse.button_buffer, 0, sizeof(win->mouse.button_buffer));
-    win->mouse.motion_buffer_size = 0;
-    win->mouse.button_buffer_size = 0;
+    win->flags &= ~(WIN_MAX|WIN_RSZ); // WIN_MIN lasts until the window comes back
     
     SDL_Event e;
-    while(SDL_PollEvent(&e) || (win->flags & WIN_MIN)) {
+    bool got = wait_ms ? SDL_WaitEventTimeout(&e, wait_ms) : SDL_PollEvent(&e);
+    for(; got; got = SDL_PollEvent(&e)) {
+        struct window_input ev;
+        ev.ms = e.common.timestamp;
+        ev.pc = SDL_GetPerformanceCounter();
+        
         switch(e.type) {
             
             case SDL_QUIT:
@@ -94,47 +177,41 @@ def_win_poll(win_poll)
             
             case SDL_KEYDOWN:
             case SDL_KEYUP: {
-                struct window_input ki;
-                ki.key = win_scancode_to_key(e.key.keysym.scancode);
-                ki.mod = e.type == SDL_KEYDOWN ? PRESS : RELEASE;
+                ev.type = WIN_INPUT_KEY;
+                ev.key = win_scancode_to_key(e.key.keysym.scancode);
+                ev.mod = e.type == SDL_KEYDOWN ? PRESS : RELEASE;
                 
-                if (e.key.keysym.mod & KMOD_CTRL) ki.mod |= CTRL;
-                if (e.key.keysym.mod & KMOD_ALT) ki.mod |= ALT;
-                if (e.key.keysym.mod & KMOD_SHIFT) ki.mod |= SHIFT;
-                if (e.key.keysym.mod & KMOD_CAPS) ki.mod |= SHIFT;
+                if (e.key.keysym.mod & KMOD_CTRL) ev.mod |= CTRL;
+                if (e.key.keysym.mod & KMOD_ALT) ev.mod |= ALT;
+                if (e.key.keysym.mod & KMOD_SHIFT) ev.mod |= SHIFT;
+                if (e.key.keysym.mod & KMOD_CAPS) ev.mod |= SHIFT;
                 
-                if (win_kb_add(ki)) {
-                    log_error("Window key buffer is overflowing!");
+                if (win_evq_add(&ev))
                     return -1;
-                }
             } break;
             
             case SDL_MOUSEMOTION: {
-                win->mouse.current_motion.pos.x = e.motion.x;
-                win->mouse.current_motion.pos.y = e.motion.y;
-                win->mouse.current_motion.mov.x = e.motion.xrel;
-                win->mouse.current_motion.mov.y = e.motion.yrel;
-                win->mouse.current_motion.button_state = e.motion.state;
-                win->mouse.current_motion.time = e.motion.timestamp;
+                ev.type = WIN_INPUT_MOTION;
+                ev.motion.pos.x = e.motion.x;
+                ev.motion.pos.y = e.motion.y;
+                ev.motion.mov.x = e.motion.xrel;
+                ev.motion.mov.y = e.motion.yrel;
+                ev.motion.button_state = e.motion.state;
                 
-                u32 i = win->mouse.motion_buffer_size;
-                win->mouse.motion_buffer[i] = win->mouse.current_motion;
-                ++win->mouse.motion_buffer_size;
+                if (win_evq_add(&ev))
+                    return -1;
             } break;
             
             case SDL_MOUSEBUTTONDOWN:
             case SDL_MOUSEBUTTONUP: {
-                u8 action = e.type == SDL_MOUSEBUTTONDOWN ? PRESS : RELEASE;
-                u32 i = win->mouse.button_buffer_size;
-                
-                win->mouse.current_button.buttons[e.button.button-1] = action;
-                win->mouse.current_button.pos.x = e.button.x;
-                win->mouse.current_button.pos.y = e.button.y;
-                win->mouse.current_button.i = e.button.button-1;
-                win->mouse.current_button.time = action;
+                ev.type = WIN_INPUT_BUTTON;
+                ev.button.pos.x = e.button.x;
+                ev.button.pos.y = e.button.y;
+                ev.button.i = (u16)(e.button.button-1);
+                ev.button.action = e.type == SDL_MOUSEBUTTONDOWN ? PRESS : RELEASE;
                 
-                win->mouse.button_buffer[i] = win->mouse.current_button;
-                ++win->mouse.button_buffer_size;
+                if (win_evq_add(&ev))
+                    return -1;
             } break;
             
             case SDL_WINDOWEVENT: {
@@ -149,16 +226,7 @@ def_win_poll(win_poll)
                     case SDL_WINDOWEVENT_MINIMIZED: {
                         win->flags &= ~WIN_SZ;
                         win->flags |= WIN_MIN;
-                        
-                        local_persist u32 pause_msg_timer = 0;
-                        if (pause_msg_timer == 0)
-                            pause_msg_timer = win_ms();
-                        
-                        if (pause_msg_timer < win_ms())
-                            pause_msg_timer += secs_to_ms(2);
-                        
                         println("Paused while minimized");
-                        os_sleep_ms(0);
                     } break;
                     
                     case SDL_WINDOWEVENT_MAXIMIZED: {
@@ -177,9 +245,14 @@ def_win_poll(win_poll)
             } break;
             
             default:
+            if (e.type == prg->fsw.event && prg->fsw.event)
+                prg->fsw.changed |= 1 << e.user.code;
             break;
         }
     }
+    if (win_evq_flush_hover())
+        return -1;
+    
     if (win->flags & WIN_RSZ) {
         SDL_GetWindowSize(win->handle, (int*)&win->dim.w, (int*)&win->dim.h);
         win->rdim.w = 1.0f / win->dim.w;
@@ -189,12 +262,39 @@ def_win_poll(win_poll)
     return 0;
 }
 
-def_win_kb_next(win_kb_next)
+def_win_push(win_push)
+{
+    return win_evq_push(ev);
+}
+
+def_win_drain(win_drain)
 {
-    if (win->input.read == win->input.write) return false;
-    win->input.read = win_input_inc(win->input.read);
-    *ki = win->input.buf[win->input.read];
-    return true;
+    u32 cnt = 0;
+    while(cnt < max) {
+        struct win_evq_block *h = win->evq.head;
+        u32 w = h->write;
+        SDL_MemoryBarrierAcquire();
+        
+        if (win->evq.read < w) {
+            u32 n = w - win->evq.read;
+            if (n > max - cnt) n = max - cnt;
+            memcpy(evs + cnt, h->buf + win->evq.read, sizeof(*evs) * n);
+            win->evq.read += n;
+            cnt += n;
+            continue;
+        }
+        
+        struct win_evq_block *next = h->next;
+        SDL_MemoryBarrierAcquire();
+        if (w < WIN_EVQ_BLOCK_SIZE || !next)
+            break;
+        
+        win->evq.head = next;
+        win->evq.read = 0;
+        if (!SDL_AtomicCASPtr(&win->evq.spare, NULL, h))
+            SDL_free(h);
+    }
+    return cnt;
 }
 
 // @TODO This needs to be a table index rather than a switch
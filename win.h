@@ -26,26 +26,14 @@ enum win_flags {
 
 enum {
     WIN_INPUT_KEY,
-    WIN_INPUT_MOUSE,
-};
-
-struct window_input {
-    u32 type;
-    union {
-        struct {
-            u16 key; // enum key_codes
-            u16 mod; // enum mod_flags
-        };
-    };
+    WIN_INPUT_MOTION,
+    WIN_INPUT_BUTTON,
 };
 
 struct mouse_button {
-    union {
-        u8 buttons[4];
-        struct { u8 b1,b2,b3,b4; };
-    };
     struct offset_u32 pos;
-    u32 i,time;
+    u16 i; // enum mouse_button_indices
+    u16 action; // PRESS or RELEASE
 };
 
 enum mouse_button_indices {
@@ -62,11 +50,46 @@ struct mouse_motion {
     struct offset_u32 pos;
     struct offset_s32 mov;
     u32 button_state;
-    u32 time;
 };
 
-#define KEY_BUFFER_SIZE 64
-#define MOUSE_BUFFER_SIZE 16
+struct window_input {
+    u32 type;
+    u32 ms; // sdl event timestamp
+    u64 pc; // performance counter when the event was taken from sdl
+    union {
+        struct {
+            u16 key; // enum key_codes
+            u16 mod; // enum mod_flags
+        };
+        struct mouse_motion motion;
+        struct mouse_button button;
+    };
+};
+
+#define WIN_EVQ_BLOCK_SIZE 512 /* events per queue block */
+
+struct win_evq_block {
+    struct win_evq_block *next;
+    volatile u32 write; // events published to the consumer
+    struct window_input buf[WIN_EVQ_BLOCK_SIZE];
+};
+
+// Single producer (win_poll), single consumer (win_drain) queue of linked blocks. It grows
+// instead of dropping events, and the consumer hands emptied blocks back through 'spare'.
+struct win_evq {
+    struct win_evq_block *head;
+    u32 read;
+    
+    struct win_evq_block *tail;
+    void *spare;
+    
+    // motion with no buttons held only matters for its final position, so it is merged
+    // here and published when anything else arrives or the poll ends
+    struct window_input hover;
+    bool hovering;
+};
+
+#define WIN_LAYOUT_VERSION 1 /* see struct prg_layout */
 
 struct win {
     SDL_Window *handle;
@@ -74,19 +97,7 @@ struct win {
     struct extent_u16 dim;
     struct extent_f32 rdim; // reciprocal of dim
     
-    struct {
-        u16 write,read; // buffer cursors
-        struct window_input buf[KEY_BUFFER_SIZE];
-    } input; // keyboard input ring buffer
-    
-    struct {
-        struct mouse_motion current_motion;
-        struct mouse_button current_button;
-        struct mouse_motion motion_buffer[MOUSE_BUFFER_SIZE];
-        struct mouse_button button_buffer[MOUSE_BUFFER_SIZE];
-        u32 motion_buffer_size;
-        u32 button_buffer_size;
-    } mouse;
+    struct win_evq evq;
     
     u32 flags; // enum win_flags
 };
@@ -110,20 +121,31 @@ static inline struct offset_u16 win_normalize_screen_px(struct offset_u16 p)
     return OFFSET((f32)p.x * win->rdim.w * 65535, (f32)p.y * win->rdim.h * 65535, u16);
 }
 
-#define def_create_win(name) void name(void)
+#define def_create_win(name) int name(void)
 def_create_win(create_win);
 
+// Set win->max from the display, which needs no window, so the world can be set up while
+// the window is created
+#define def_win_query_max(name) int name(void)
+def_win_query_max(win_query_max);
+
 #define def_win_inst_exts(name) void name(u32 *count, char **exts)
 def_win_inst_exts(win_inst_exts);
 
 #define def_win_create_surf(name) int name(void)
 def_win_create_surf(win_create_surf);
 
-#define def_win_poll(name) int win_poll(void)
+// Blocks for up to 'wait_ms' until the first event arrives, 0 == just take what is queued
+#define def_win_poll(name) int name(u32 wait_ms)
 def_win_poll(win_poll);
 
-#define def_win_kb_next(name) bool name(struct window_input *ki)
-def_win_kb_next(win_kb_next);
+// Queue an event as is, bypassing coalescing (used for replays)
+#define def_win_push(name) int name(struct window_input *ev)
+def_win_push(win_push);
+
+// Copies up to 'max' queued events into 'evs', returns the number copied
+#define def_win_drain(name) u32 name(struct window_input *evs, u32 max)
+def_win_drain(win_drain);
 
 #define def_win_key_to_char(name) char name(struct window_input ki)
 def_win_key_to_char(win_key_to_char);
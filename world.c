@@ -1,6 +1,18 @@
 #include "world.h"
 
-#define WORLD_FILE_URI "world.bin"
+internal struct prg_field world_fields[] = {
+    prg_field(struct world, tick),
+    prg_field(struct world, quiet),
+    prg_field(struct world, checksum),
+    prg_field(struct world, war),
+    prg_field(struct world, dcm),
+    prg_field(struct world, cow),
+    prg_field(struct world, saver),
+    prg_field(struct world, player),
+    prg_field(struct world, jrnl),
+    prg_field(struct world, editor),
+};
+prg_layout(prg_layout_world, struct world, WORLD_LAYOUT_VERSION, world_fields);
 
 inline_fn struct offset_u32 world_war_midpoint(void)
 {
@@ -39,9 +51,9 @@ inline_fn struct offset_u32 world_chunk_i_to_ofs(u32 i) {
                   ((i / world->war.dim.w) + (world->war.dim.h - world->war.ofs.y)) % world->war.dim.h, u32);
 }
 
-// chunk coordinates to a chunk reference
+// chunk coordinates to a chunk reference, for reading (writers go through world_chunk_write)
 inline_fn struct world_chunk* world_chunk_from_war(struct offset_u32 p) {
-    return &world->war.chunks[world_chunk_i(p)];
+    return world->war.chunks[world_chunk_i(p)];
 }
 
 // war coordinates to the coordinates of its parent chunk
@@ -65,65 +77,793 @@ inline_fn struct offset_u32 world_chunk_to_screen_px(struct offset_u32 c_pos) {
                   (c_pos.y - c_beg.y) * WAR_CHUNK_DIM_H - (e_beg.y % WAR_CHUNK_DIM_H), u32);
 }
 
-// draw a circle of radius world.editor.brush_width centred on war coordinates
-internal struct offset_u32* world_pos_to_elems(struct offset_u32 pos, u32 *cnt)
+/**************************************************************************/
+// Snapshots
+
+internal void world_chunk_release(struct world_chunk *c)
 {
-    u32 h = pos.x;
-    u32 k = pos.y;
-    f32 r = (f32)world->editor.brush_width / 2;
-    struct offset_u32 *ret = salloc(MT, sizeof(*ret) * (u32)ceilf(r) * (u32)ceilf(r));
-    *cnt = fill_circle(r, h, k, ret);
-    return ret;
+    if (--c->ref)
+        return;
+    c->next_free = world->cow.free;
+    world->cow.free = c;
 }
 
-// travel from 'pos' to 'pos + mov', stepping by radius 'world.editor.brush_width', and drawing a circle
-// at each step whose centre lies on 'mov', and whose radius is also 'world.editor.brush_width'
-internal struct offset_u32* world_mov_to_elems(struct offset_u32 pos, struct offset_s32 mov, u32 *cnt)
+// The live chunk at chunk coordinates 'p', made private first if a published table shares it.
+// Chunks are only copied once between publishes, so the cost follows how much of the world changes.
+internal struct world_chunk* world_chunk_write(struct offset_u32 p)
 {
-    struct offset_s32 p1 = OFFSET((s32)pos.x, (s32)pos.y, s32);
-    struct offset_s32 p2 = OFFSET((s32)pos.x + mov.x, (s32)pos.y + mov.y, s32);
+    u32 i = world_chunk_i(p);
+    struct world_chunk *c = world->war.chunks[i];
+    if (c->ref == 1)
+        return c;
     
-    u32 l = (u32)sqrtf((f32)((p2.x-p1.x)*(p2.x-p1.x) + (p2.y-p1.y)*(p2.y-p1.y)));
-    struct offset_u32 *ret = salloc(MT, sizeof(*ret) * world->editor.brush_width * l);
+    struct world_chunk *n = world->cow.free;
+    if (n) {
+        world->cow.free = n->next_free;
+    } else {
+        n = mem_alloc(&world->cow.pool, sizeof(*n));
+        if (!n) {
+            log_error("Failed to copy chunk %u for writing, readers may see a partial edit", (u64)i);
+            return c;
+        }
+        world->cow.copies++;
+    }
+    memcpy(n->elem, c->elem, sizeof(c->elem));
+    n->ref = 1;
+    c->ref--; // a published table still has it
     
-    *cnt = 0;
-    f32 r = (f32)world->editor.brush_width / 2;
+    world->war.chunks[i] = n;
+    world->dcm.chunks[world->dcm.size++] = i;
+    return n;
+}
+
+// Pin the latest published table. Never blocks, publishing skips a table while it is pinned.
+internal struct world_gen* world_snap_acquire(void)
+{
+    while(1) {
+        u32 i = SDL_AtomicGet(&world->cow.snap);
+        struct world_gen *g = &world->cow.gen[i];
+        SDL_AtomicIncRef(&g->readers);
+        if ((u32)SDL_AtomicGet(&world->cow.snap) == i)
+            return g;
+        SDL_AtomicDecRef(&g->readers); // published over while pinning, a reader can only trust the latest
+    }
+}
+
+internal void world_snap_release(struct world_gen *g)
+{
+    SDL_AtomicDecRef(&g->readers);
+}
+
+#define WORLD_STROKE_STEP 4.0f /* max length in elements of a flattened curve piece */
+
+internal int world_stroke_emit(struct world_stroke_pt p)
+{
+    if (world->editor.stroke.pt_cnt == world->editor.stroke.pt_cap) {
+        u32 cap = world->editor.stroke.pt_cap ? world->editor.stroke.pt_cap * 2 : 256;
+        void *pts = SDL_realloc(world->editor.stroke.pts, sizeof(p) * cap);
+        if (!pts) {
+            log_error("Failed to grow stroke point buffer to %u points", (u64)cap);
+            return -1;
+        }
+        world->editor.stroke.pts = pts;
+        world->editor.stroke.pt_cap = cap;
+    }
+    world->editor.stroke.pts[world->editor.stroke.pt_cnt++] = p;
+    return 0;
+}
+
+// blend 'a' (at knot 'ta') and 'b' (at knot 'tb') at 't'
+internal struct world_stroke_pt world_stroke_mix(struct world_stroke_pt a, struct world_stroke_pt b,
+                                                 f64 ta, f64 tb, f64 t)
+{
+    f32 f = (f32)((t - ta) / (tb - ta));
+    return (struct world_stroke_pt) {.x = a.x + (b.x - a.x) * f, .y = a.y + (b.y - a.y) * f, .t = t};
+}
+
+// Flatten the catmull-rom segment p1 -> p2 into the polyline. The knots are centripetal,
+// spaced by the square root of the distance between points, which keeps the curve from
+// overshooting or looping where the mouse speeds up or turns sharply. Event times are no use
+// here, as events polled together share a timestamp.
+// (Barry-Goldman's pyramid evaluation, p1 itself was already emitted.)
+internal void world_stroke_segment(struct world_stroke_pt p0, struct world_stroke_pt p1,
+                                   struct world_stroke_pt p2, struct world_stroke_pt p3)
+{
+    f32 dx = p2.x - p1.x;
+    f32 dy = p2.y - p1.y;
+    u32 n = (u32)ceilf(sqrtf(dx*dx + dy*dy) / WORLD_STROKE_STEP);
+    if (n == 0) n = 1;
+    if (n > 256) n = 256;
+    
+    for(u32 i=1; i <= n; ++i) {
+        f64 t = p1.t + (p2.t - p1.t) * i / n;
+        struct world_stroke_pt a1 = world_stroke_mix(p0, p1, p0.t, p1.t, t);
+        struct world_stroke_pt a2 = world_stroke_mix(p1, p2, p1.t, p2.t, t);
+        struct world_stroke_pt a3 = world_stroke_mix(p2, p3, p2.t, p3.t, t);
+        struct world_stroke_pt b1 = world_stroke_mix(a1, a2, p0.t, p2.t, t);
+        struct world_stroke_pt b2 = world_stroke_mix(a2, a3, p1.t, p3.t, t);
+        if (world_stroke_emit(world_stroke_mix(b1, b2, p1.t, p2.t, t)))
+            return;
+    }
+}
+
+// draw the segment between the 2nd and 3rd newest control points, or the last one when 'end'
+internal void world_stroke_draw(bool end)
+{
+    struct world_stroke_pt *c = world->editor.stroke.ctl;
+    u32 n = world->editor.stroke.ctl_cnt;
+    
+    // the segment runs c[i] -> c[i+1], missing neighbours are extrapolated
+    s32 i = end ? (s32)n - 2 : (s32)n - 3;
+    if (i < 0) return;
     
-    if (p1.y > p2.y)
-        swap(p1,p2);
+    struct world_stroke_pt p1 = c[i];
+    struct world_stroke_pt p2 = c[i+1];
+    struct world_stroke_pt p0 = i > 0 ? c[i-1] : (struct world_stroke_pt){p1.x, p1.y, p1.t - (p2.t - p1.t)};
+    struct world_stroke_pt p3 = (u32)i + 2 < n ? c[i+2] : (struct world_stroke_pt){p2.x, p2.y, p2.t + (p2.t - p1.t)};
+    world_stroke_segment(p0, p1, p2, p3);
+}
+
+// points arrive in event queue order, which is all the ordering the curve needs
+internal void world_stroke_add(struct offset_u32 screen_pos)
+{
+    struct offset_u32 pos = world_screen_pos_to_elem(screen_pos);
+    struct world_stroke_pt p = {
+        .x = (f32)pos.x + 0.5f, // element centre
+        .y = (f32)pos.y + 0.5f,
+    };
     
-    if (p1.x == p2.x) {
-        for(u32 i = p1.y; i < (u32)p2.y; ++i)
-            *cnt += fill_circle(r, p1.x, i, ret + *cnt);
-    } else if (p1.y == p2.y) {
-        if (p1.x > p2.x)
-            swap(p1, p2);
-        for(u32 i = p1.x; i < (u32)p2.x; ++i)
-            *cnt += fill_circle(r, i, p1.y, ret + *cnt);
+    struct world_stroke_pt *c = world->editor.stroke.ctl;
+    u32 *n = &world->editor.stroke.ctl_cnt;
+    
+    if (*n == 0) {
+        world_jrnl_begin();
+        c[(*n)++] = p;
+        world_stroke_emit(p);
+        return;
     }
     
-    struct offset_s32 vec = OFFSET(p2.x - p1.x, p2.y - p1.y, s32);
-    float f = (f32)(r * r) / (vec.x*vec.x + vec.y*vec.y);
-    f32 sh_x = vec.x * f;
-    f32 sh_y = vec.y * f;
+    if (p.x == c[*n-1].x && p.y == c[*n-1].y)
+        return;
     
-    if (sh_x > 0) {
-        for(f32 k = (f32)p1.y, h = (f32)p1.x;
-            k < (f32)p2.y && h < (f32)p2.x;
-            k += sh_y, h += sh_x)
-        {
-            *cnt += fill_circle(r, (u32)h, (u32)k, ret + *cnt);
-        }
+    // |dp|^0.5, never 0 as repeated positions were dropped above
+    f32 dx = p.x - c[*n-1].x, dy = p.y - c[*n-1].y;
+    p.t = c[*n-1].t + sqrt(sqrt((f64)dx*dx + (f64)dy*dy));
+    
+    if (*n == cl_array_size(world->editor.stroke.ctl)) {
+        memmove(c, c + 1, sizeof(*c) * (*n - 1));
+        --*n;
+    }
+    c[(*n)++] = p;
+    world_stroke_draw(false);
+}
+
+/**************************************************************************/
+// Undo journal
+
+internal void world_jrnl_io(u64 off, void *p, u32 n, bool write)
+{
+    u64 i = off % world->jrnl.size;
+    u32 first = n < world->jrnl.size - i ? n : (u32)(world->jrnl.size - i);
+    if (write) {
+        memcpy(world->jrnl.buf + i, p, first);
+        memcpy(world->jrnl.buf, (u8*)p + first, n - first);
     } else {
-        for(f32 k = (f32)p1.y, h = (f32)p1.x;
-            k < (f32)p2.y && h > (f32)p2.x;
-            k += sh_y, h += sh_x)
+        memcpy(p, world->jrnl.buf + i, first);
+        memcpy((u8*)p + first, world->jrnl.buf, n - first);
+    }
+}
+
+internal u32 world_jrnl_type(u64 off)
+{
+    struct world_jrnl_rec r;
+    world_jrnl_io(off, &r, sizeof(r), false);
+    return r.type;
+}
+
+// Make room for 'n' more bytes by dropping the oldest edits. When only the edit being
+// recorded is left it is dropped too, and the rest of it goes unrecorded.
+internal bool world_jrnl_reserve(u32 n)
+{
+    if (world->jrnl.overflow)
+        return false;
+    
+    while(world->jrnl.end + n - world->jrnl.beg > world->jrnl.size) {
+        if (world->jrnl.beg >= world->jrnl.group) {
+            log_error("Edit is larger than the undo budget (%umb), it cannot be undone",
+                      (u64)(world->jrnl.size / mb(1)));
+            world->jrnl.beg = world->jrnl.cur = world->jrnl.end = world->jrnl.group;
+            world->jrnl.overflow = true;
+            return false;
+        }
+        do {
+            struct world_jrnl_rec r;
+            world_jrnl_io(world->jrnl.beg, &r, sizeof(r), false);
+            world->jrnl.beg += r.size;
+        } while(world->jrnl.beg < world->jrnl.group && world_jrnl_type(world->jrnl.beg) != WORLD_JRNL_GROUP);
+    }
+    return true;
+}
+
+internal void world_jrnl_append(struct world_jrnl_rec *r, u64 wr)
+{
+    r->size = (u32)(wr + sizeof(r->size) - world->jrnl.end);
+    world_jrnl_io(world->jrnl.end, r, sizeof(*r), true);
+    world_jrnl_io(wr, &r->size, sizeof(r->size), true);
+    world->jrnl.end = world->jrnl.cur = wr + sizeof(r->size);
+}
+
+// start a new undoable edit, which throws away anything that could have been redone
+internal void world_jrnl_begin(void)
+{
+    if (!world->jrnl.buf)
+        return;
+    
+    world->jrnl.end = world->jrnl.cur;
+    u32 sz = sizeof(struct world_jrnl_rec) + sizeof(u32);
+    if (world->jrnl.end - world->jrnl.beg >= sz && world->jrnl.end - sz == world->jrnl.group && !world->jrnl.overflow)
+        return; // the last edit changed nothing, reuse it
+    
+    world->jrnl.group = world->jrnl.end;
+    world->jrnl.overflow = false;
+    if (!world_jrnl_reserve(sz))
+        return;
+    
+    struct world_jrnl_rec r = {.type = WORLD_JRNL_GROUP};
+    world_jrnl_append(&r, world->jrnl.end + sizeof(r));
+}
+
+// run length encode 'cnt' elements into the journal at '*off'
+internal u16 world_jrnl_runs(u64 *off, struct world_elem *row, u32 cnt)
+{
+    u16 runs = 0;
+    for(u32 i=0; i < cnt; ++runs) {
+        struct world_jrnl_run r = {.e = row[i], .cnt = 1};
+        while(i + r.cnt < cnt && !memcmp(&row[i + r.cnt], &r.e, sizeof(r.e)))
+            r.cnt++;
+        world_jrnl_io(*off, &r, sizeof(r), true);
+        *off += sizeof(r);
+        i += r.cnt;
+    }
+    return runs;
+}
+
+// Record the 'cnt' elements at 'row' (within one chunk) around a write to them:
+// span_beg before the write takes the old values, span_end after takes the new.
+internal void world_jrnl_span_beg(u32 y, u32 x, struct world_elem *row, u32 cnt)
+{
+    world->jrnl.rec.cnt = 0;
+    if (!world->jrnl.buf || !world_jrnl_reserve(sizeof(world->jrnl.rec) + sizeof(struct world_jrnl_run) * cnt * 2 + sizeof(u32)))
+        return;
+    
+    world->jrnl.rec = (struct world_jrnl_rec) {.type = WORLD_JRNL_SPAN, .y = y, .x = x, .cnt = (u16)cnt};
+    world->jrnl.wr = world->jrnl.end + sizeof(world->jrnl.rec);
+    world->jrnl.rec.old_runs = world_jrnl_runs(&world->jrnl.wr, row, cnt);
+}
+
+internal void world_jrnl_span_end(struct world_elem *row)
+{
+    if (!world->jrnl.rec.cnt)
+        return;
+    world->jrnl.rec.new_runs = world_jrnl_runs(&world->jrnl.wr, row, world->jrnl.rec.cnt);
+    world_jrnl_append(&world->jrnl.rec, world->jrnl.wr);
+}
+
+// write a span record's old or new values back into its chunk
+internal void world_jrnl_apply(u64 off, bool redo)
+{
+    struct world_jrnl_rec r;
+    world_jrnl_io(off, &r, sizeof(r), false);
+    
+    struct offset_u32 p = OFFSET(r.x, r.y, u32);
+    struct world_elem *row = world_elem_from_chunk(world_chunk_write(world_elem_to_chunk(p)), p);
+    
+    u64 rd = off + sizeof(r) + (redo ? sizeof(struct world_jrnl_run) * r.old_runs : 0);
+    for(u32 i = redo ? r.new_runs : r.old_runs; i; --i) {
+        struct world_jrnl_run run;
+        world_jrnl_io(rd, &run, sizeof(run), false);
+        rd += sizeof(run);
+        
+        __m128i v = _mm_loadu_si128((__m128i*)&run.e);
+        for(u32 j=0; j < run.cnt; ++j)
+            _mm_storeu_si128((__m128i*)row++, v);
+    }
+}
+
+internal void world_undo(void)
+{
+    while(world->jrnl.cur > world->jrnl.beg) {
+        u32 size;
+        world_jrnl_io(world->jrnl.cur - sizeof(size), &size, sizeof(size), false);
+        world->jrnl.cur -= size;
+        
+        if (world_jrnl_type(world->jrnl.cur) == WORLD_JRNL_GROUP)
+            break;
+        world_jrnl_apply(world->jrnl.cur, false);
+    }
+}
+
+internal void world_redo(void)
+{
+    if (world->jrnl.cur == world->jrnl.end)
+        return;
+    
+    // step over the group record, then apply until the next one
+    do {
+        struct world_jrnl_rec r;
+        world_jrnl_io(world->jrnl.cur, &r, sizeof(r), false);
+        if (r.type == WORLD_JRNL_SPAN)
+            world_jrnl_apply(world->jrnl.cur, true);
+        world->jrnl.cur += r.size;
+    } while(world->jrnl.cur < world->jrnl.end && world_jrnl_type(world->jrnl.cur) != WORLD_JRNL_GROUP);
+}
+
+/**************************************************************************/
+// Editing
+
+// fill elements [x0, x1) of war row 'y' with 'e', a chunk row at a time
+internal void world_fill_span(u32 y, u32 x0, u32 x1, struct world_elem *e)
+{
+    __m128i v = _mm_loadu_si128((__m128i*)e);
+    u32 cy = y / WAR_CHUNK_DIM_H;
+    
+    while(x0 < x1) {
+        u32 cx = x0 / WAR_CHUNK_DIM_W;
+        u32 end = (cx + 1) * WAR_CHUNK_DIM_W;
+        if (end > x1) end = x1;
+        
+        struct world_chunk *c = world_chunk_write(OFFSET(cx, cy, u32));
+        __m128i *row = (__m128i*)&c->elem[world_elem_chunk_y(y)][world_elem_chunk_x(x0)];
+        
+        world_jrnl_span_beg(y, x0, (struct world_elem*)row, end - x0);
+        for(u32 i=0; i < end - x0; ++i)
+            _mm_storeu_si128(row + i, v);
+        world_jrnl_span_end((struct world_elem*)row);
+        
+        x0 = end;
+    }
+}
+
+// narrow [*x0, *x1] to where a * x + c lies in [lo, hi]
+internal bool world_slab(f32 a, f32 c, f32 lo, f32 hi, f32 *x0, f32 *x1)
+{
+    if (a == 0)
+        return c >= lo && c <= hi;
+    f32 p = (lo - c) / a;
+    f32 q = (hi - c) / a;
+    if (p > q) swap(p, q);
+    if (p > *x0) *x0 = p;
+    if (q < *x1) *x1 = q;
+    return *x0 <= *x1;
+}
+
+// The elements of the row with centre 'yc' that lie within 'r' of the segment a -> b,
+// as an inclusive range. The capsule is convex, so this is the union of the row's
+// intersections with the two end discs and with the body.
+internal bool world_capsule_row(struct world_stroke_pt a, struct world_stroke_pt b, f32 r, f32 yc,
+                                s32 *ex0, s32 *ex1)
+{
+    f32 lo = 1e30f, hi = -1e30f;
+    
+    struct world_stroke_pt ends[] = {a, b};
+    for(u32 i=0; i < cl_array_size(ends); ++i) {
+        f32 d = yc - ends[i].y;
+        if (d*d > r*r)
+            continue;
+        f32 hw = sqrtf(r*r - d*d);
+        if (ends[i].x - hw < lo) lo = ends[i].x - hw;
+        if (ends[i].x + hw > hi) hi = ends[i].x + hw;
+    }
+    
+    // body: the projection onto the segment is inside it and the distance from it is within r
+    f32 dx = b.x - a.x, dy = b.y - a.y;
+    f32 l2 = dx*dx + dy*dy;
+    if (l2 > 0) {
+        f32 rl = r * sqrtf(l2);
+        f32 u0 = -1e30f, u1 = 1e30f; // relative to a.x
+        if (world_slab(dx, (yc - a.y) * dy, 0, l2, &u0, &u1) &&
+            world_slab(dy, -(yc - a.y) * dx, -rl, rl, &u0, &u1))
         {
-            *cnt += fill_circle(r, (u32)h, (u32)k, ret + *cnt);
+            if (a.x + u0 < lo) lo = a.x + u0;
+            if (a.x + u1 > hi) hi = a.x + u1;
+        }
+    }
+    
+    if (lo > hi)
+        return false;
+    
+    // an element is covered when its centre is
+    *ex0 = (s32)ceilf(lo - 0.5f);
+    *ex1 = (s32)floorf(hi - 0.5f);
+    return *ex0 <= *ex1;
+}
+
+#define WORLD_ROW_SPANS 32 /* disjoint spans merged per row before they are written */
+
+struct world_span {
+    s32 x0, x1; // inclusive
+};
+
+// write a row's spans, except for the inclusive range c0..c1 that is already covered
+internal void world_fill_spans(s32 y, struct world_span *spans, u32 n, s32 c0, s32 c1)
+{
+    for(u32 l=0; l < n; ++l) {
+        s32 x0 = spans[l].x0, x1 = spans[l].x1;
+        if (c0 > c1 || c1 < x0 || c0 > x1) {
+            world_fill_span(y, x0, x1 + 1, &world->editor.elem);
+            continue;
+        }
+        if (x0 < c0)
+            world_fill_span(y, x0, c0, &world->editor.elem);
+        if (x1 > c1)
+            world_fill_span(y, c1 + 1, x1 + 1, &world->editor.elem);
+    }
+}
+
+// Rasterise this frame's polyline as the union of capsules around its segments. Each row
+// merges the segments' spans, so every element is written once, and the spans go straight
+// into the chunks without any intermediate coverage memory.
+internal void world_stroke_raster(void)
+{
+    struct world_stroke_pt *pts = world->editor.stroke.pts;
+    u32 cnt = world->editor.stroke.pt_cnt;
+    bool carried = world->editor.stroke.carried;
+    if (!cnt) return;
+    
+    // a held button that has not moved adds nothing, only a fresh press stamps a lone disc
+    if (carried && cnt == 1) {
+        if (!world->editor.stroke.ctl_cnt) {
+            world->editor.stroke.pt_cnt = 0;
+            world->editor.stroke.carried = false;
+        }
+        return;
+    }
+    
+    f32 r = (f32)world->editor.brush_width / 2;
+    
+    f32 by0 = pts[0].y, by1 = pts[0].y;
+    for(u32 i=1; i < cnt; ++i) {
+        if (pts[i].y < by0) by0 = pts[i].y;
+        if (pts[i].y > by1) by1 = pts[i].y;
+    }
+    
+    // only visible elements are editable
+    struct offset_u32 min = world_first_visible_elem();
+    struct offset_u32 max = world_first_hidden_elem();
+    s32 y0 = (s32)floorf(by0 - r), y1 = (s32)ceilf(by1 + r);
+    if (y0 < (s32)min.y) y0 = min.y;
+    if (y1 > (s32)max.y) y1 = max.y;
+    
+    u32 seg_cnt = cnt > 1 ? cnt - 1 : 1; // a lone point is a zero length segment
+    struct world_span spans[WORLD_ROW_SPANS];
+    
+    for(s32 y = y0; y < y1; ++y) {
+        f32 yc = (f32)y + 0.5f;
+        u32 n = 0;
+        
+        // the carried point's disc was written by the last raster
+        s32 c0 = 1, c1 = 0;
+        if (carried)
+            world_capsule_row(pts[0], pts[0], r, yc, &c0, &c1);
+        
+        for(u32 i=0; i < seg_cnt; ++i) {
+            struct world_stroke_pt a = pts[i];
+            struct world_stroke_pt b = pts[i + (cnt > 1)];
+            if ((a.y < yc - r && b.y < yc - r) || (a.y > yc + r && b.y > yc + r))
+                continue;
+            
+            struct world_span s;
+            if (!world_capsule_row(a, b, r, yc, &s.x0, &s.x1))
+                continue;
+            if (s.x0 < (s32)min.x) s.x0 = min.x;
+            if (s.x1 >= (s32)max.x) s.x1 = max.x - 1;
+            if (s.x0 > s.x1)
+                continue;
+            
+            // merge into the sorted disjoint set, touching spans join up
+            u32 j = 0;
+            while(j < n && spans[j].x1 + 1 < s.x0) ++j;
+            u32 k = j;
+            for(; k < n && spans[k].x0 <= s.x1 + 1; ++k) {
+                if (spans[k].x0 < s.x0) s.x0 = spans[k].x0;
+                if (spans[k].x1 > s.x1) s.x1 = spans[k].x1;
+            }
+            
+            if (k == j) {
+                if (n == WORLD_ROW_SPANS) {
+                    // rows crossed this many times can afford a few elements written twice
+                    world_fill_spans(y, spans, n, c0, c1);
+                    n = j = 0;
+                }
+                memmove(spans + j + 1, spans + j, sizeof(*spans) * (n - j));
+                ++n;
+            } else {
+                memmove(spans + j + 1, spans + k, sizeof(*spans) * (n - k));
+                n -= k - j - 1;
+            }
+            spans[j] = s;
         }
+        
+        world_fill_spans(y, spans, n, c0, c1);
     }
     
-    return ret;
+    // carry the last point over so next frame's polyline joins up with this one
+    pts[0] = pts[cnt-1];
+    world->editor.stroke.pt_cnt = world->editor.stroke.ctl_cnt ? 1 : 0;
+    world->editor.stroke.carried = world->editor.stroke.ctl_cnt != 0;
+}
+
+internal void world_stroke_end(void)
+{
+    world_stroke_draw(true);
+    world->editor.stroke.ctl_cnt = 0;
+    
+    // raster now, a stroke started later in the frame must not join up with this one
+    world_stroke_raster();
+}
+
+inline_fn bool world_elem_same(struct world_elem *a, struct world_elem *b)
+{
+    return a->type == b->type && !memcmp(&a->col, &b->col, sizeof(a->col));
+}
+
+// Walk row 'y' from 'x' in direction 'dir' while elements match 't', staying inside [lo, hi].
+// Returns the last matching x. The chunk is only looked up again when the walk crosses into the next one.
+internal s32 world_fill_run(s32 x, u32 y, s32 dir, s32 lo, s32 hi, struct world_elem *t)
+{
+    struct world_chunk *c = world_chunk_from_war(OFFSET(x / WAR_CHUNK_DIM_W, y / WAR_CHUNK_DIM_H, u32));
+    u32 ey = world_elem_chunk_y(y);
+    
+    for(s32 nx = x + dir; nx >= lo && nx <= hi; nx += dir) {
+        if (world_elem_chunk_x(nx) == (dir > 0 ? 0 : WAR_CHUNK_DIM_W - 1))
+            c = world_chunk_from_war(OFFSET(nx / WAR_CHUNK_DIM_W, y / WAR_CHUNK_DIM_H, u32));
+        if (!world_elem_same(&c->elem[ey][world_elem_chunk_x(nx)], t))
+            break;
+        x = nx;
+    }
+    return x;
+}
+
+inline_fn bool world_fill_match(s32 x, u32 y, struct world_elem *t)
+{
+    struct offset_u32 p = OFFSET(x, y, u32);
+    return world_elem_same(world_elem_from_chunk(world_chunk_from_war(world_elem_to_chunk(p)), p), t);
+}
+
+#define WORLD_FILL_STACK 16384 /* pending spans, a screen sized cavern needs a few hundred */
+
+// row 'y' was filled over [x0, x1], row 'y + dy' still has to be looked at
+struct world_fill_seg {
+    s32 y, x0, x1, dy;
+};
+
+// Replace the region connected to 'pos' that matches its material and colour with world.editor.elem.
+// Span based scanline fill (Heckbert's), bounded to the world active region, and the pending
+// spans live in a fixed size stack instead of recursing per element.
+internal void world_fill(struct offset_u32 pos)
+{
+    struct world_elem t = *world_elem_from_chunk(world_chunk_from_war(world_elem_to_chunk(pos)), pos);
+    if (world_elem_same(&t, &world->editor.elem))
+        return;
+    
+    world_jrnl_begin();
+    
+    s32 xlo = 0, xhi = world->war.dim.w * WAR_CHUNK_DIM_W - 1;
+    s32 ylo = 0, yhi = world->war.dim.h * WAR_CHUNK_DIM_H - 1;
+    
+    struct world_fill_seg *stack = salloc(prg_ti, sizeof(*stack) * WORLD_FILL_STACK);
+    u32 sp = 0;
+    bool overflow = false;
+    
+    #define world_fill_push(py, px0, px1, pdy) do { \
+        if ((py) + (pdy) < ylo || (py) + (pdy) > yhi) break; \
+        if (sp < WORLD_FILL_STACK) \
+            stack[sp++] = (struct world_fill_seg) {.y = (py), .x0 = (px0), .x1 = (px1), .dy = (pdy)}; \
+        else \
+            overflow = true; \
+    } while(0)
+    
+    world_fill_push((s32)pos.y, (s32)pos.x, (s32)pos.x, 1);
+    world_fill_push((s32)pos.y + 1, (s32)pos.x, (s32)pos.x, -1);
+    
+    while(sp) {
+        struct world_fill_seg s = stack[--sp];
+        s32 y = s.y + s.dy;
+        s32 x = s.x0;
+        
+        // a run through x0 may extend left past the parent span, which leaks back upwards
+        if (world_fill_match(x, y, &t)) {
+            s32 l = world_fill_run(x, y, -1, xlo, xhi, &t);
+            s32 r = world_fill_run(x, y, 1, xlo, xhi, &t);
+            world_fill_span(y, l, r + 1, &world->editor.elem);
+            
+            if (l < s.x0) world_fill_push(y, l, s.x0 - 1, -s.dy);
+            world_fill_push(y, l, r, s.dy);
+            if (r > s.x1) world_fill_push(y, s.x1 + 1, r, -s.dy);
+            x = r + 1;
+        }
+        
+        while(x <= s.x1) {
+            for(; x <= s.x1 && !world_fill_match(x, y, &t); ++x);
+            if (x > s.x1)
+                break;
+            
+            s32 r = world_fill_run(x, y, 1, xlo, xhi, &t);
+            world_fill_span(y, x, r + 1, &world->editor.elem);
+            
+            world_fill_push(y, x, r, s.dy);
+            if (r > s.x1) world_fill_push(y, s.x1 + 1, r, -s.dy);
+            x = r + 1;
+        }
+    }
+    #undef world_fill_push
+    
+    if (overflow)
+        log_error("Fill region too complex, stopped after %u pending spans", (u64)WORLD_FILL_STACK);
+}
+
+// copy 'cnt' 16 byte elements, four at a time
+internal inline void world_copy_elems(struct world_elem *dst, struct world_elem *src, u32 cnt)
+{
+    __m128i *d = (__m128i*)dst;
+    __m128i *s = (__m128i*)src;
+    u32 i = 0;
+    for(; i + 4 <= cnt; i += 4) {
+        __m128i a = _mm_loadu_si128(s + i + 0);
+        __m128i b = _mm_loadu_si128(s + i + 1);
+        __m128i c = _mm_loadu_si128(s + i + 2);
+        __m128i e = _mm_loadu_si128(s + i + 3);
+        _mm_storeu_si128(d + i + 0, a);
+        _mm_storeu_si128(d + i + 1, b);
+        _mm_storeu_si128(d + i + 2, c);
+        _mm_storeu_si128(d + i + 3, e);
+    }
+    for(; i < cnt; ++i)
+        _mm_storeu_si128(d + i, _mm_loadu_si128(s + i));
+}
+
+// Copy elements [x0, x1) of war row 'y' to or from 'buf', a chunk row at a time, so
+// the copy does not care how the buffer lines up with the chunk grid.
+internal void world_copy_row(u32 y, u32 x0, u32 x1, struct world_elem *buf, bool to_world, u32 type_mask)
+{
+    u32 cy = y / WAR_CHUNK_DIM_H;
+    
+    while(x0 < x1) {
+        u32 cx = x0 / WAR_CHUNK_DIM_W;
+        u32 end = (cx + 1) * WAR_CHUNK_DIM_W;
+        if (end > x1) end = x1;
+        
+        struct world_chunk *c = to_world ? world_chunk_write(OFFSET(cx, cy, u32)) : world_chunk_from_war(OFFSET(cx, cy, u32));
+        struct world_elem *row = &c->elem[world_elem_chunk_y(y)][world_elem_chunk_x(x0)];
+        u32 cnt = end - x0;
+        
+        if (!to_world) {
+            world_copy_elems(buf, row, cnt);
+        } else {
+            world_jrnl_span_beg(y, x0, row, cnt);
+            if (type_mask == Max_u32) {
+                world_copy_elems(row, buf, cnt);
+            } else {
+                for(u32 i=0; i < cnt; ++i) {
+                    if (type_mask & (1 << buf[i].type))
+                        _mm_storeu_si128((__m128i*)(row + i), _mm_loadu_si128((__m128i*)(buf + i)));
+                }
+            }
+            world_jrnl_span_end(row);
+        }
+        
+        buf += cnt;
+        x0 = end;
+    }
+}
+
+// the selection as a half open rectangle, clipped to the world active region
+internal bool world_sel_rect(struct offset_u32 *beg, struct offset_u32 *end)
+{
+    if (!world->editor.sel.active)
+        return false;
+    
+    struct offset_u32 a = world->editor.sel.beg;
+    struct offset_u32 b = world->editor.sel.end;
+    *beg = OFFSET(a.x < b.x ? a.x : b.x, a.y < b.y ? a.y : b.y, u32);
+    *end = OFFSET((a.x > b.x ? a.x : b.x) + 1, (a.y > b.y ? a.y : b.y) + 1, u32);
+    
+    u32 w = world->war.dim.w * WAR_CHUNK_DIM_W;
+    u32 h = world->war.dim.h * WAR_CHUNK_DIM_H;
+    if (end->x > w) end->x = w;
+    if (end->y > h) end->y = h;
+    return beg->x < end->x && beg->y < end->y;
+}
+
+internal void world_copy(void)
+{
+    struct offset_u32 beg, end;
+    if (!world_sel_rect(&beg, &end)) {
+        println("Nothing selected to copy");
+        return;
+    }
+    
+    struct extent_u32 dim = EXTENT(end.x - beg.x, end.y - beg.y, u32);
+    if (dim.w * dim.h > world->editor.clip.cap) {
+        void *elems = SDL_realloc(world->editor.clip.elems, sizeof(struct world_elem) * dim.w * dim.h);
+        if (!elems) {
+            log_error("Failed to allocate clipboard for %ux%u elements", (u64)dim.w, (u64)dim.h);
+            return;
+        }
+        world->editor.clip.elems = elems;
+        world->editor.clip.cap = dim.w * dim.h;
+    }
+    
+    world->editor.clip.dim = dim;
+    for(u32 y=0; y < dim.h; ++y)
+        world_copy_row(beg.y + y, beg.x, end.x, world->editor.clip.elems + y * dim.w, false, 0);
+    
+    println("COPY : %ux%u", (u64)dim.w, (u64)dim.h);
+}
+
+// paste the clipboard centred on 'pos', skipping element types outside clip.type_mask
+internal void world_stamp(struct offset_u32 pos)
+{
+    struct extent_u32 dim = world->editor.clip.dim;
+    if (!dim.w || !dim.h)
+        return;
+    
+    world_jrnl_begin();
+    
+    s32 x0 = (s32)pos.x - (s32)dim.w / 2;
+    s32 y0 = (s32)pos.y - (s32)dim.h / 2;
+    s32 x1 = x0 + dim.w;
+    s32 y1 = y0 + dim.h;
+    
+    // clip to the world active region, keeping track of where the source rows start
+    u32 sx = x0 < 0 ? -x0 : 0;
+    u32 sy = y0 < 0 ? -y0 : 0;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > (s32)(world->war.dim.w * WAR_CHUNK_DIM_W)) x1 = world->war.dim.w * WAR_CHUNK_DIM_W;
+    if (y1 > (s32)(world->war.dim.h * WAR_CHUNK_DIM_H)) y1 = world->war.dim.h * WAR_CHUNK_DIM_H;
+    
+    for(s32 y = y0; y < y1; ++y) {
+        struct world_elem *src = world->editor.clip.elems + (sy + y - y0) * dim.w + sx;
+        world_copy_row(y, x0, x1, src, true, world->editor.clip.type_mask);
+    }
+}
+
+// Hash a chunk's bytes, four independent lanes so the multiplies overlap
+internal u64 world_chunk_hash(struct world_chunk *c, u64 seed)
+{
+    u64 k = 0x9E3779B97F4A7C15ull;
+    u64 h[4] = {seed * k, (seed + 1) * k, (seed + 2) * k, (seed + 3) * k};
+    u64 *w = (u64*)c->elem;
+    
+    for(u32 i=0; i < sizeof(c->elem) / sizeof(*w); i += 4) {
+        for(u32 j=0; j < 4; ++j) {
+            h[j] = (h[j] ^ w[i+j]) * k;
+            h[j] ^= h[j] >> 29;
+        }
+    }
+    u64 r = h[0] ^ (h[1] << 16 | h[1] >> 48) ^ (h[2] << 32 | h[2] >> 32) ^ (h[3] << 48 | h[3] >> 16);
+    r ^= r >> 31;
+    return r * k;
+}
+
+// Sum of every war chunk's hash, seeded by its position rather than its slot in the array.
+// A sum doesn't care about order, so threads can each add up their own chunks.
+internal void world_checksum(void)
+{
+    if (!world->checksum)
+        return;
+    
+    u64 sum = 0;
+    u32 wcc = world->war.dim.w * world->war.dim.h;
+    for(u32 i=0; i < wcc; ++i) {
+        struct offset_u32 p = world_chunk_i_to_ofs(i);
+        sum += world_chunk_hash(world->war.chunks[i], (u64)p.y << 32 | p.x);
+    }
+    
+    char buf[64];
+    u32 len = SDL_snprintf(buf, sizeof(buf), "%llu %016llx\n", (unsigned long long)world->tick, (unsigned long long)sum);
+    SDL_RWwrite(world->checksum, buf, 1, len);
 }
 
 // just a random flashing point for now
@@ -142,115 +882,398 @@ internal void world_update_player_col(void)
     col[i] += dir;
 }
 
-// load chunks from the world file
+// load chunks from the world file, if it was saved for an active region like this one
 internal void world_load(void)
 {
-    return;
+    // recordings start from an empty world, so they replay the same whatever is on disk
+    if (prg->rec.flags & (REC_RECORD|REC_REPLAY))
+        return;
+    
+    SDL_RWops *f = SDL_RWFromFile(WORLD_FILE_URI, "rb");
+    if (!f)
+        return; // nothing saved yet
+    
+    struct world_file_header h;
+    u32 wcc = world->war.dim.w * world->war.dim.h;
+    if (SDL_RWread(f, &h, sizeof(h), 1) != 1 || h.magic != WORLD_FILE_MAGIC || h.version != WORLD_FILE_VERSION) {
+        log_error("%s is not a version %u world file, starting empty", WORLD_FILE_URI, (u64)WORLD_FILE_VERSION);
+    } else if (h.dim.w != world->war.dim.w || h.dim.h != world->war.dim.h || h.ofs.x != world->war.ofs.x || h.ofs.y != world->war.ofs.y) {
+        log_error("%s was saved for a %ux%u chunk active region, this one is %ux%u, starting empty",
+                  WORLD_FILE_URI, (u64)h.dim.w, (u64)h.dim.h, (u64)world->war.dim.w, (u64)world->war.dim.h);
+    } else {
+        // every table still shares every chunk, so loading the live ones loads them all
+        u32 i = 0;
+        for(; i < wcc && SDL_RWread(f, world->war.chunks[i]->elem, sizeof(world->war.chunks[i]->elem), 1) == 1; ++i);
+        if (i < wcc)
+            log_error("%s is truncated, loaded %u of %u chunks", WORLD_FILE_URI, (u64)i, (u64)wcc);
+        world->tick = h.tick;
+    }
+    SDL_RWclose(f);
 }
 
-// write chunks to the world file
-internal void world_save(void)
+// Writes the snapshot it was handed while the simulation carries on. Publishing rotates through
+// the other tables until the snapshot is released.
+internal int world_saver(void *data)
 {
-    return;
+    struct world_gen *g = &world->cow.gen[world->saver.gen];
+    struct world_file_header *h = &world->saver.hdr;
+    u32 wcc = h->dim.w * h->dim.h;
+    u64 pc = SDL_GetPerformanceCounter();
+    
+    int res = -1;
+    SDL_RWops *f = SDL_RWFromFile(WORLD_FILE_URI, "wb");
+    if (f) {
+        u32 i = 0;
+        if (SDL_RWwrite(f, h, sizeof(*h), 1) == 1)
+            for(; i < wcc && SDL_RWwrite(f, g->chunks[i]->elem, sizeof(g->chunks[i]->elem), 1) == 1; ++i);
+        res = i < wcc ? -1 : 0;
+        SDL_RWclose(f);
+        SDL_AtomicSet(&world->saver.wrote, 1);
+    }
+    world_snap_release(g);
+    
+    if (res)
+        log_error("Failed to save the world to %s - %s", WORLD_FILE_URI, SDL_GetError());
+    else
+        println("World saved at tick %u in %fms", h->tick, (f64)prg_ns_since(pc) / 1e6);
+    SDL_AtomicSet(&world->saver.done, 1);
+    return res;
 }
 
-// edit the elements between 'pos' and 'pos + mov' using the world.editor config
-internal void world_edit_elem(struct offset_u32 pos, struct offset_s32 mov)
+def_world_await_save(world_await_save)
 {
-    struct offset_u32 min = world_first_visible_elem();
-    struct offset_u32 max = world_first_hidden_elem();
+    if (!world->saver.thread)
+        return;
+    SDL_WaitThread(world->saver.thread, NULL);
+    world->saver.thread = NULL;
+}
+
+def_world_file_changed(world_file_changed)
+{
+    // the debounce can split a long save into several reports, the last one comes after the close
+    if (world->saver.thread && !SDL_AtomicGet(&world->saver.done))
+        return false;
+    return !SDL_AtomicSet(&world->saver.wrote, 0);
+}
+
+// write the latest published snapshot to the world file in the background
+internal void world_save(void)
+{
+    if (world->saver.thread && !SDL_AtomicGet(&world->saver.done)) {
+        println("Still saving the world");
+        return;
+    }
+    world_await_save();
     
-    u32 cnt;
-    struct offset_u32 *arr;
-    if (mov.x || mov.y)
-        arr = world_mov_to_elems(pos, mov, &cnt);
-    else
-        arr = world_pos_to_elems(pos, &cnt);
+    struct world_gen *g = world_snap_acquire();
+    world->saver.gen = g - world->cow.gen;
+    world->saver.hdr = (struct world_file_header) {
+        .magic = WORLD_FILE_MAGIC,
+        .version = WORLD_FILE_VERSION,
+        .dim = world->war.dim,
+        .ofs = world->war.ofs,
+        .tick = g->tick,
+    };
+    SDL_AtomicSet(&world->saver.done, 0);
     
-    for(u32 i = 0; i < cnt; ++i) {
-        struct offset_u32 e_pos = arr[i];
-        
-        if (e_pos.x < min.x || e_pos.x >= max.x ||
-            e_pos.y < min.y || e_pos.y >= max.y)
-        {
-            continue;
-        }
-        
-        struct offset_u32 c_pos = world_elem_to_chunk(e_pos);
-        struct world_chunk *c = world_chunk_from_war(c_pos);
-        struct world_elem *e = world_elem_from_chunk(c, e_pos);
-        
-        *e = world->editor.elem;
+    world->saver.thread = SDL_CreateThread(world_saver, "world_saver", NULL);
+    if (!world->saver.thread) {
+        log_error("Failed to create world saver thread - %s", SDL_GetError());
+        world_snap_release(g);
     }
 }
 
-internal void world_handle_input(void)
+internal void world_handle_key(struct window_input ki)
 {
     u8 col_step = 10;
     
-    struct window_input ki;
-    while(win_kb_next(&ki)) { // @Todo
-        switch(ki.key) {
-            case KEY_ESCAPE: {
-                win->flags |= WIN_CLO;
-            } break;
-            
-            case KEY_S: {
-                if (ki.mod & CTRL) world_save();
-            } break;
-            
-            case KEY_R: {
-                if (ki.mod & SHIFT)
-                    world->editor.elem.col.r -= (world->editor.elem.col.r > col_step) * col_step;
-                else
-                    world->editor.elem.col.r += (world->editor.elem.col.r < Max_u8 - col_step) * col_step;
-                println("RED : %u / 255", (u64)world->editor.elem.col.r);
-            } break;
-            
-            case KEY_G: {
-                if (ki.mod & SHIFT)
-                    world->editor.elem.col.g -= (world->editor.elem.col.g > col_step) * col_step;
-                else
-                    world->editor.elem.col.g += (world->editor.elem.col.g < Max_u8 - col_step) * col_step;
-                println("GREEN : %u / 255", (u64)world->editor.elem.col.g);
-            } break;
+    if (!(ki.mod & PRESS))
+        return;
+    
+    switch(ki.key) {
+        case KEY_ESCAPE: {
+            // this can run on the worker, so go through the event queue rather than win->flags
+            SDL_Event e = {.type = SDL_QUIT};
+            SDL_PushEvent(&e);
+        } break;
+        
+        case KEY_F2: {
+            // this can run on the worker, the toggle is applied by the main thread's vdt_frame
+            vdt_request_instr(!(vdt->flags & VDT_INSTR));
+        } break;
+        
+        case KEY_F3: {
+            if (!gpu->dev)
+                break;
+            u32 pm = gpu->pm.cur;
+            do pm = (pm + 1) % GPU_PM_CNT; while(!(gpu->pm.supported & (1 << pm)));
+            gpu_request_present_mode(pm);
+        } break;
+        
+        case KEY_F: {
+            if (world->editor.stroke.ctl_cnt)
+                world_stroke_end();
+            world->editor.tool = world->editor.tool == WORLD_TOOL_FILL ? WORLD_TOOL_BRUSH : WORLD_TOOL_FILL;
+            println("TOOL : %s", world->editor.tool == WORLD_TOOL_FILL ? "fill" : "brush");
+        } break;
+        
+        case KEY_C: {
+            if (ki.mod & CTRL) world_copy();
+        } break;
+        
+        case KEY_V: {
+            if (!(ki.mod & CTRL))
+                break;
+            if (world->editor.stroke.ctl_cnt)
+                world_stroke_end();
             
-            case KEY_B: {
-                if (ki.mod & SHIFT)
-                    world->editor.elem.col.b -= (world->editor.elem.col.b > col_step) * col_step;
-                else
-                    world->editor.elem.col.b += (world->editor.elem.col.b < Max_u8 - col_step) * col_step;
-                println("BLUE : %u / 255", (u64)world->editor.elem.col.b);
-            } break;
+            // with shift, empty space in the clipboard leaves the world alone
+            world->editor.clip.type_mask = ki.mod & SHIFT ? ~(1u << WEM_TYPE_VOID) : Max_u32;
+            world->editor.tool = world->editor.tool == WORLD_TOOL_STAMP ? WORLD_TOOL_BRUSH : WORLD_TOOL_STAMP;
+            println("TOOL : %s", world->editor.tool == WORLD_TOOL_STAMP ? "stamp" : "brush");
+        } break;
+        
+        case KEY_Z:
+        case KEY_Y: {
+            if (!(ki.mod & CTRL))
+                break;
             
-            case KEY_MINUS: {
-                if (ki.mod & SHIFT)
-                    world->editor.brush_width -= (world->editor.brush_width > 1);
-                else
-                    world->editor.brush_width += (world->editor.brush_width < 250);
-            } break;
+            // finish whatever is being drawn so it is part of the history first
+            if (world->editor.stroke.ctl_cnt)
+                world_stroke_end();
             
-            default: break;
+            if (ki.key == KEY_Y || (ki.mod & SHIFT))
+                world_redo();
+            else
+                world_undo();
+        } break;
+        
+        case KEY_S: {
+            if (ki.mod & CTRL) world_save();
+        } break;
+        
+        case KEY_R: {
+            if (ki.mod & SHIFT)
+                world->editor.elem.col.r -= (world->editor.elem.col.r > col_step) * col_step;
+            else
+                world->editor.elem.col.r += (world->editor.elem.col.r < Max_u8 - col_step) * col_step;
+            println("RED : %u / 255", (u64)world->editor.elem.col.r);
+        } break;
+        
+        case KEY_G: {
+            if (ki.mod & SHIFT)
+                world->editor.elem.col.g -= (world->editor.elem.col.g > col_step) * col_step;
+            else
+                world->editor.elem.col.g += (world->editor.elem.col.g < Max_u8 - col_step) * col_step;
+            println("GREEN : %u / 255", (u64)world->editor.elem.col.g);
+        } break;
+        
+        case KEY_B: {
+            if (ki.mod & SHIFT)
+                world->editor.elem.col.b -= (world->editor.elem.col.b > col_step) * col_step;
+            else
+                world->editor.elem.col.b += (world->editor.elem.col.b < Max_u8 - col_step) * col_step;
+            println("BLUE : %u / 255", (u64)world->editor.elem.col.b);
+        } break;
+        
+        case KEY_MINUS: {
+            if (ki.mod & SHIFT)
+                world->editor.brush_width -= (world->editor.brush_width > 1);
+            else
+                world->editor.brush_width += (world->editor.brush_width < 250);
+        } break;
+        
+        default: break;
+    }
+}
+
+#define WORLD_INPUT_BATCH 64 /* events taken from the window queue at a time */
+
+// returns the number of events handled
+internal u32 world_handle_input(void)
+{
+    struct window_input evs[WORLD_INPUT_BATCH];
+    u32 cnt, tot = 0;
+    while((cnt = win_drain(evs, cl_array_size(evs)))) {
+        tot += cnt;
+        for(u32 i=0; i < cnt; ++i) {
+            switch(evs[i].type) {
+                case WIN_INPUT_KEY: {
+                    world_handle_key(evs[i]);
+                } break;
+                
+                case WIN_INPUT_MOTION: {
+                    struct mouse_motion *m = &evs[i].motion;
+                    if (is_mouse_button_pressed(m->button_state, MOUSE_BUTTON_3) && world->editor.sel.active)
+                        world->editor.sel.end = world_screen_pos_to_elem(m->pos);
+                    
+                    if (world->editor.tool != WORLD_TOOL_BRUSH)
+                        break;
+                    
+                    if (is_mouse_button_pressed(m->button_state, MOUSE_BUTTON_1))
+                        world_stroke_add(m->pos);
+                    else if (world->editor.stroke.ctl_cnt)
+                        world_stroke_end();
+                } break;
+                
+                case WIN_INPUT_BUTTON: {
+                    struct mouse_button *b = &evs[i].button;
+                    if (b->i == MOUSE_BUTTON_3) {
+                        struct offset_u32 pos = world_screen_pos_to_elem(b->pos);
+                        if (b->action == PRESS) {
+                            world->editor.sel.beg = pos;
+                            world->editor.sel.active = true;
+                        }
+                        world->editor.sel.end = pos;
+                        break;
+                    }
+                    if (b->i != MOUSE_BUTTON_1)
+                        break;
+                    
+                    if (world->editor.tool == WORLD_TOOL_FILL) {
+                        if (b->action == PRESS) {
+                            world_stroke_raster(); // keep edits in order
+                            world_fill(world_screen_pos_to_elem(b->pos));
+                        }
+                    } else if (world->editor.tool == WORLD_TOOL_STAMP) {
+                        if (b->action == PRESS) {
+                            world_stroke_raster();
+                            world_stamp(world_screen_pos_to_elem(b->pos));
+                        }
+                    } else if (b->action == PRESS) {
+                        world_stroke_add(b->pos);
+                    } else {
+                        world_stroke_add(b->pos);
+                        world_stroke_end();
+                    }
+                } break;
+                
+                default: break;
+            }
         }
     }
-    if (win->mouse.motion_buffer_size > 0) {
-        for(u32 i=0; i < win->mouse.motion_buffer_size; ++i) {
-            if (is_mouse_button_pressed(win->mouse.motion_buffer[i].button_state, MOUSE_BUTTON_1)) {
-                struct offset_u32 pos = world_screen_pos_to_elem(win->mouse.motion_buffer[i].pos);
-                struct offset_s32 mov = OFFSET(win->mouse.motion_buffer[i].mov.x,
-                                               win->mouse.motion_buffer[i].mov.y, s32);
-                pos = OFFSET_OP(pos, mov, -, u32);
-                world_edit_elem(pos, mov);
+    return tot;
+}
+
+/**************************************************************************/
+// Page size benchmark
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// counts this thread's dtlb load misses from when it is opened, -1 when perf events are not
+// allowed (see kernel.perf_event_paranoid)
+internal int world_bench_tlb_open(void)
+{
+    struct perf_event_attr pa = {
+        .type = PERF_TYPE_HW_CACHE,
+        .size = sizeof(pa),
+        .config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    return (int)syscall(SYS_perf_event_open, &pa, 0, -1, -1, 0);
+}
+
+internal u64 world_bench_tlb_read(int fd)
+{
+    u64 n = 0;
+    if (fd >= 0 && read(fd, &n, sizeof(n)) != sizeof(n))
+        n = 0;
+    return n;
+}
+
+#define world_bench_tlb_close(fd) do { if ((fd) >= 0) close(fd); } while(0)
+#else
+// windows only exposes the pmu through etw with admin rights, so no counts there
+#define world_bench_tlb_open() -1
+#define world_bench_tlb_read(fd) 0
+#define world_bench_tlb_close(fd)
+#endif
+
+internal volatile u64 world_bench_sink;
+
+// The two ways the simulation walks the war: along rows, and down columns the way elements
+// fall. A column of the whole region crosses a 4kb page every other element row, and with
+// a few dozen chunks down a screen it is far more pages than the tlb holds.
+internal void world_bench_scan(struct world_chunk *chunks, struct extent_u32 dim, bool columns)
+{
+    u64 sum = 0;
+    if (columns) {
+        for(u32 cx=0; cx < dim.w; ++cx) {
+            for(u32 x=0; x < WAR_CHUNK_DIM_W; ++x) {
+                for(u32 cy=0; cy < dim.h; ++cy) {
+                    for(u32 y=0; y < WAR_CHUNK_DIM_H; ++y)
+                        sum += chunks[cy * dim.w + cx].elem[y][x].state;
+                }
+            }
+        }
+    } else {
+        for(u32 i=0; i < dim.w * dim.h; ++i) {
+            for(u32 y=0; y < WAR_CHUNK_DIM_H; ++y) {
+                for(u32 x=0; x < WAR_CHUNK_DIM_W; ++x)
+                    sum += chunks[i].elem[y][x].state;
             }
         }
-    } else if (win->mouse.button_buffer_size > 0) {
-        for(u32 i=0; i < win->mouse.button_buffer_size; ++i) {
-            if (win->mouse.button_buffer[i].b1 == PRESS) {
-                struct offset_u32 pos = world_screen_pos_to_elem(win->mouse.button_buffer[i].pos);
-                world_edit_elem(pos, OFFSET(0,0,s32));
+    }
+    world_bench_sink = sum;
+}
+
+def_world_bench_pages(world_bench_pages)
+{
+    struct extent_u32 screens[] = {
+        EXTENT(1920, 1080, u32),
+        EXTENT(2560, 1440, u32),
+        EXTENT(3840, 2160, u32),
+    };
+    char *order[] = {"rows", "columns"};
+    
+    int fd = world_bench_tlb_open();
+#ifdef __linux__
+    char *no_tlb = " (no dtlb miss counter, check kernel.perf_event_paranoid)";
+#else
+    char *no_tlb = " (no dtlb miss counter on this platform, times only)";
+#endif
+    println("\nActive region scans by page size, average of %u%s", (u64)WORLD_BENCH_ROUNDS, fd < 0 ? no_tlb : "");
+    
+    for(u32 i=0; i < cl_array_size(screens); ++i) {
+        // sized the same way create_world sizes the war from the screen
+        struct extent_u32 dim = EXTENT((screens[i].w * 2 + WAR_CHUNK_DIM_W - 1) / WAR_CHUNK_DIM_W,
+                                       (screens[i].h * 2 + WAR_CHUNK_DIM_H - 1) / WAR_CHUNK_DIM_H, u32);
+        u64 size = (u64)dim.w * dim.h * sizeof(struct world_chunk);
+        
+        for(u32 p=0; p < MEM_PAGES_CNT; ++p) {
+            u32 got;
+            struct world_chunk *chunks = mem_alloc_pages(size, p, &got);
+            if (!chunks) {
+                log_error("Failed to allocate %fmb for the page size benchmark", (f64)size / mb(1));
+                continue;
+            }
+            memset(chunks, 0, size); // fault everything in before anything is timed
+            
+            for(u32 o=0; o < cl_array_size(order); ++o) {
+                world_bench_scan(chunks, dim, o);
+                
+                u64 misses = world_bench_tlb_read(fd);
+                u64 pc = SDL_GetPerformanceCounter();
+                for(u32 r=0; r < WORLD_BENCH_ROUNDS; ++r)
+                    world_bench_scan(chunks, dim, o);
+                u64 ns = prg_ns_since(pc) / WORLD_BENCH_ROUNDS;
+                misses = (world_bench_tlb_read(fd) - misses) / WORLD_BENCH_ROUNDS;
+                
+                char tlb[32] = "";
+                if (fd >= 0)
+                    SDL_snprintf(tlb, sizeof(tlb), ", %llu dtlb misses", (unsigned long long)misses);
+                println("  %ux%u screen, %fmb, huge pages %s (%s asked for), %s: %fms%s",
+                        (u64)screens[i].w, (u64)screens[i].h, (f64)size / mb(1), mem_pages_names[got],
+                        mem_pages_names[p], order[o], (f64)ns / 1e6, tlb);
             }
+            mem_free_pages(chunks, size);
         }
     }
+    world_bench_tlb_close(fd);
 }
 
 /**************************************************************************/
@@ -259,41 +1282,163 @@ def_create_world(create_world)
 {
     memset(world, 0, sizeof(*world));
     
-    world->fd = create_fd(WORLD_FILE_URI, CREATE_FD_READ|CREATE_FD_WRITE);
-    
     world->war.dim.w = win->max.w * 2 / WAR_CHUNK_DIM_W + (win->max.w * 2 / WAR_CHUNK_DIM_W > 0);
     world->war.dim.h = win->max.h * 2 / WAR_CHUNK_DIM_H + (win->max.h * 2 % WAR_CHUNK_DIM_H > 0);
     
     u32 wcc = world->war.dim.w * world->war.dim.h;
     
-    u64 war_size = wcc * (sizeof(*world->war.chunks));
+    struct world_gen *gen = world->cow.gen;
+    
+    u64 war_size = wcc * (sizeof(struct world_chunk) + sizeof(*world->war.chunks));
     u64 dcm_size = wcc * (sizeof(*world->dcm.chunks) + sizeof(*world->dcm.maps));
+    u64 gen_size = wcc * WORLD_GENS * (sizeof(*gen->chunks) + sizeof(*gen->stale) + sizeof(*gen->is_stale));
     
     println("\nWorld active region memory requirements (%ux%u screen)", (u64)win->max.w, (u64)win->max.h);
     println("  war chunk array:   %fmb", (f64)war_size / mb(1));
     println("  dynamic chunk map: %fmb", (f64)dcm_size / mb(1));
+    println("  snapshot tables:   %fmb (plus a chunk per chunk written between frames)", (f64)gen_size / mb(1));
     
-    world->war.chunks = palloc(MT, war_size + dcm_size);
-    world->dcm.chunks = (typeof(world->dcm.chunks))(world->war.chunks + wcc);
-    world->dcm.maps = (typeof(world->dcm.maps))(world->dcm.chunks + wcc);
+    // Everything here is walked every frame, which is where huge pages save the most tlb misses
+    u32 pages = mem_pages_wanted();
+    
+    // 16 byte aligned members first
+    struct world_chunk *chunks = mem_alloc_pages(war_size + dcm_size + gen_size, pages, &world->war.pages);
+    if (!chunks) {
+        log_error("Failed to allocate world active region");
+        return -1;
+    }
+    println("  huge pages:        %s (%s asked for)", mem_pages_names[world->war.pages], mem_pages_names[pages]);
+    
+    // at most every chunk in every published table can be a copy at once
+    if (create_mem_arena((u64)wcc * WORLD_GENS * sizeof(struct world_chunk), pages, &world->cow.pool))
+        log_error("Failed to reserve the chunk copy pool, readers may see partial edits");
+    world->dcm.maps = (typeof(world->dcm.maps))(chunks + wcc);
+    world->war.chunks = (typeof(world->war.chunks))(world->dcm.maps + wcc);
+    for(u32 i=0; i < WORLD_GENS; ++i)
+        gen[i].chunks = world->war.chunks + wcc * (i + 1);
+    world->dcm.chunks = (typeof(world->dcm.chunks))(world->war.chunks + wcc * (WORLD_GENS + 1));
+    for(u32 i=0; i < WORLD_GENS; ++i)
+        gen[i].stale = world->dcm.chunks + wcc * (i + 1);
+    for(u32 i=0; i < WORLD_GENS; ++i)
+        gen[i].is_stale = (u8*)(world->dcm.chunks + wcc * (WORLD_GENS + 1)) + wcc * i;
+    memset(gen[0].is_stale, 0, wcc * WORLD_GENS);
+    
+    // every table starts out sharing every chunk
+    for(u32 i=0; i < wcc; ++i) {
+        chunks[i].ref = WORLD_GENS + 1;
+        world->war.chunks[i] = &chunks[i];
+        for(u32 j=0; j < WORLD_GENS; ++j)
+            gen[j].chunks[i] = &chunks[i];
+    }
+    SDL_AtomicSet(&world->cow.snap, 0);
     
     world->player.pos = OFFSET(WORLD_DIM_W / 2, WORLD_DIM_H / 2, u32);
     
+    char *checksum = SDL_getenv(WORLD_ENV_CHECKSUM);
+    if (checksum) {
+        world->checksum = SDL_RWFromFile(checksum, "wb");
+        if (!world->checksum)
+            log_error("Failed to open checksum output %s - %s", checksum, SDL_GetError());
+    }
+    
+    char *undo_mb = SDL_getenv(WORLD_ENV_UNDO_MB);
+    world->jrnl.size = undo_mb && SDL_atoi(undo_mb) >= 0 ? mb((u64)SDL_atoi(undo_mb)) : WORLD_JRNL_BUDGET;
+    if (world->jrnl.size) {
+        world->jrnl.buf = palloc(MT, world->jrnl.size);
+        if (!world->jrnl.buf) {
+            log_error("Failed to allocate %umb undo journal, editing without history", (u64)(world->jrnl.size / mb(1)));
+            world->jrnl.size = 0;
+        }
+    }
+    
     world->editor.elem.col = RGBA(255,255,255,255);
     world->editor.brush_width = 1;
     world->editor.elem.type = WEM_TYPE_ROCK;
     world->editor.elem.state = WEM_STATE_NONE;
     
+    world_load();
+    
     return 0;
 }
 
 def_world_update(world_update)
+{
+    u32 evs = world_handle_input();
+    world_stroke_raster();
+    
+    // @Todo also count chunks with falling or burning elements once dcm.maps are filled in
+    if (evs || world->editor.stroke.ctl_cnt || world->dcm.size)
+        world->quiet = 0;
+    else if (world->quiet < Max_u32)
+        world->quiet++;
+    return 0;
+}
+
+def_world_asleep(world_asleep)
+{
+    return world->quiet >= WORLD_SLEEP_FRAMES;
+}
+
+def_world_tick(world_tick)
+{
+    // an asleep world only gets a frame every PRG_IDLE_MS, so the flash would just stutter
+    if (!world_asleep())
+        world_update_player_col();
+    
+    world_checksum();
+    world->tick++;
+    return 0;
+}
+
+// Publishing goes into the oldest table that is neither the latest nor pinned, so readers are
+// never disturbed. If every other table is pinned, this publish is skipped and the chunks carry
+// over to the next one.
+def_world_publish(world_publish)
+{
+    struct world_gen *latest = &world->cow.gen[SDL_AtomicGet(&world->cow.snap)];
+    struct world_gen *g = NULL;
+    for(u32 i=0; i < WORLD_GENS; ++i) {
+        struct world_gen *s = &world->cow.gen[i];
+        if (s != latest && !SDL_AtomicGet(&s->readers) && (!g || s->tick < g->tick))
+            g = s;
+    }
+    
+    for(u32 i=0; i < WORLD_GENS; ++i) {
+        struct world_gen *s = &world->cow.gen[i];
+        for(u32 j=0; j < world->dcm.size; ++j) {
+            u32 ci = world->dcm.chunks[j];
+            if (s->is_stale[ci])
+                continue;
+            s->is_stale[ci] = 1;
+            s->stale[s->stale_cnt++] = ci;
+        }
+    }
+    world->dcm.size = 0;
+    
+    if (!g)
+        return;
+    
+    for(u32 j=0; j < g->stale_cnt; ++j) {
+        u32 ci = g->stale[j];
+        world_chunk_release(g->chunks[ci]);
+        g->chunks[ci] = world->war.chunks[ci];
+        g->chunks[ci]->ref++;
+        g->is_stale[ci] = 0;
+    }
+    g->stale_cnt = 0;
+    g->tick = world->tick;
+    
+    SDL_AtomicSet(&world->cow.snap, g - world->cow.gen);
+}
+
+// Reads the latest published table rather than the live one, so it does not care what the
+// simulation is doing to the world meanwhile.
+def_world_draw(world_draw)
 {
     timed_trigger(frame_time_trigger, false, secs_to_ms(2));
     create_timer(frame_timer);
     
-    world_update_player_col();
-    world_handle_input();
+    struct world_gen *g = world_snap_acquire();
     
     gpu_add_draw_elem(world->player.col, OFFSET(65535 / 2, 65535 / 2, u16));
     
@@ -326,7 +1471,7 @@ def_world_update(world_update)
         if (c_pos.y == c_beg.y)
             e_ofs.y = col_beg_y;
         
-        struct world_chunk *c = &world->war.chunks[ci];
+        struct world_chunk *c = g->chunks[ci];
         for(u32 j = e_ofs.y; j < e_ext.h; ++j) {
             for(u32 i = e_ofs.x; i < e_ext.w; ++i) {
                 if (c->elem[j][i].type != WEM_TYPE_ROCK)
@@ -340,8 +1485,12 @@ def_world_update(world_update)
         }
     }
     
-    if (frame_time_trigger && REPORT_FRAME_TIME)
-        check_timer(frame_timer, "Time to update world: ");
+    world_snap_release(g);
+    
+    if (frame_time_trigger && REPORT_FRAME_TIME) {
+        check_timer(frame_timer, "Time to draw world: ");
+        println("  world chunk copies: %u, drawn from tick %u", (u64)world->cow.copies, g->tick);
+    }
     
     return 0;
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 #define WORLD_H
 
 #include "../solh/sol.h"
+#include "rng.h"
+#include "mem.h"
 
 enum world_elem_types {
     WEM_TYPE_VOID,
@@ -30,19 +32,96 @@ struct world_elem {
 
 struct world_chunk {
     struct world_elem elem[WAR_CHUNK_DIM_H][WAR_CHUNK_DIM_W];
+    u32 ref; // chunk tables pointing at this chunk, live and published
+    struct world_chunk *next_free;
+};
+
+#define WORLD_GENS 3 /* the renderer alternates between two, the saver can hold the third as long as it needs */
+
+// A published copy of the war chunk table. The tables share chunks with each other and with
+// the live table, and the simulation copies a chunk the first time it writes to one that a
+// published table still points at, so a table never changes under a reader.
+struct world_gen {
+    struct world_chunk **chunks;
+    u64 tick; // world->tick when published
+    SDL_atomic_t readers;
+    
+    u32 *stale; // chunk indices whose entry is behind the live table
+    u32 stale_cnt;
+    u8 *is_stale;
+};
+
+enum world_editor_tools {
+    WORLD_TOOL_BRUSH,
+    WORLD_TOOL_FILL,
+    WORLD_TOOL_STAMP,
+};
+
+// a point on the brush stroke, in war coordinates, at curve parameter 't'
+struct world_stroke_pt {
+    f32 x,y;
+    f64 t;
+};
+
+#define WORLD_FILE_URI "world.bin"
+#define WORLD_FILE_MAGIC 0x444c5257 /* "WRLD" */
+#define WORLD_FILE_VERSION 1
+
+// followed by the elements of every war chunk in chunk index order
+struct world_file_header {
+    u32 magic;
+    u32 version;
+    struct extent_u32 dim; // war chunks
+    struct offset_u32 ofs;
+    u64 tick;
+};
+#define WORLD_ENV_CHECKSUM "PRG_CHECKSUM" /* file to write a hash of the world active region to every tick */
+
+#define WORLD_SLEEP_FRAMES 30 /* quiet frames before the world counts as asleep */
+
+#define WORLD_JRNL_BUDGET mb(16) /* undo history size, oldest edits are dropped to stay inside it */
+#define WORLD_ENV_UNDO_MB "PRG_UNDO_MB" /* overrides WORLD_JRNL_BUDGET, 0 == no undo history */
+
+#define WORLD_ENV_BENCH_PAGES "PRG_BENCH_PAGES" /* set to time active region scans on each page size and exit */
+#define WORLD_BENCH_ROUNDS 8
+
+enum world_jrnl_rec_types {
+    WORLD_JRNL_GROUP, // starts one undoable edit
+    WORLD_JRNL_SPAN,
+};
+
+// Journal record, followed by run length encoded old values, then new values, then the record
+// size again so the journal can be walked backwards. Spans never cross a chunk.
+struct world_jrnl_rec {
+    u32 type; // enum world_jrnl_rec_types
+    u32 size; // bytes including the header and trailing size
+    u32 y,x; // war coordinates of the first element
+    u16 cnt; // elements
+    u16 old_runs;
+    u16 new_runs;
+};
+
+struct world_jrnl_run {
+    struct world_elem e;
+    u32 cnt;
 };
 
 struct world_chunk_map {
     __m128i masks[WAR_CHUNK_DIM_H];
 };
 
+#define WORLD_LAYOUT_VERSION 1 /* see struct prg_layout */
+
 struct world {
-    os_fd fd;
+    u64 tick; // world updates so far, part of every rng counter
+    u32 quiet; // frames since there was input or a chunk changed
+    SDL_RWops *checksum;
     
     struct {
         struct extent_u32 dim; // chunks
         struct offset_u32 ofs; // chunks
-        struct world_chunk *chunks;
+        struct world_chunk **chunks; // live table, only the simulation reads and writes through it
+        u32 pages; // enum mem_pages backing the chunks, the dcm and the snapshot tables
     } war; // world active region - chunks loaded from disk
     
     struct {
@@ -51,14 +130,68 @@ struct world {
         u32 size;
     } dcm; // dynamic chunk map - array of chunks that are actively changing, e.g. falling, on fire, etc.
     
+    struct {
+        struct world_gen gen[WORLD_GENS];
+        SDL_atomic_t snap; // index into gen of the latest published table, only set by world_publish
+        struct world_chunk *free;
+        struct mem_arena pool; // where copies come from, freed ones go on 'free' instead
+        u32 copies; // chunks allocated on top of the war for copy on write
+    } cow;
+    
+    struct {
+        SDL_Thread *thread;
+        SDL_atomic_t done; // set by the thread, which is joined by the next save or world_await_save
+        u32 gen; // index into cow.gen of the table pinned until the thread is done with it
+        SDL_atomic_t wrote; // set once the file is closed, until the watcher reports the write
+        struct world_file_header hdr;
+    } saver;
+    
     struct {
         struct rgba col;
         struct offset_u32 pos;
     } player;
     
+    // Offsets only grow, and are taken modulo size to index buf. Records in [beg, cur)
+    // can be undone, records in [cur, end) redone.
+    struct {
+        u8 *buf;
+        u64 size;
+        u64 beg,cur,end;
+        u64 group; // start of the edit being recorded
+        bool overflow; // the edit being recorded outgrew the budget and is not recorded
+        
+        struct world_jrnl_rec rec; // span between world_jrnl_span_beg and world_jrnl_span_end
+        u64 wr;
+    } jrnl; // undo journal
+    
     struct {
         struct world_elem elem;
         u32 brush_width;
+        u32 tool; // enum world_editor_tools
+        
+        struct {
+            struct world_stroke_pt ctl[4]; // latest curve control points, oldest first
+            u32 ctl_cnt; // 0 == no stroke in progress
+            
+            // the curve flattened to a polyline since the last raster,
+            // pts[0] is carried over from the previous frame
+            struct world_stroke_pt *pts;
+            u32 pt_cnt;
+            u32 pt_cap;
+            bool carried; // pts[0] is the end of the last raster, its disc is already written
+        } stroke;
+        
+        struct {
+            struct offset_u32 beg, end; // war coordinates, opposite corners in any order
+            bool active;
+        } sel;
+        
+        struct {
+            struct world_elem *elems; // dim.h rows of dim.w
+            struct extent_u32 dim;
+            u32 cap; // elements
+            u32 type_mask; // types a stamp writes, bits are 1 << enum world_elem_types
+        } clip;
     } editor;
 };
 
@@ -68,8 +201,39 @@ struct world *world;
 #define def_create_world(name) int name(void)
 def_create_world(create_world);
 
+// once per frame: input and editing
 #define def_world_update(name) int name(void)
 def_world_update(world_update);
+
+// one fixed step of the simulation, SIM_TICK_HZ times a second
+#define def_world_tick(name) int name(void)
+def_world_tick(world_tick);
+
+// once per frame: hand the latest state to the gpu
+#define def_world_draw(name) int name(void)
+def_world_draw(world_draw);
+
+// nothing to simulate and no input for a while, so frames can wait on events
+#define def_world_asleep(name) bool name(void)
+def_world_asleep(world_asleep);
+
+// once per frame, after the ticks: make chunks written since the last call visible to world_draw
+#define def_world_publish(name) void name(void)
+def_world_publish(world_publish);
+
+// Times scans of large screens' active regions on each page size. Stands on its own, nothing
+// else needs to be set up first.
+#define def_world_bench_pages(name) void name(void)
+def_world_bench_pages(world_bench_pages);
+
+// a save in progress runs library code on its own thread, so wait for it before a reload
+#define def_world_await_save(name) void name(void)
+def_world_await_save(world_await_save);
+
+// the file watcher saw the world file change, false when that was our own save
+#define def_world_file_changed(name) bool name(void)
+def_world_file_changed(world_file_changed);
+
 #endif
 
 #endif // WORLD_H